@@ -6,9 +6,14 @@ LOCAL_MODULE    := pktriggercord-cli
 LOCAL_SRC_FILES := ../../pslr_enum.c \
 	../../pslr_lens.c \
 	../../pslr_model.c \
+	../../pslr_tiff.c \
 	../../pslr_scsi.c \
 	../../pslr.c \
 	../../pktriggercord-servermode.c \
+	../../pktriggercord-writer.c \
+	../../pktriggercord-checksum.c \
+	../../pktriggercord-compress.c \
+	../../pktriggercord-output.c \
 	../../pktriggercord-cli.c
 DEFINES 	:= -DANDROID -DVERSION=\"$(VERSION)\" 
 LOCAL_CFLAGS  	:= $(DEFINES) -frtti -I.. -Istlport -g 
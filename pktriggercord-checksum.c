@@ -0,0 +1,113 @@
+/*
+    pkTriggerCord
+    Copyright (C) 2011-2016 Andras Salamon <andras.salamon@melda.info>
+    Remote control of Pentax DSLR cameras.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    and GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdbool.h>
+
+#include "pktriggercord-checksum.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define CRC32C_SSE42
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define CRC32C_ARM
+#endif
+
+/* reflected polynomial 0x1edc6f41, one nibble at a time */
+static const uint32_t crc32c_nibble[16] = {
+    0x00000000, 0x105ec76f, 0x20bd8ede, 0x30e349b1,
+    0x417b1dbc, 0x5125dad3, 0x61c69362, 0x7198540d,
+    0x82f63b78, 0x92a8fc17, 0xa24bb5a6, 0xb21572c9,
+    0xc38d26c4, 0xd3d3e1ab, 0xe330a81a, 0xf36e6f75
+};
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *buf, size_t length) {
+    while (length--) {
+        crc ^= *buf++;
+        crc = (crc >> 4) ^ crc32c_nibble[crc & 15];
+        crc = (crc >> 4) ^ crc32c_nibble[crc & 15];
+    }
+    return crc;
+}
+
+#ifdef CRC32C_SSE42
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *buf, size_t length) {
+    uint64_t crc64 = crc;
+    uint64_t word;
+
+    while (length && ((uintptr_t) buf & 7)) {
+        crc64 = _mm_crc32_u8(crc64, *buf++);
+        length--;
+    }
+    while (length >= 8) {
+        __builtin_memcpy(&word, buf, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        buf += 8;
+        length -= 8;
+    }
+    while (length--) {
+        crc64 = _mm_crc32_u8(crc64, *buf++);
+    }
+    return crc64;
+}
+
+static bool crc32c_has_hw(void) {
+    static int has_hw = -1;
+    if (has_hw < 0) {
+        has_hw = __builtin_cpu_supports("sse4.2") ? 1 : 0;
+    }
+    return has_hw;
+}
+#endif
+
+#ifdef CRC32C_ARM
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *buf, size_t length) {
+    uint64_t word;
+
+    while (length && ((uintptr_t) buf & 7)) {
+        crc = __crc32cb(crc, *buf++);
+        length--;
+    }
+    while (length >= 8) {
+        __builtin_memcpy(&word, buf, 8);
+        crc = __crc32cd(crc, word);
+        buf += 8;
+        length -= 8;
+    }
+    while (length--) {
+        crc = __crc32cb(crc, *buf++);
+    }
+    return crc;
+}
+
+static bool crc32c_has_hw(void) {
+    return true;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const uint8_t *buf, size_t length) {
+    crc = ~crc;
+#if defined(CRC32C_SSE42) || defined(CRC32C_ARM)
+    if (crc32c_has_hw()) {
+        return ~crc32c_hw(crc, buf, length);
+    }
+#endif
+    return ~crc32c_sw(crc, buf, length);
+}
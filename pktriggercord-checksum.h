@@ -0,0 +1,35 @@
+/*
+    pkTriggerCord
+    Copyright (C) 2011-2016 Andras Salamon <andras.salamon@melda.info>
+    Remote control of Pentax DSLR cameras.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    and GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef PKTRIGGERCORD_CHECKSUM_H
+#define PKTRIGGERCORD_CHECKSUM_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* CRC32C (Castagnoli) of the downloaded images.
+ *
+ *   crc = crc32c(0, block1, length1);
+ *   crc = crc32c(crc, block2, length2);
+ *
+ * Uses the crc32 instruction of SSE4.2 or ARMv8 if available,
+ * otherwise a table driven implementation. */
+uint32_t crc32c(uint32_t crc, const uint8_t *buf, size_t length);
+
+#endif
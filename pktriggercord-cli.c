@@ -40,16 +40,19 @@
 #include <stdarg.h>
 #include <math.h>
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <errno.h>
+#ifndef WIN32
+#include <pthread.h>
+#endif
 
 #include "pslr.h"
 //#include "pslr_lens.h"
 #include "pktriggercord-servermode.h"
-
-#ifdef WIN32
-#define FILE_ACCESS O_WRONLY | O_CREAT | O_TRUNC | O_BINARY
-#else
-#define FILE_ACCESS O_WRONLY | O_CREAT | O_TRUNC
-#endif
+#include "pktriggercord-writer.h"
+#include "pktriggercord-checksum.h"
+#include "pktriggercord-compress.h"
+#include "pktriggercord-output.h"
 
 extern char *optarg;
 extern int optind, opterr, optopt;
@@ -98,33 +101,625 @@ static struct option const longopts[] ={
 #ifndef WIN32
     {"servermode", no_argument, NULL, 22},
     {"servermode_timeout", required_argument, NULL, 23},
+    {"servermode_bind", required_argument, NULL, 35},
+    {"servermode_port", required_argument, NULL, 36},
+    {"servermode_poll", required_argument, NULL, 37},
+    {"servermode_unix", required_argument, NULL, 38},
+    {"servermode_send_timeout", required_argument, NULL, 39},
+    {"pipeline", required_argument, NULL, 25},
+    {"direct_io", no_argument, NULL, 26},
+    {"fsync_batch", required_argument, NULL, 27},
+    {"mmap", no_argument, NULL, 28},
+    {"stream_format", required_argument, NULL, 29},
+    {"checksum", optional_argument, NULL, 30},
+    {"compress", required_argument, NULL, 31},
+    {"durable", optional_argument, NULL, 33},
+    {"durable_bytes", required_argument, NULL, 34},
+    {"compress_level", required_argument, NULL, 32},
 #endif
     {"pentax_debug_mode", required_argument, NULL,24},
     { NULL, 0, NULL, 0}
 };
 
-int save_buffer(pslr_handle_t, int, int, pslr_status*, user_file_format, int);
+/* CRC32C of a downloaded image (--checksum) */
+typedef struct {
+    uint32_t crc;
+    uint32_t size;
+} checksum_t;
+
+int save_buffer(pslr_handle_t, int, int, int, pslr_status*, user_file_format, int, checksum_t*);
 void print_status_info(pslr_handle_t h, pslr_status status);
 void usage(char*);
 void version(char*);
+void warning_message( const char* message, ... );
+
+// status.bufmask
+#define MAX_BUFFERS 16
+#define FILE_NAME_SIZE 256
+// seconds to wait for the image after the shutter in pipeline mode
+#define PIPELINE_SHOT_TIMEOUT 60
+
+/* writer_open flags of the output files */
+static int writer_flags = 0;
+
+/* --checksum: sidecar files, or lines appended to the manifest */
+static bool checksum = false;
+static char *checksum_manifest = NULL;
+
+/* --durable: the camera buffers are deleted only after a group commit
+ * of the filesystem covers their files */
+#define DURABLE_SECONDS 5
+static bool durable = false;
+static double durable_seconds = DURABLE_SECONDS;
+static uint64_t durable_bytes = 0;
+
+/* --compress: bit (1 << user_file_format) set for the compressed formats */
+static int compress_formats = 0;
+static int compress_level = COMPRESS_LEVEL;
+static int compress_threads = 1;
+
+/* Container of the images on standard output (--stream_format) */
+typedef enum {
+    STREAM_RAW,                 // images back to back, single frame only
+    STREAM_FRAMED,              // frame header before every image
+    STREAM_TAR                  // ustar archive
+} stream_format_t;
+
+static stream_format_t stream_format = STREAM_RAW;
+
+#define STREAM_MAGIC "PKTF"
+#define STREAM_HEADER_SIZE 36
+/* flags of the framed header */
+#define STREAM_FLAG_ERROR 1         // the image of the frame before is not complete
+#define STREAM_FLAG_DOWNLOAD_TIME 2 // no capture time in the image, the time is the download start
+
+/* A failed download ends a tar stream without the end of archive */
+static bool stream_failed = false;
+#define TAR_BLOCK 512
 
-int open_file(char* output_file, int frameNo, user_file_format_t ufft) {
-    int ofd = -1;
-    char fileName[256];
+#ifndef WIN32
+/* Serializes camera commands when the pipeline download thread runs */
+static pthread_mutex_t camera_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
 
-    if (!output_file) {
-        ofd = 1;
+static void camera_lock() {
+#ifndef WIN32
+    pthread_mutex_lock(&camera_mutex);
+#endif
+}
+
+static void camera_unlock() {
+#ifndef WIN32
+    pthread_mutex_unlock(&camera_mutex);
+#endif
+}
+
+/* Output directory and file name template of -o, NULL for standard
+ * output */
+static output_t *output = NULL;
+
+/* -o DIR/NAME: NAME is the template of the file names. A NAME without
+ * % gets the frame number and the extension, as NAME-0001.pef. */
+static output_t *open_output(const char *output_file) {
+    char dir[FILE_NAME_SIZE];
+    char template[FILE_NAME_SIZE];
+    const char *base = strrchr(output_file, '/');
+
+    if (base) {
+        snprintf(dir, sizeof(dir), "%.*s", base == output_file ? 1 : (int) (base - output_file), output_file);
+        base++;
     } else {
-        snprintf(fileName, 256, "%s-%04d.%s", output_file, frameNo, ufft.extension);
-        ofd = open(fileName, FILE_ACCESS, 0664);
-        if (ofd == -1) {
-            fprintf(stderr, "Could not open %s\n", output_file);
-            return -1;
-        }
+        base = output_file;
+    }
+    if (strchr(base, '%')) {
+        snprintf(template, sizeof(template), "%s", base);
+    } else {
+        snprintf(template, sizeof(template), "%s-%%n.%%e", base);
+    }
+    return output_open(base == output_file ? NULL : dir, template);
+}
+
+/* fileName receives the name of the file in the output directory
+ * (FILE_NAME_SIZE bytes). The file has no name until close_file
+ * publishes it. */
+int open_file(int frameNo, user_file_format_t ufft, pslr_status *status, char *fileName) {
+    size_t length;
+    int ofd;
+
+    if (!output) {
+        return 1;
+    }
+    if (output_name(output, fileName, FILE_NAME_SIZE, frameNo, ufft.extension, status) != 0) {
+        return -1;
+    }
+    length = strlen(fileName);
+    if (compress_formats & (1 << ufft.uff)) {
+        snprintf(fileName + length, FILE_NAME_SIZE - length, ".zst");
+    }
+    /* memory mapping needs read access */
+    ofd = output_create(output, fileName, (writer_flags & WRITER_MMAP) != 0);
+    if (ofd == -1) {
+        return -1;
     }
     return ofd;
 }
 
+/* Returns 0 if the file got its name, the camera buffer can go then */
+int close_file(int fd, char *fileName, bool ok) {
+    if (fd == 1) {
+        return ok ? 0 : -1;
+    }
+    if (fd == -1) {
+        return -1;
+    }
+    return output_publish(output, fd, fileName, ok);
+}
+
+/* Writes "<crc32c>  <size>  <name>" to fileName.crc32c, or appends it
+ * to the manifest. Standard output is listed as "-". */
+void write_checksum(int fd, char *fileName, checksum_t *sum) {
+    char sidecar[FILE_NAME_SIZE + 8];
+    char line[FILE_NAME_SIZE + 32];
+    const char *name = fd == 1 ? "-" : fileName;
+    int sidecar_fd;
+    FILE *f;
+
+    snprintf(line, sizeof(line), "%08x  %u  %s\n", sum->crc, sum->size, name);
+    if (checksum_manifest) {
+        f = fopen(checksum_manifest, "a");
+        if (!f) {
+            perror("Could not write the checksum");
+            return;
+        }
+        fputs(line, f);
+        fclose(f);
+    } else if (fd == 1) {
+        fprintf(stderr, "crc32c %s", line);
+    } else {
+        /* next to the image in the output directory */
+        snprintf(sidecar, sizeof(sidecar), "%s.crc32c", fileName);
+        sidecar_fd = output_create(output, sidecar, false);
+        if (sidecar_fd == -1) {
+            return;
+        }
+        output_publish(output, sidecar_fd, sidecar, write(sidecar_fd, line, strlen(line)) == (ssize_t) strlen(line));
+    }
+}
+
+/* The size of the file has to match the downloaded bytes, a short
+ * write is an error. */
+static int check_file_size(int fd, uint32_t length) {
+    struct stat st;
+
+    if (fd == 1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        return 0;
+    }
+    if (st.st_size != (off_t) length) {
+        fprintf(stderr, "Short write: %lld of %u bytes on disk.\n", (long long) st.st_size, length);
+        return EIO;
+    }
+    return 0;
+}
+
+/* Framed stream header, all numbers are little endian:
+ *  0 "PKTF"
+ *  4 header size, including the status text
+ *  8 frame number
+ * 12 buffer type (pslr_buffer_type)
+ * 16 image size
+ * 20 status text size
+ * 24 capture time, microseconds since the epoch (64 bit)
+ * 32 flags (STREAM_FLAG_*)
+ * 36 status text, as printed by --status
+ * The image follows the header. A short image is padded with zeros and
+ * followed by a header of the same frame with STREAM_FLAG_ERROR and no
+ * image. */
+static void stream_framed_header(writer_t *w, int frameNo, pslr_buffer_type type, uint32_t length, const char *status_text,
+                                 uint64_t usec, uint32_t flags) {
+    uint8_t header[STREAM_HEADER_SIZE];
+    uint32_t status_length = strlen(status_text);
+
+    memcpy(header, STREAM_MAGIC, 4);
+    set_uint32_le(STREAM_HEADER_SIZE + status_length, header + 4);
+    set_uint32_le(frameNo, header + 8);
+    set_uint32_le(type, header + 12);
+    set_uint32_le(length, header + 16);
+    set_uint32_le(status_length, header + 20);
+    set_uint32_le(usec & 0xffffffff, header + 24);
+    set_uint32_le(usec >> 32, header + 28);
+    set_uint32_le(flags, header + 32);
+    writer_sink(header, sizeof(header), 0, 0, (uintptr_t) w);
+    writer_sink((uint8_t *) status_text, status_length, 0, 0, (uintptr_t) w);
+}
+
+static void stream_tar_entry(writer_t *w, const char *name, uint32_t length, time_t mtime) {
+    uint8_t header[TAR_BLOCK];
+    unsigned int checksum = 0;
+    int i;
+
+    memset(header, 0, sizeof(header));
+    snprintf((char *) header, 100, "%s", name);
+    snprintf((char *) header + 100, 8, "%07o", 0644);
+    snprintf((char *) header + 108, 8, "%07o", 0);
+    snprintf((char *) header + 116, 8, "%07o", 0);
+    snprintf((char *) header + 124, 12, "%011o", length);
+    snprintf((char *) header + 136, 12, "%011lo", (unsigned long) mtime & 077777777777);
+    memset(header + 148, ' ', 8);
+    header[156] = '0';
+    memcpy(header + 257, "ustar", 6);
+    memcpy(header + 263, "00", 2);
+    for (i = 0; i < TAR_BLOCK; i++) {
+        checksum += header[i];
+    }
+    snprintf((char *) header + 148, 8, "%06o", checksum);
+    writer_sink(header, sizeof(header), 0, 0, (uintptr_t) w);
+}
+
+/* tar entries are padded to the block size */
+static void stream_tar_padding(writer_t *w, uint32_t length) {
+    uint8_t zero[TAR_BLOCK];
+    if (length % TAR_BLOCK) {
+        memset(zero, 0, sizeof(zero));
+        writer_sink(zero, TAR_BLOCK - length % TAR_BLOCK, 0, 0, (uintptr_t) w);
+    }
+}
+
+/* Capture time from the Exif date of the first block of the image,
+ * false if it has none */
+static bool stream_capture_time(uint8_t *buf, uint32_t length, uint64_t *usec) {
+    pslr_image_metadata_t meta;
+    const char *date;
+    struct tm tm;
+    time_t t;
+
+    if (pslr_tiff_parse_metadata(buf, length, &meta) != PSLR_OK) {
+        return false;
+    }
+    date = meta.datetime_original[0] ? meta.datetime_original : meta.datetime;
+    memset(&tm, 0, sizeof(tm));
+    if (sscanf(date, "%d:%d:%d %d:%d:%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+               &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6) {
+        return false;
+    }
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    // the camera clock is local time
+    tm.tm_isdst = -1;
+    t = mktime(&tm);
+    if (t == (time_t) -1) {
+        return false;
+    }
+    *usec = (uint64_t) t * 1000000;
+    return true;
+}
+
+/* Written before the image, buf holds its first block. For tar a text
+ * entry with the status comes before the image entry. */
+static void stream_header(writer_t *w, pslr_handle_t camhandle, int frameNo, pslr_status *status,
+                          pslr_buffer_type type, const char *extension, uint32_t length,
+                          uint8_t *buf, uint32_t fill) {
+    char name[FILE_NAME_SIZE];
+    char *status_text = collect_status_info(camhandle, *status);
+    uint32_t flags = 0;
+    struct timeval now;
+    uint64_t usec;
+
+    if (!stream_capture_time(buf, fill, &usec)) {
+        gettimeofday(&now, NULL);
+        usec = (uint64_t) now.tv_sec * 1000000 + now.tv_usec;
+        flags |= STREAM_FLAG_DOWNLOAD_TIME;
+    }
+    if (stream_format == STREAM_FRAMED) {
+        stream_framed_header(w, frameNo, type, length, status_text, usec, flags);
+    } else if (stream_format == STREAM_TAR) {
+        snprintf(name, sizeof(name), "pktriggercord-%06d.txt", frameNo);
+        stream_tar_entry(w, name, strlen(status_text), usec / 1000000);
+        writer_sink((uint8_t *) status_text, strlen(status_text), 0, 0, (uintptr_t) w);
+        stream_tar_padding(w, strlen(status_text));
+        snprintf(name, sizeof(name), "pktriggercord-%06d.%s", frameNo, extension);
+        stream_tar_entry(w, name, length, usec / 1000000);
+    }
+    free(status_text);
+    writer_flush(w);
+}
+
+/* Written after the image. A short framed image is padded with zeros,
+ * so the consumer stays in sync, and flagged by an error header. A tar
+ * stream cannot flag it: the archive ends there, truncated. */
+static void stream_trailer(writer_t *w, int frameNo, pslr_buffer_type type, uint32_t current, uint32_t length) {
+    uint8_t zero[4096];
+    bool failed = current < length;
+    uint32_t n;
+    struct timeval now;
+
+    if (failed) {
+        stream_failed = true;
+        if (stream_format == STREAM_TAR) {
+            writer_flush(w);
+            return;
+        }
+    }
+    memset(zero, 0, sizeof(zero));
+    while (current < length) {
+        n = length - current < sizeof(zero) ? length - current : sizeof(zero);
+        writer_sink(zero, n, 0, 0, (uintptr_t) w);
+        current += n;
+    }
+    if (stream_format == STREAM_TAR) {
+        stream_tar_padding(w, length);
+    } else if (failed) {
+        gettimeofday(&now, NULL);
+        stream_framed_header(w, frameNo, type, 0, "", (uint64_t) now.tv_sec * 1000000 + now.tv_usec,
+                             STREAM_FLAG_ERROR | STREAM_FLAG_DOWNLOAD_TIME);
+    }
+    writer_flush(w);
+}
+
+/* End of the tar archive: two zero blocks */
+static void stream_finish(void) {
+    uint8_t zero[2 * TAR_BLOCK];
+    if (stream_format == STREAM_TAR && !stream_failed) {
+        memset(zero, 0, sizeof(zero));
+        if (write(1, zero, sizeof(zero)) != sizeof(zero)) {
+            perror("write");
+        }
+    }
+}
+
+#ifndef WIN32
+/* Pipelined mode: the main thread keeps shooting while a download
+ * thread drains the camera buffers to disk. busy holds the buffers
+ * queued or being downloaded, they are the slots we must not
+ * overrun. */
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int bufno[MAX_BUFFERS];
+    int file_no[MAX_BUFFERS];
+    int head;
+    int count;
+    int next_file_no;
+    uint16_t busy;
+    uint16_t ignored;           // images already in the camera at start
+    uint16_t kept;              // failed downloads left in the camera
+    uint16_t pending_delete;    // saved, waiting for the sync (--durable)
+    unsigned int sync_count;    // writer_sync_count() at the last delete
+    int depth;
+    bool finished;
+    pslr_handle_t camhandle;
+    user_file_format uff;
+    int quality;
+    pslr_status status;
+} pipeline_t;
+
+/* Delete the saved buffers and give their slots back to the shooter */
+static void pipeline_delete(pipeline_t *pl, uint16_t buffers) {
+    pslr_status st;
+    int bufno;
+    int retry;
+
+    camera_lock();
+    for( bufno = 0; bufno < MAX_BUFFERS; ++bufno ) {
+	if( buffers & (1 << bufno) ) {
+	    pslr_delete_buffer(pl->camhandle, bufno);
+	}
+    }
+    for( retry = 0; retry < 5; ++retry ) {
+	if( pslr_get_status(pl->camhandle, &st) == PSLR_OK && (st.bufmask & buffers) == 0 ) {
+	    break;
+	}
+	DPRINT("pipeline: buffers 0x%x not gone - wait\n", st.bufmask & buffers);
+	usleep(100000);
+    }
+    camera_unlock();
+
+    pthread_mutex_lock(&pl->mutex);
+    pl->busy &= ~buffers;
+    pthread_cond_broadcast(&pl->cond);
+    pthread_mutex_unlock(&pl->mutex);
+}
+
+/* Buffers taken by this run, called with the mutex held. The failed
+ * downloads left in the camera still take a slot. */
+static int pipeline_used(pipeline_t *pl) {
+    return __builtin_popcount(pl->busy | pl->kept);
+}
+
+/* The image could not be saved: the buffer stays in the camera like
+ * the images found at start, and its slot is given back */
+static void pipeline_keep(pipeline_t *pl, int bufno) {
+    fprintf(stderr, "Download of buffer %d failed, it is kept in the camera\n", bufno);
+    pthread_mutex_lock(&pl->mutex);
+    pl->busy &= ~(1 << bufno);
+    pl->ignored |= 1 << bufno;
+    pl->kept |= 1 << bufno;
+    pthread_cond_broadcast(&pl->cond);
+    pthread_mutex_unlock(&pl->mutex);
+}
+
+/* --durable: sync the saved files if the batch is due (or forced), and
+ * delete their buffers once a sync covered them */
+static void pipeline_commit(pipeline_t *pl, bool force) {
+    if( !pl->pending_delete ) {
+	return;
+    }
+    if( (force || writer_sync_due()) && writer_sync_batch() != 0 ) {
+	return;
+    }
+    if( writer_sync_count() == pl->sync_count ) {
+	return;
+    }
+    DPRINT("pipeline: buffers 0x%x are on the disk\n", pl->pending_delete);
+    pl->sync_count = writer_sync_count();
+    pipeline_delete(pl, pl->pending_delete);
+    pl->pending_delete = 0;
+}
+
+static void *pipeline_thread(void *arg) {
+    pipeline_t *pl = (pipeline_t *) arg;
+    user_file_format_t ufft = *get_file_format_t(pl->uff);
+    struct timeval now;
+    struct timespec deadline;
+    bool force;
+    int bufno;
+    int file_no;
+    int fd;
+    int ret;
+    char fileName[FILE_NAME_SIZE];
+    checksum_t sum;
+
+    pthread_mutex_lock(&pl->mutex);
+    while( true ) {
+	while( pl->count == 0 && !pl->finished ) {
+	    if( !pl->pending_delete ) {
+		pthread_cond_wait(&pl->cond, &pl->mutex);
+		continue;
+	    }
+	    /* idle with unsynced files: check the batch every 100 ms, sync
+	     * at once if the shooter waits for a slot */
+	    gettimeofday(&now, NULL);
+	    deadline.tv_sec = now.tv_sec + (now.tv_usec + 100000) / 1000000;
+	    deadline.tv_nsec = (now.tv_usec + 100000) % 1000000 * 1000;
+	    pthread_cond_timedwait(&pl->cond, &pl->mutex, &deadline);
+	    if( pl->count > 0 ) {
+		break;
+	    }
+	    force = pipeline_used(pl) >= pl->depth || pl->finished;
+	    pthread_mutex_unlock(&pl->mutex);
+	    pipeline_commit(pl, force);
+	    pthread_mutex_lock(&pl->mutex);
+	}
+	if( pl->count == 0 ) {
+	    break;
+	}
+	bufno = pl->bufno[pl->head];
+	file_no = pl->file_no[pl->head];
+	pl->head = (pl->head + 1) % MAX_BUFFERS;
+	--pl->count;
+	pthread_mutex_unlock(&pl->mutex);
+
+	DPRINT("pipeline: download buffer %d as frame %d\n", bufno, file_no);
+	fd = open_file(file_no, ufft, &pl->status, fileName);
+	if( fd == -1 ) {
+	    // no file to save to, the camera buffer is not touched
+	    pipeline_keep(pl, bufno);
+	    pthread_mutex_lock(&pl->mutex);
+	    continue;
+	}
+	while( (ret = save_buffer(pl->camhandle, bufno, fd, file_no, &pl->status, pl->uff, pl->quality, checksum ? &sum : NULL)) == 1 ) {
+	    usleep(10000);
+	}
+	if( close_file(fd, fileName, ret == 0) != 0 ) {
+	    pipeline_keep(pl, bufno);
+	} else {
+	    if( checksum ) {
+		write_checksum(fd, fileName, &sum);
+	    }
+	    if( durable ) {
+		pl->pending_delete |= 1 << bufno;
+		pipeline_commit(pl, false);
+	    } else {
+		pipeline_delete(pl, 1 << bufno);
+	    }
+	}
+	pthread_mutex_lock(&pl->mutex);
+    }
+    pthread_mutex_unlock(&pl->mutex);
+    pipeline_commit(pl, true);
+    return NULL;
+}
+
+static int pipeline_start(pipeline_t *pl, pslr_handle_t camhandle, int depth, user_file_format uff, int quality, pslr_status *status) {
+    memset(pl, 0, sizeof(pipeline_t));
+    pl->depth = depth;
+    pthread_mutex_init(&pl->mutex, NULL);
+    pthread_cond_init(&pl->cond, NULL);
+    pl->camhandle = camhandle;
+    pl->uff = uff;
+    pl->quality = quality;
+    pl->status = *status;
+    pl->ignored = status->bufmask;
+    if( pl->ignored ) {
+	warning_message("Camera buffers 0x%x are not empty, they are left untouched\n", pl->ignored);
+    }
+    return pthread_create(&pl->thread, NULL, pipeline_thread, pl);
+}
+
+/* Block until less than depth images are waiting in the camera.
+ * Returns -1 if the kept images fill all the slots. */
+static int pipeline_wait_slot(pipeline_t *pl, int depth) {
+    int ret = 0;
+
+    pthread_mutex_lock(&pl->mutex);
+    while( pipeline_used(pl) >= depth ) {
+	if( __builtin_popcount(pl->kept) >= depth ) {
+	    ret = -1;
+	    break;
+	}
+	pthread_cond_wait(&pl->cond, &pl->mutex);
+    }
+    pthread_mutex_unlock(&pl->mutex);
+    return ret;
+}
+
+/* Wait for the buffer(s) of the new picture and queue them */
+static int pipeline_collect(pipeline_t *pl, int timeout) {
+    struct timeval start_time;
+    struct timeval current_time;
+    pslr_status st;
+    uint16_t new_buffers;
+    int ret;
+    int i;
+
+    gettimeofday(&start_time, NULL);
+    while( true ) {
+	camera_lock();
+	ret = pslr_get_status(pl->camhandle, &st);
+	camera_unlock();
+	if( ret != PSLR_OK ) {
+	    return ret;
+	}
+
+	pthread_mutex_lock(&pl->mutex);
+	new_buffers = st.bufmask & ~pl->busy & ~pl->ignored;
+	for( i = 0; i < MAX_BUFFERS; ++i ) {
+	    if( new_buffers & (1 << i) ) {
+		int tail = (pl->head + pl->count) % MAX_BUFFERS;
+		pl->bufno[tail] = i;
+		pl->file_no[tail] = pl->next_file_no++;
+		++pl->count;
+		pl->busy |= 1 << i;
+	    }
+	}
+	if( new_buffers ) {
+	    pthread_cond_broadcast(&pl->cond);
+	}
+	pthread_mutex_unlock(&pl->mutex);
+	if( new_buffers ) {
+	    return PSLR_OK;
+	}
+
+	gettimeofday(&current_time, NULL);
+	if( timeout != 0 && timeval_diff(&current_time, &start_time) / 1000000.0 >= timeout ) {
+	    printf("Timeout %d sec passed!\n", timeout);
+	    return PSLR_READ_ERROR;
+	}
+	usleep(100000); /* 100 ms */
+    }
+}
+
+static void pipeline_finish(pipeline_t *pl) {
+    pthread_mutex_lock(&pl->mutex);
+    pl->finished = true;
+    pthread_cond_broadcast(&pl->cond);
+    pthread_mutex_unlock(&pl->mutex);
+    pthread_join(pl->thread, NULL);
+    pthread_cond_destroy(&pl->cond);
+    pthread_mutex_destroy(&pl->mutex);
+}
+#endif
+
 void warning_message( const char* message, ... ) {
     if( warnings ) {
 	// Write to stderr
@@ -162,7 +757,12 @@ int main(int argc, char **argv) {
     char *MODESTRING = NULL;
     int resolution = 0;
     int quality = -1;
-    int optc, fd, i;
+    int optc, fd, i, ret;
+    char fileName[FILE_NAME_SIZE];
+    checksum_t sum;
+    uint16_t saved = 0;
+    uint16_t kept = 0;
+    bool failed = false;
     int wbadj_ss=0;
     pslr_handle_t camhandle;
     pslr_status status;
@@ -202,8 +802,10 @@ int main(int argc, char **argv) {
     bool noshutter = false;
 #ifndef WIN32
     bool servermode = false;
-    int servermode_timeout = 30;
+    servermode_options_t servermode_options = { NULL, SERVERMODE_PORT, 30, SERVERMODE_POLL_INTERVAL, NULL, SERVERMODE_SEND_TIMEOUT };
+    pipeline_t pipeline;
 #endif
+    int pipeline_depth = 0;
 
     int modify_debug_mode=0;
     char debug_mode=0;
@@ -448,10 +1050,6 @@ int main(int argc, char **argv) {
 
             case 'F':
                 frames = atoi(optarg);
-                if (frames > 9999) {
-                    warning_message("%s: Invalid frame number.\n", argv[0]);
-		    frames = 9999;
-                }
                 break;
 
             case 'd':
@@ -497,7 +1095,121 @@ int main(int argc, char **argv) {
 	        break;
 
             case 23:
-                servermode_timeout = atoi(optarg);
+                servermode_options.timeout = atoi(optarg);
+                break;
+
+            case 35:
+                servermode_options.bind_address = optarg;
+                break;
+
+            case 36:
+                servermode_options.port = atoi(optarg);
+                if (servermode_options.port <= 0 || servermode_options.port > 65535) {
+                    warning_message("%s: Invalid port number.\n", argv[0]);
+                    servermode_options.port = SERVERMODE_PORT;
+                }
+                break;
+
+            case 37:
+                servermode_options.poll_interval = atoi(optarg);
+                if (servermode_options.poll_interval < 10) {
+                    warning_message("%s: Invalid status poll interval.\n", argv[0]);
+                    servermode_options.poll_interval = SERVERMODE_POLL_INTERVAL;
+                }
+                break;
+
+            case 38:
+                servermode_options.unix_path = optarg;
+                break;
+
+            case 39:
+                servermode_options.send_timeout = atoi(optarg);
+                if (servermode_options.send_timeout < 0) {
+                    warning_message("%s: Invalid send timeout.\n", argv[0]);
+                    servermode_options.send_timeout = SERVERMODE_SEND_TIMEOUT;
+                }
+                break;
+
+            case 25:
+                pipeline_depth = atoi(optarg);
+                if (pipeline_depth < 1 || pipeline_depth > MAX_BUFFERS) {
+                    warning_message("%s: Invalid pipeline depth.\n", argv[0]);
+                    pipeline_depth = pipeline_depth < 1 ? 0 : MAX_BUFFERS;
+                }
+                break;
+
+            case 26:
+                writer_flags |= WRITER_DIRECT;
+                break;
+
+            case 27:
+                writer_set_fsync_batch(atoi(optarg));
+                break;
+
+            case 28:
+                writer_flags |= WRITER_MMAP;
+                break;
+
+            case 29:
+                if (!strcmp(optarg, "framed")) {
+                    stream_format = STREAM_FRAMED;
+                } else if (!strcmp(optarg, "tar")) {
+                    stream_format = STREAM_TAR;
+                } else if (!strcmp(optarg, "raw")) {
+                    stream_format = STREAM_RAW;
+                } else {
+                    warning_message("%s: Invalid stream format: %s\n", argv[0], optarg);
+                }
+                break;
+
+            case 30:
+                checksum = true;
+                checksum_manifest = optarg;
+                break;
+
+            case 31:
+#ifdef HAVE_ZSTD
+                for (i = 0; i < strlen(optarg); i++) {
+                    optarg[i] = toupper(optarg[i]);
+                }
+                {
+                    char *format = strtok(optarg, ",");
+                    while (format) {
+                        if (!strcmp(format, "DNG")) {
+                            compress_formats |= 1 << USER_FILE_FORMAT_DNG;
+                        } else if (!strcmp(format, "PEF")) {
+                            compress_formats |= 1 << USER_FILE_FORMAT_PEF;
+                        } else if (!strcmp(format, "JPEG") || !strcmp(format, "JPG")) {
+                            compress_formats |= 1 << USER_FILE_FORMAT_JPEG;
+                        } else {
+                            warning_message("%s: Invalid file format to compress: %s\n", argv[0], format);
+                        }
+                        format = strtok(NULL, ",");
+                    }
+                }
+                compress_threads = sysconf(_SC_NPROCESSORS_ONLN);
+                if (compress_threads < 1) {
+                    compress_threads = 1;
+                }
+#else
+                warning_message("%s: Compiled without zstd, --compress is ignored\n", argv[0]);
+#endif
+                break;
+
+            case 32:
+                compress_level = atoi(optarg);
+                break;
+
+            case 33:
+            case 34:
+                if (optc == 33 && optarg) {
+                    durable_seconds = atof(optarg);
+                } else if (optc == 34) {
+                    durable_bytes = (uint64_t) atoi(optarg) * 1024 * 1024;
+                }
+                durable = true;
+                writer_set_sync_limits(durable_seconds, durable_bytes);
+                writer_set_sync_manual(true);
                 break;
 #endif
 
@@ -510,16 +1222,27 @@ int main(int argc, char **argv) {
 #ifndef WIN32
     if( servermode ) {
         // ignore all the other argument and go to server mode
-        servermode_socket(servermode_timeout);
-        exit(0);
+        exit(servermode_socket(&servermode_options));
     }
 #endif
 
-    if (!output_file && frames > 1) {
-        fprintf(stderr, "Should specify output filename if frames>1\n");
+    if (stream_format != STREAM_RAW && output_file) {
+        fprintf(stderr, "--stream_format needs standard output, do not specify output filename\n");
         exit(-1);
     }
 
+    if (!output_file && frames > 1 && stream_format == STREAM_RAW) {
+        fprintf(stderr, "Should specify output filename if frames>1 (or use --stream_format)\n");
+        exit(-1);
+    }
+
+    if (output_file) {
+        output = open_output(output_file);
+        if (!output) {
+            exit(-1);
+        }
+    }
+
     DPRINT("%s %s \n", argv[0], VERSION);
     DPRINT("model %s\n", model );
     DPRINT("device %s\n", device );
@@ -717,6 +1440,22 @@ int main(int argc, char **argv) {
 	status.drive_mode == PSLR_DRIVE_MODE_CONTINUOUS_LO;
     DPRINT("cont: %d\n", continuous);
 
+#ifndef WIN32
+    if( pipeline_depth > 0 ) {
+	if( reconnect ) {
+	    warning_message("%s: --reconnect is ignored in pipeline mode\n", argv[0]);
+	    reconnect = false;
+	}
+	if( pipeline_start(&pipeline, camhandle, pipeline_depth, uff, quality, &status) ) {
+	    fprintf(stderr, "Cannot start the download thread\n");
+	    pipeline_depth = 0;
+	}
+    }
+#endif
+    if( durable && pipeline_depth == 0 && frames > 1 ) {
+	warning_message("%s: --durable syncs after every frame without --pipeline\n", argv[0]);
+    }
+
     for (frameNo = 0; frameNo < frames; ++frameNo) {
 	gettimeofday(&current_time, NULL);
 	if( bracket_count <= bracket_index ) {
@@ -735,7 +1474,16 @@ int main(int argc, char **argv) {
 	    bracket_index = 0;
 	    gettimeofday(&prev_time, NULL);
 	}
-	if( noshutter ) {
+#ifndef WIN32
+	if( pipeline_depth > 0 ) {
+	    if( pipeline_wait_slot(&pipeline, pipeline_depth) != 0 ) {
+		fprintf(stderr, "Failed downloads fill the pipeline slots, stopping.\n");
+		failed = true;
+		break;
+	    }
+	}
+#endif
+	if( noshutter && pipeline_depth == 0 ) {
 	    while (1) {
 	        if( PSLR_OK != pslr_get_status (camhandle, &status) ) {
                     break;
@@ -753,56 +1501,139 @@ int main(int argc, char **argv) {
 
 		usleep(100000); /* 100 ms */
 	    }
-	} else {
+	} else if( !noshutter ) {
 	    if( frames > 1 ) {
 		printf("Taking picture %d/%d\n", frameNo+1, frames);
 	    }
 	    if( status.exposure_mode ==  PSLR_GUI_EXPOSURE_MODE_B ) {
 		DPRINT("bulb\n");
+		camera_lock();
 		pslr_bulb( camhandle, true );
 		pslr_shutter(camhandle);
+		camera_unlock();
 		gettimeofday(&current_time, NULL);
 		waitsec = 1.0 * shutter_speed.nom / shutter_speed.denom - timeval_diff(&current_time, &prev_time) / 1000000.0;
 		if( waitsec < 0 ) {
 		    waitsec = 0;
 		}
 		sleep_sec( waitsec  );
+		camera_lock();
 		pslr_bulb( camhandle, false );
+		camera_unlock();
 	    } else {
 		DPRINT("not bulb\n");
+		camera_lock();
 		pslr_shutter(camhandle);
+		camera_unlock();
 	    }
+	    camera_lock();
 	    pslr_get_status(camhandle, &status);
+	    camera_unlock();
 	}
-	if( bracket_index+1 >= bracket_count || frameNo+1>=frames ) {
+	if( pipeline_depth > 0 ) {
+#ifndef WIN32
+	    // the download thread takes it from here
+	    if( pipeline_collect(&pipeline, timeout != 0 || noshutter ? timeout : PIPELINE_SHOT_TIMEOUT) != PSLR_OK ) {
+		fprintf(stderr, "No image from the camera for frame %d, stopping.\n", frameNo);
+		failed = true;
+		break;
+	    }
+#endif
+	} else if( bracket_index+1 >= bracket_count || frameNo+1>=frames ) {
 	    if( bracket_index+1 < bracket_count ) {
 		// partial bracket set
 		bracket_count = bracket_index+1;
 	    }
 	    for( buffer_index = 0; buffer_index < bracket_count; ++buffer_index ) {
-		fd = open_file(output_file, frameNo-bracket_count+buffer_index+1, ufft);
-		while( save_buffer(camhandle, buffer_index, fd, &status, uff, quality) ) {
+		fd = open_file(frameNo-bracket_count+buffer_index+1, ufft, &status, fileName);
+		if( fd == -1 ) {
+		    // no file to save to, the camera buffer is not touched
+		    kept |= 1 << buffer_index;
+		    continue;
+		}
+		while( (ret = save_buffer(camhandle, buffer_index, fd, frameNo-bracket_count+buffer_index+1, &status, uff, quality, checksum ? &sum : NULL)) == 1 ) {
 		    usleep(10000);
 		}
-		pslr_delete_buffer(camhandle, buffer_index);
-		if (fd != 1) {
-		    close(fd);
+		if( close_file(fd, fileName, ret == 0) != 0 ) {
+		    // the image is not on the disk, it stays in the camera
+		    kept |= 1 << buffer_index;
+		    continue;
+		}
+		if( checksum ) {
+		    write_checksum(fd, fileName, &sum);
 		}
+		if( !durable ) {
+		    pslr_delete_buffer(camhandle, buffer_index);
+		} else {
+		    saved |= 1 << buffer_index;
+		}
+	    }
+	    /* the next shot reuses the buffers, so the group commit covers
+	     * the files of this frame only: one sync per frame, --pipeline
+	     * batches across frames */
+	    if( durable && writer_sync_batch() != 0 ) {
+		// the files may not be on the disk, the images stay in the camera
+		kept |= saved;
+	    } else if( durable ) {
+		for( buffer_index = 0; buffer_index < bracket_count; ++buffer_index ) {
+		    if( saved & (1 << buffer_index) ) {
+			pslr_delete_buffer(camhandle, buffer_index);
+		    }
+		}
+	    }
+	    saved = 0;
+	    if( kept ) {
+		// the next shot would not go to the buffers downloaded here
+		fprintf(stderr, "Download failed, camera buffers 0x%x are kept, stopping.\n", kept);
+		break;
 	    }
 	}
 	++bracket_index;
     }
+#ifndef WIN32
+    if( pipeline_depth > 0 ) {
+	pipeline_finish(&pipeline);
+    }
+#endif
+    stream_finish();
+    writer_sync_batch();
+    output_free(output);
     camera_close(camhandle);
 
-    exit(0);
+    exit(kept || failed ? 1 : 0);
 }
 
-int save_buffer(pslr_handle_t camhandle, int bufno, int fd, pslr_status *status, user_file_format filefmt, int jpeg_stars) {
+/* Fills the whole block from the open buffer, only the last one of the
+ * image is short. Returns the bytes read. */
+static uint32_t read_block(pslr_handle_t camhandle, uint8_t *buf) {
+    uint32_t fill = 0;
+    uint32_t bytes;
+
+    do {
+        /* lock per read, so shots can be taken between the reads */
+        camera_lock();
+        bytes = pslr_buffer_read(camhandle, buf + fill, WRITER_BLOCK_SIZE - fill);
+        camera_unlock();
+        fill += bytes;
+    } while (bytes > 0 && fill < WRITER_BLOCK_SIZE);
+    return fill;
+}
+
+/* sum receives the CRC32C of the image, if not NULL */
+int save_buffer(pslr_handle_t camhandle, int bufno, int fd, int frameNo, pslr_status *status, user_file_format filefmt, int jpeg_stars, checksum_t *sum) {
 
     pslr_buffer_type imagetype;
-    uint8_t buf[65536];
+    writer_t *writer;
+    writer_map_t map;
+    compressor_t *comp = NULL;
+    uint8_t *block = NULL;
+    uint8_t *buf;
     uint32_t length;
     uint32_t current;
+    uint32_t fill = WRITER_BLOCK_SIZE;
+    bool compress;
+    int comp_ret = 0;
+    int ret;
 
     if (filefmt == USER_FILE_FORMAT_PEF) {
       imagetype = PSLR_BUF_PEF;
@@ -814,29 +1645,124 @@ int save_buffer(pslr_handle_t camhandle, int bufno, int fd, pslr_status *status,
 
     DPRINT("get buffer %d type %d res %d\n", bufno, imagetype, status->jpeg_resolution);
 
-    if (pslr_buffer_open(camhandle, bufno, imagetype, status->jpeg_resolution) != PSLR_OK) return (1);
-
+    camera_lock();
+    if (pslr_buffer_open(camhandle, bufno, imagetype, status->jpeg_resolution) != PSLR_OK) {
+        camera_unlock();
+        return (1);
+    }
     length = pslr_buffer_get_size(camhandle);
+    camera_unlock();
     DPRINT("Buffer length: %d\n", length);
     current = 0;
+    if (sum) {
+        sum->crc = 0;
+    }
+
+    /* standard output is never compressed */
+    compress = fd != 1 && (compress_formats & (1 << filefmt));
+
+    writer_map_init(&map, fd);
+    /* a stream has headers between the images, only a file of its own is mapped */
+    if (!compress && fd != 1 && stream_format == STREAM_RAW && (writer_flags & WRITER_MMAP) && length > 0
+        && writer_map(&map, length)) {
+        /* download straight into the mapped file */
+        while (current < length) {
+            uint32_t bytes;
+            camera_lock();
+            bytes = pslr_buffer_read(camhandle, map.map + current, length - current);
+            camera_unlock();
+            if (bytes == 0) {
+                break;
+            }
+            if (sum) {
+                sum->crc = crc32c(sum->crc, map.map + current, bytes);
+            }
+            current += bytes;
+        }
+        map.written = current;
+        ret = writer_unmap(&map);
+    } else {
+        /* the blocks are read straight into the ring of the writer thread */
+        writer = writer_open(fd, compress ? 0 : length, writer_flags);
+        if (!writer) {
+            fprintf(stderr, "Cannot start the writer thread.\n");
+            camera_lock();
+            pslr_buffer_close(camhandle);
+            camera_unlock();
+            return (-1);
+        }
+        if (compress) {
+            /* the camera blocks go through the compressor instead of the ring */
+            block = malloc(WRITER_BLOCK_SIZE);
+            comp = block ? compressor_open(writer, compress_level, compress_threads) : NULL;
+            if (!comp) {
+                fprintf(stderr, "Cannot start the compressor: %s\n", strerror(block ? errno : ENOMEM));
+                free(block);
+                writer_close(writer);
+                camera_lock();
+                pslr_buffer_close(camhandle);
+                camera_unlock();
+                return (-1);
+            }
+        }
+        if (stream_format != STREAM_RAW) {
+            /* the header needs the capture time of the first block, the
+             * block goes to the stream after it (never compressed) */
+            block = malloc(WRITER_BLOCK_SIZE);
+            fill = block ? read_block(camhandle, block) : 0;
+            stream_header(writer, camhandle, frameNo, status, imagetype, get_file_format_t(filefmt)->extension, length,
+                          block, fill);
+            if (sum) {
+                sum->crc = crc32c(sum->crc, block, fill);
+            }
+            writer_sink(block, fill, 0, 0, (uintptr_t) writer);
+            writer_flush(writer);
+            free(block);
+            block = NULL;
+            current = fill;
+        }
 
-    while (1) {
-        uint32_t bytes;
-        bytes = pslr_buffer_read(camhandle, buf, sizeof (buf));
-        if (bytes == 0) {
-            break;
-      	}
-        ssize_t r = write(fd, buf, bytes);
-        if (r == 0) {
-            DPRINT("write(buf): Nothing has been written to buf.\n");
-        } else if (r == -1) {
-            perror("write(buf)");
-        } else if (r < bytes) {
-            DPRINT("write(buf): only write %d bytes, should be %d bytes.\n", r, bytes);
+        while (fill == WRITER_BLOCK_SIZE) {
+            buf = comp ? block : writer_get_block(writer);
+            fill = read_block(camhandle, buf);
+            /* the block is still hot in the cache */
+            if (sum) {
+                sum->crc = crc32c(sum->crc, buf, fill);
+            }
+            if (comp) {
+                compressor_write(comp, buf, fill);
+            } else {
+                writer_commit(writer, fill);
+            }
+            current += fill;
+        }
+        if (stream_format != STREAM_RAW) {
+            stream_trailer(writer, frameNo, imagetype, current, length);
+        }
+        if (comp) {
+            comp_ret = compressor_close(comp);
+            free(block);
+        }
+        ret = writer_close(writer);
+        if (!ret) {
+            ret = comp_ret;
         }
-        current += bytes;
     }
+    if (ret) {
+        fprintf(stderr, "write(buf): %s\n", strerror(ret));
+    } else if (stream_format == STREAM_RAW && !compress) {
+        ret = check_file_size(fd, current);
+    }
+    if (sum) {
+        sum->size = current;
+    }
+    camera_lock();
     pslr_buffer_close(camhandle);
+    camera_unlock();
+    if (ret || current < length) {
+        fprintf(stderr, "Could not download buffer %d.\n", bufno);
+        return (-1);
+    }
     return (0);
 }
 
@@ -876,6 +1802,21 @@ Shoot a Pentax DSLR and send the picture to standard output.\n\
       --reconnect                       reconnect between shots\n\
       --servermode                      start in server mode and wait for commands\n\
       --servermode_timeout=SECONDS      servermode timeout\n\
+      --servermode_bind=ADDRESS         listen on this address only in server mode\n\
+      --servermode_port=PORT            server mode port (default 8888)\n\
+      --servermode_poll=MS              status poll interval for the subscribed clients (default 500)\n\
+      --servermode_unix=PATH            also listen on a unix socket, local clients can get the images as memfds\n\
+      --servermode_send_timeout=SECONDS disconnect clients not reading their answers (default 30, 0 never)\n\
+      --pipeline=DEPTH                  keep shooting while downloading, at most DEPTH images wait in the camera\n\
+      --direct_io                       write the output files with O_DIRECT, bypassing the page cache\n\
+      --fsync_batch=N                   sync the filesystem after every N output files\n\
+      --mmap                            download straight into the memory mapped output file\n\
+      --stream_format=FORMAT            container of the images on standard output, valid values: raw, framed, tar\n\
+      --checksum[=MANIFEST]             CRC32C of the images into FILE.crc32c, or appended to MANIFEST\n\
+      --compress=FORMATS                zstd compress the files of these formats (e.g. PEF,DNG)\n\
+      --compress_level=LEVEL            zstd compression level (default 3)\n\
+      --durable[=SECONDS]               delete the camera buffers after a filesystem sync covers the files\n\
+      --durable_bytes=MB                sync the output files after MB megabytes in durable mode\n\
   -g, --green                           green button\n\
   -s, --status                          print status info\n\
       --status_hex                      print status hex info\n\
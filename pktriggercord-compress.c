@@ -0,0 +1,262 @@
+/*
+    pkTriggerCord
+    Copyright (C) 2011-2016 Andras Salamon <andras.salamon@melda.info>
+    Remote control of Pentax DSLR cameras.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    and GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include "pslr.h"
+#include "pktriggercord-compress.h"
+
+#ifdef HAVE_ZSTD
+#include <pthread.h>
+#include <zstd.h>
+
+typedef enum {
+    CHUNK_FREE,                 // filled by the producer
+    CHUNK_QUEUED,               // waiting for a worker
+    CHUNK_DONE                  // compressed, waiting to be written
+} chunk_state_t;
+
+typedef struct {
+    chunk_state_t state;
+    uint8_t *input;
+    size_t input_length;
+    uint8_t *output;
+    size_t output_length;
+    int error;
+} compress_chunk_t;
+
+struct compressor {
+    writer_t *writer;
+    int level;
+    int nthreads;
+    pthread_t *threads;
+    int nchunks;
+    compress_chunk_t *chunks;
+    int fill;                   // chunk filled by the producer
+    int next_job;               // next chunk for the workers
+    int next_write;             // next chunk to be written
+    bool stop;
+    int error;
+    pthread_mutex_t mutex;
+    pthread_cond_t queued;
+    pthread_cond_t done;
+};
+
+static void *compressor_thread(void *arg) {
+    compressor_t *c = (compressor_t *) arg;
+    compress_chunk_t *chunk;
+    ZSTD_CCtx *cctx = ZSTD_createCCtx();
+    size_t ret;
+
+    pthread_mutex_lock(&c->mutex);
+    while (1) {
+        while (!c->stop && c->chunks[c->next_job].state != CHUNK_QUEUED) {
+            pthread_cond_wait(&c->queued, &c->mutex);
+        }
+        if (c->chunks[c->next_job].state != CHUNK_QUEUED) {
+            break;
+        }
+        chunk = &c->chunks[c->next_job];
+        c->next_job = (c->next_job + 1) % c->nchunks;
+        pthread_mutex_unlock(&c->mutex);
+
+        if (!cctx) {
+            ret = 0;
+            chunk->error = ENOMEM;
+        } else {
+            ret = ZSTD_compressCCtx(cctx, chunk->output, ZSTD_compressBound(COMPRESS_CHUNK),
+                                    chunk->input, chunk->input_length, c->level);
+            if (ZSTD_isError(ret)) {
+                DPRINT("compressor: %s\n", ZSTD_getErrorName(ret));
+                ret = 0;
+                chunk->error = EIO;
+            }
+        }
+
+        pthread_mutex_lock(&c->mutex);
+        chunk->output_length = ret;
+        chunk->state = CHUNK_DONE;
+        pthread_cond_broadcast(&c->done);
+    }
+    pthread_mutex_unlock(&c->mutex);
+    ZSTD_freeCCtx(cctx);
+    return NULL;
+}
+
+/* Writes the oldest chunk, waiting for its compression */
+static void compressor_write_next(compressor_t *c) {
+    compress_chunk_t *chunk = &c->chunks[c->next_write];
+
+    pthread_mutex_lock(&c->mutex);
+    while (chunk->state != CHUNK_DONE) {
+        pthread_cond_wait(&c->done, &c->mutex);
+    }
+    pthread_mutex_unlock(&c->mutex);
+
+    if (chunk->error) {
+        c->error = chunk->error;
+    } else if (!c->error) {
+        writer_sink(chunk->output, chunk->output_length, 0, 0, (uintptr_t) c->writer);
+    }
+    chunk->input_length = 0;
+    chunk->error = 0;
+    chunk->state = CHUNK_FREE;
+    c->next_write = (c->next_write + 1) % c->nchunks;
+}
+
+static void compressor_queue(compressor_t *c) {
+    pthread_mutex_lock(&c->mutex);
+    c->chunks[c->fill].state = CHUNK_QUEUED;
+    pthread_cond_signal(&c->queued);
+    pthread_mutex_unlock(&c->mutex);
+    c->fill = (c->fill + 1) % c->nchunks;
+}
+
+static void compressor_free(compressor_t *c) {
+    int i;
+    for (i = 0; i < c->nchunks; i++) {
+        free(c->chunks[i].input);
+        free(c->chunks[i].output);
+    }
+    free(c->chunks);
+    free(c->threads);
+    pthread_mutex_destroy(&c->mutex);
+    pthread_cond_destroy(&c->queued);
+    pthread_cond_destroy(&c->done);
+    free(c);
+}
+
+static void compressor_stop(compressor_t *c, int started) {
+    int i;
+    pthread_mutex_lock(&c->mutex);
+    c->stop = true;
+    pthread_cond_broadcast(&c->queued);
+    pthread_mutex_unlock(&c->mutex);
+    for (i = 0; i < started; i++) {
+        pthread_join(c->threads[i], NULL);
+    }
+}
+
+compressor_t *compressor_open(writer_t *w, int level, int threads) {
+    compressor_t *c;
+    int i;
+
+    if (threads < 1) {
+        threads = 1;
+    }
+    c = calloc(1, sizeof(compressor_t));
+    if (!c) {
+        return NULL;
+    }
+    c->writer = w;
+    c->level = level;
+    c->nthreads = threads;
+    /* the producer fills one set while the other is compressed */
+    c->nchunks = 2 * threads;
+    pthread_mutex_init(&c->mutex, NULL);
+    pthread_cond_init(&c->queued, NULL);
+    pthread_cond_init(&c->done, NULL);
+    c->threads = calloc(threads, sizeof(pthread_t));
+    c->chunks = calloc(c->nchunks, sizeof(compress_chunk_t));
+    if (!c->threads || !c->chunks) {
+        compressor_free(c);
+        errno = ENOMEM;
+        return NULL;
+    }
+    for (i = 0; i < c->nchunks; i++) {
+        c->chunks[i].input = malloc(COMPRESS_CHUNK);
+        c->chunks[i].output = malloc(ZSTD_compressBound(COMPRESS_CHUNK));
+        if (!c->chunks[i].input || !c->chunks[i].output) {
+            compressor_free(c);
+            errno = ENOMEM;
+            return NULL;
+        }
+    }
+    for (i = 0; i < threads; i++) {
+        if (pthread_create(&c->threads[i], NULL, compressor_thread, c) != 0) {
+            compressor_stop(c, i);
+            compressor_free(c);
+            errno = EAGAIN;
+            return NULL;
+        }
+    }
+    DPRINT("compressor: level %d, %d threads\n", level, threads);
+    return c;
+}
+
+int compressor_write(compressor_t *c, const uint8_t *buf, uint32_t length) {
+    compress_chunk_t *chunk;
+    uint32_t n;
+
+    while (length > 0) {
+        chunk = &c->chunks[c->fill];
+        /* chunks are reused in order, the oldest is written first */
+        while (chunk->state != CHUNK_FREE) {
+            compressor_write_next(c);
+        }
+        n = COMPRESS_CHUNK - chunk->input_length;
+        if (n > length) {
+            n = length;
+        }
+        memcpy(chunk->input + chunk->input_length, buf, n);
+        chunk->input_length += n;
+        buf += n;
+        length -= n;
+        if (chunk->input_length == COMPRESS_CHUNK) {
+            compressor_queue(c);
+        }
+    }
+    return c->error;
+}
+
+int compressor_close(compressor_t *c) {
+    int ret;
+
+    if (c->chunks[c->fill].state == CHUNK_FREE && c->chunks[c->fill].input_length > 0) {
+        compressor_queue(c);
+    }
+    while (c->chunks[c->next_write].state != CHUNK_FREE) {
+        compressor_write_next(c);
+    }
+    compressor_stop(c, c->nthreads);
+    ret = c->error;
+    compressor_free(c);
+    return ret;
+}
+
+#else
+
+compressor_t *compressor_open(writer_t *w, int level, int threads) {
+    errno = ENOSYS;
+    return NULL;
+}
+
+int compressor_write(compressor_t *c, const uint8_t *buf, uint32_t length) {
+    return ENOSYS;
+}
+
+int compressor_close(compressor_t *c) {
+    return ENOSYS;
+}
+
+#endif
@@ -0,0 +1,48 @@
+/*
+    pkTriggerCord
+    Copyright (C) 2011-2016 Andras Salamon <andras.salamon@melda.info>
+    Remote control of Pentax DSLR cameras.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    and GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef PKTRIGGERCORD_COMPRESS_H
+#define PKTRIGGERCORD_COMPRESS_H
+
+#include <stdint.h>
+
+#include "pktriggercord-writer.h"
+
+/* Input size of one zstd frame */
+#define COMPRESS_CHUNK (1024 * 1024)
+#define COMPRESS_LEVEL 3
+
+/* Compresses the image in front of a writer. The input is cut into
+ * COMPRESS_CHUNK sized chunks, each becomes an independent zstd frame
+ * compressed on a pool of worker threads. The frames are written in
+ * order, so the output is a normal multi-frame .zst file.
+ *
+ *   c = compressor_open(w, level, threads);
+ *   compressor_write(c, buf, length);   // any number of times
+ *   ret = compressor_close(c);          // the writer stays open
+ *
+ * Needs libzstd (HAVE_ZSTD), otherwise compressor_open fails with
+ * ENOSYS. */
+typedef struct compressor compressor_t;
+
+compressor_t *compressor_open(writer_t *w, int level, int threads);
+int compressor_write(compressor_t *c, const uint8_t *buf, uint32_t length);
+int compressor_close(compressor_t *c);
+
+#endif
@@ -0,0 +1,342 @@
+/*
+    pkTriggerCord
+    Copyright (C) 2011-2016 Andras Salamon <andras.salamon@melda.info>
+    Remote control of Pentax DSLR cameras.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    and GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "pktriggercord-output.h"
+
+#ifdef WIN32
+#define O_BINARY_FLAG O_BINARY
+#else
+#define O_BINARY_FLAG 0
+#endif
+
+#define OUTPUT_DEFAULT_WIDTH 4
+#define OUTPUT_TMP_SUFFIX ".part"
+
+typedef enum {
+    SEGMENT_TEXT,
+    SEGMENT_FRAME,
+    SEGMENT_EXTENSION,
+    SEGMENT_TIME,
+    SEGMENT_ISO,
+    SEGMENT_SHUTTER,
+    SEGMENT_APERTURE
+} segment_type_t;
+
+typedef struct {
+    segment_type_t type;
+    int width;                  // SEGMENT_FRAME
+    char *text;                 // SEGMENT_TEXT
+} segment_t;
+
+struct output {
+#ifndef WIN32
+    int dirfd;
+#endif
+    char *dir;
+    segment_t *segments;
+    int segment_count;
+};
+
+static int output_add_segment(output_t *o, segment_type_t type, int width, const char *text, size_t length) {
+    segment_t *segments = realloc(o->segments, (o->segment_count + 1) * sizeof(segment_t));
+    segment_t *s;
+
+    if (!segments) {
+        return -1;
+    }
+    o->segments = segments;
+    s = &o->segments[o->segment_count];
+    s->type = type;
+    s->width = width;
+    s->text = NULL;
+    if (text) {
+        s->text = malloc(length + 1);
+        if (!s->text) {
+            return -1;
+        }
+        memcpy(s->text, text, length);
+        s->text[length] = '\0';
+    }
+    o->segment_count++;
+    return 0;
+}
+
+static int output_compile(output_t *o, const char *template) {
+    const char *p = template;
+    const char *text = template;
+    int width;
+    int ret = 0;
+
+    while (*p && ret == 0) {
+        if (*p != '%') {
+            p++;
+            continue;
+        }
+        if (p > text) {
+            ret = output_add_segment(o, SEGMENT_TEXT, 0, text, p - text);
+        }
+        p++;
+        width = 0;
+        while (*p >= '0' && *p <= '9') {
+            width = width * 10 + *p++ - '0';
+        }
+        switch (*p) {
+        case 'n':
+            ret = output_add_segment(o, SEGMENT_FRAME, width ? width : OUTPUT_DEFAULT_WIDTH, NULL, 0);
+            break;
+        case 'e':
+            ret = output_add_segment(o, SEGMENT_EXTENSION, 0, NULL, 0);
+            break;
+        case 't':
+            ret = output_add_segment(o, SEGMENT_TIME, 0, NULL, 0);
+            break;
+        case 'i':
+            ret = output_add_segment(o, SEGMENT_ISO, 0, NULL, 0);
+            break;
+        case 's':
+            ret = output_add_segment(o, SEGMENT_SHUTTER, 0, NULL, 0);
+            break;
+        case 'a':
+            ret = output_add_segment(o, SEGMENT_APERTURE, 0, NULL, 0);
+            break;
+        case '%':
+            ret = output_add_segment(o, SEGMENT_TEXT, 0, "%", 1);
+            break;
+        default:
+            fprintf(stderr, "Invalid file name template: %s\n", template);
+            return -1;
+        }
+        text = ++p;
+    }
+    if (ret == 0 && p > text) {
+        ret = output_add_segment(o, SEGMENT_TEXT, 0, text, p - text);
+    }
+    return ret;
+}
+
+output_t *output_open(const char *dir, const char *template) {
+    output_t *o = calloc(1, sizeof(output_t));
+
+    if (!o) {
+        return NULL;
+    }
+#ifndef WIN32
+    o->dirfd = -1;
+#endif
+    o->dir = strdup(dir ? dir : ".");
+    if (!o->dir) {
+        output_free(o);
+        return NULL;
+    }
+#ifndef WIN32
+    o->dirfd = open(o->dir, O_RDONLY | O_DIRECTORY);
+    if (o->dirfd == -1) {
+        fprintf(stderr, "Could not open directory %s: %s\n", o->dir, strerror(errno));
+        output_free(o);
+        return NULL;
+    }
+#endif
+    if (template && output_compile(o, template) != 0) {
+        output_free(o);
+        return NULL;
+    }
+    return o;
+}
+
+void output_free(output_t *o) {
+    int i;
+
+    if (!o) {
+        return;
+    }
+#ifndef WIN32
+    if (o->dirfd != -1) {
+        close(o->dirfd);
+    }
+#endif
+    for (i = 0; i < o->segment_count; i++) {
+        free(o->segments[i].text);
+    }
+    free(o->segments);
+    free(o->dir);
+    free(o);
+}
+
+int output_name(output_t *o, char *name, size_t size, int frame, const char *extension, pslr_status *status) {
+    size_t length = 0;
+    time_t now = time(NULL);
+    struct tm *tm;
+    segment_t *s;
+    int n = 0;
+    int i;
+
+    for (i = 0; i < o->segment_count && length < size; i++) {
+        s = &o->segments[i];
+        switch (s->type) {
+        case SEGMENT_TEXT:
+            n = snprintf(name + length, size - length, "%s", s->text);
+            break;
+        case SEGMENT_FRAME:
+            n = snprintf(name + length, size - length, "%0*d", s->width, frame);
+            break;
+        case SEGMENT_EXTENSION:
+            n = snprintf(name + length, size - length, "%s", extension);
+            break;
+        case SEGMENT_TIME:
+            tm = localtime(&now);
+            n = strftime(name + length, size - length, "%Y%m%d-%H%M%S", tm);
+            break;
+        case SEGMENT_ISO:
+            n = snprintf(name + length, size - length, "%d", status ? status->current_iso : 0);
+            break;
+        case SEGMENT_SHUTTER:
+            if (!status || status->current_shutter_speed.denom == 0) {
+                n = snprintf(name + length, size - length, "0");
+            } else if (status->current_shutter_speed.nom == 1 && status->current_shutter_speed.denom > 1) {
+                n = snprintf(name + length, size - length, "1_%d", status->current_shutter_speed.denom);
+            } else {
+                n = snprintf(name + length, size - length, "%gs",
+                             (double) status->current_shutter_speed.nom / status->current_shutter_speed.denom);
+            }
+            break;
+        case SEGMENT_APERTURE:
+            n = snprintf(name + length, size - length, "f%.1f",
+                         status && status->current_aperture.denom ?
+                         (double) status->current_aperture.nom / status->current_aperture.denom : 0.0);
+            break;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        length += n;
+    }
+    if (length >= size) {
+        fprintf(stderr, "File name is too long\n");
+        return -1;
+    }
+    name[length] = '\0';
+    return 0;
+}
+
+int output_create(output_t *o, const char *name, bool read_write) {
+    int flags = (read_write ? O_RDWR : O_WRONLY) | O_BINARY_FLAG;
+    char tmp_name[FILENAME_MAX];
+    int fd;
+
+#ifdef O_TMPFILE
+    /* unnamed until output_publish links it through /proc */
+    if (access("/proc/self/fd", X_OK) == 0) {
+        fd = openat(o->dirfd, ".", O_TMPFILE | flags, 0664);
+        if (fd != -1) {
+            return fd;
+        }
+        // not supported by the filesystem
+    }
+#endif
+#ifndef WIN32
+    snprintf(tmp_name, sizeof(tmp_name), "%s%s", name, OUTPUT_TMP_SUFFIX);
+    fd = openat(o->dirfd, tmp_name, flags | O_CREAT | O_TRUNC, 0664);
+#else
+    snprintf(tmp_name, sizeof(tmp_name), "%s/%s%s", o->dir, name, OUTPUT_TMP_SUFFIX);
+    fd = open(tmp_name, flags | O_CREAT | O_TRUNC, 0664);
+#endif
+    if (fd == -1) {
+        fprintf(stderr, "Could not open %s: %s\n", tmp_name, strerror(errno));
+    }
+    return fd;
+}
+
+/* The file has no name yet (O_TMPFILE) */
+static bool output_is_unnamed(int fd) {
+#ifdef O_TMPFILE
+    struct stat st;
+    return fstat(fd, &st) == 0 && st.st_nlink == 0;
+#else
+    return false;
+#endif
+}
+
+int output_publish(output_t *o, int fd, const char *name, bool ok) {
+    char tmp_name[FILENAME_MAX];
+    int ret = 0;
+#ifdef O_TMPFILE
+    char proc_name[64];
+#endif
+
+    snprintf(tmp_name, sizeof(tmp_name), "%s%s", name, OUTPUT_TMP_SUFFIX);
+    if (output_is_unnamed(fd)) {
+#ifdef O_TMPFILE
+        if (!ok) {
+            // the file vanishes with the descriptor
+            close(fd);
+            return -1;
+        }
+        snprintf(proc_name, sizeof(proc_name), "/proc/self/fd/%d", fd);
+        if (linkat(AT_FDCWD, proc_name, o->dirfd, name, AT_SYMLINK_FOLLOW) == -1) {
+            if (errno != EEXIST
+                || linkat(AT_FDCWD, proc_name, o->dirfd, tmp_name, AT_SYMLINK_FOLLOW) == -1
+                || renameat(o->dirfd, tmp_name, o->dirfd, name) == -1) {
+                fprintf(stderr, "Could not save %s: %s\n", name, strerror(errno));
+                ret = -1;
+            }
+        }
+#endif
+        close(fd);
+        return ret;
+    }
+    close(fd);
+    if (!ok) {
+        fprintf(stderr, "Download failed, partial file left as %s\n", tmp_name);
+        return -1;
+    }
+#ifndef WIN32
+    if (renameat(o->dirfd, tmp_name, o->dirfd, name) == -1) {
+        fprintf(stderr, "Could not save %s: %s\n", name, strerror(errno));
+        ret = -1;
+    }
+#else
+    {
+        char path[FILENAME_MAX];
+        char tmp_path[FILENAME_MAX];
+        snprintf(path, sizeof(path), "%s/%s", o->dir, name);
+        snprintf(tmp_path, sizeof(tmp_path), "%s/%s", o->dir, tmp_name);
+        // rename does not replace an existing file
+        unlink(path);
+        if (rename(tmp_path, path) == -1) {
+            perror("rename");
+            ret = -1;
+        }
+    }
+#endif
+    return ret;
+}
@@ -0,0 +1,61 @@
+/*
+    pkTriggerCord
+    Copyright (C) 2011-2016 Andras Salamon <andras.salamon@melda.info>
+    Remote control of Pentax DSLR cameras.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    and GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef PKTRIGGERCORD_OUTPUT_H
+#define PKTRIGGERCORD_OUTPUT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "pslr.h"
+
+/* Output directory of the saved images. The directory is opened once,
+ * the files are created relative to it and published atomically
+ * (O_TMPFILE and linkat, or a .part file and renameat), so other
+ * programs never see a partial file.
+ *
+ * File names come from a template, parsed once by output_open:
+ *   %n   frame number, at least 4 digits (%6n: at least 6 digits)
+ *   %e   extension of the file format
+ *   %t   local time, YYYYMMDD-HHMMSS
+ *   %i   ISO
+ *   %s   shutter speed, e.g. 1_250 or 2.5s
+ *   %a   aperture, e.g. f5.6
+ *   %%   percent sign
+ *
+ *   o = output_open(dir, "img-%6n.%e");
+ *   output_name(o, name, sizeof(name), frame, "pef", &status);
+ *   fd = output_create(o, name, false);
+ *   ... write fd ...
+ *   output_publish(o, fd, name, ok);      // closes fd
+ *   output_free(o);
+ */
+typedef struct output output_t;
+
+/* dir NULL is the current directory */
+output_t *output_open(const char *dir, const char *template);
+void output_free(output_t *o);
+int output_name(output_t *o, char *name, size_t size, int frame, const char *extension, pslr_status *status);
+/* read_write is needed for memory mapping the file */
+int output_create(output_t *o, const char *name, bool read_write);
+/* Gives the file its name, a failed file is removed (O_TMPFILE) or
+ * left as name.part. Returns 0 on success. */
+int output_publish(output_t *o, int fd, const char *name, bool ok);
+
+#endif
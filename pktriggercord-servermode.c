@@ -26,19 +26,35 @@
     and GNU Lesser General Public License
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
+#define _GNU_SOURCE
+
 #ifndef WIN32
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
 #include <arpa/inet.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <strings.h>
 #endif
 
 #include <stdio.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <string.h>
 #include <sys/time.h>
 #include <stdlib.h>
 
 #include <unistd.h>
+#include <time.h>
 
 #include "pslr.h"
 #include "pslr_lens.h"
+#include "pktriggercord-servermode.h"
 
 long int timeval_diff(struct timeval *t2, struct timeval *t1) {
     return (t2->tv_usec + 1000000 * t2->tv_sec) - (t1->tv_usec + 1000000 * t1->tv_sec);
@@ -83,21 +99,468 @@ pslr_handle_t camera_connect( char *model, char *device, int timeout, char *erro
 }
 
 #ifndef WIN32
-int client_sock;
+#define SERVER_LINE_MAX 2000
+#define SERVER_MAX_LISTEN 8
+#define SERVER_MAX_EVENTS 64
+#define SERVER_MAX_CAMERAS 16
+#define SERVER_OUT_MIN 4096
+/* Buffer downloads are split into chunks of this size, other
+   commands run between the chunks. */
+#define SERVER_TRANSFER_CHUNK (256 * 1024)
+
+/* A download to a client is paused while more than the high watermark
+   of its answers waits to be sent, and resumed below the low one */
+#define SERVER_HIGH_WATERMARK (4 * 1024 * 1024)
+#define SERVER_LOW_WATERMARK (1024 * 1024)
+
+/* Upper bounds (seconds) of the request latency histogram buckets */
+static const double server_latency_buckets[] = { 0.001, 0.005, 0.01, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10 };
+#define SERVER_LATENCY_BUCKETS (sizeof(server_latency_buckets) / sizeof(server_latency_buckets[0]))
+
+/* The commands counted in the statistics, the last one counts the rest */
+static const char *const server_command_names[] = {
+    "connect", "disconnect", "stopserver", "echo", "list_cameras", "stats",
+    "update_status", "get_status", "subscribe", "unsubscribe", "get_camera_name",
+    "get_lens_name", "get_current_shutter_speed", "get_current_aperture",
+    "get_current_iso", "get_bufmask", "focus", "shutter", "delete_buffer",
+    "get_preview_buffer", "get_buffer", "get_buffer_fd", "other"
+};
+#define SERVER_COMMAND_COUNT (sizeof(server_command_names) / sizeof(server_command_names[0]))
+
+#if defined(__linux__) && defined(MFD_ALLOW_SEALING) && defined(F_SEAL_WRITE)
+#define HAVE_MEMFD
+#endif
+
+/* Everything registered in the epoll set starts with this, so
+   the event loop can tell the sockets apart. */
+typedef enum {
+    SERVER_LISTENER,
+    SERVER_CLIENT,
+    SERVER_WAKEUP
+} server_endpoint_kind;
+
+typedef struct {
+    server_endpoint_kind kind;
+    int fd;
+} server_endpoint_t;
+
+struct server_conn;
+struct server_camera;
+
+/* Answer bytes produced by the camera worker for a connection */
+typedef struct server_chunk {
+    struct server_conn *conn;
+    int fd;                 /* passed with the first byte, or -1 */
+    bool close;             /* close the connection after this chunk */
+    size_t length;
+    size_t size;
+    struct server_chunk *next;
+    uint8_t data[];
+} server_chunk_t;
+
+/* A command waiting for (or being executed by) the camera worker */
+typedef struct server_job {
+    struct server_conn *conn;
+    struct server_camera *camera; /* executes the command */
+    uint32_t id;            /* request id of the binary protocol */
+    char command[SERVER_LINE_MAX+1];
+    bool transfer;          /* the job downloads a camera buffer */
+    bool suspended;         /* download paused, the buffer is closed */
+    bool failed;            /* the download ended early */
+    bool stop;              /* stopserver, set by the worker */
+    uint32_t remaining;     /* bytes of the buffer still to send */
+    server_chunk_t *reply;
+    bool data;              /* the reply has binary data from data_start */
+    size_t data_start;
+    bool event;             /* status event, not an answer */
+    bool more_sent;         /* a frame with SERVERMODE_FRAME_MORE went out */
+    int memfd;              /* get_buffer_fd downloads into this memfd */
+    uint8_t *map;
+    uint32_t size;
+    int reply_fd;           /* passed to the client with the reply */
+    bool range;             /* part of the buffer was requested */
+    uint32_t offset;
+    uint32_t total;         /* size of the whole buffer */
+    int bufno;              /* the downloaded buffer, reopened after a pause */
+    pslr_buffer_type buftype;
+    int resolution;
+    uint32_t position;      /* buffer offset of the next chunk */
+    bool answered;          /* answered by the event loop, the reply is ready */
+    struct timespec queued;
+    struct server_job *parent; /* broadcast this job is a part of */
+    int parts;              /* parts of a broadcast still running */
+    uint32_t targets;       /* cameras of a broadcast */
+    uint32_t failures;      /* cameras of a broadcast answering an error */
+    struct server_job *next;
+} server_job_t;
+
+/* A file descriptor waiting in the answer queue of a local client */
+typedef struct server_fd {
+    uint64_t position;      /* sent with this byte of the answer stream */
+    int fd;
+    struct server_fd *next;
+} server_fd_t;
+
+typedef struct server_conn {
+    server_endpoint_t ep;
+    bool local;             /* unix socket, can receive file descriptors */
+    char in[SERVER_LINE_MAX+1];
+    size_t in_length;
+    bool discard;           /* skipping the rest of a too long command */
+    bool detected;          /* the protocol is known */
+    bool binary;            /* framed protocol */
+    bool http;              /* metrics request of a web client */
+    uint32_t skip;          /* payload bytes of a rejected frame to skip */
+    uint8_t *out;
+    size_t out_offset;      /* first byte not yet sent */
+    size_t out_length;
+    size_t out_size;
+    uint64_t out_sent;      /* bytes sent since the connection was accepted */
+    server_fd_t *fds;
+    server_fd_t *fds_tail;
+    uint32_t events;        /* registered in the epoll set */
+    struct timespec last_progress; /* of sending the queued answers */
+    bool closing;           /* close after the answers are sent */
+    struct server_conn *next;
+    /* protected by the server mutex */
+    server_job_t *jobs;     /* executed in order */
+    server_job_t *jobs_tail;
+    struct server_conn *ready_next[SERVER_MAX_CAMERAS];
+    uint32_t ready;         /* in the round robin lists of these workers */
+    bool dead;              /* socket closed, drop the jobs */
+    int pending;            /* jobs and undelivered chunks */
+    int64_t backlog;        /* answer bytes not sent yet */
+    bool paused;            /* downloads wait for the backlog to drain */
+    uint64_t sub_mask;      /* subscribed status fields */
+    uint64_t sub_changed;   /* changed fields not reported yet */
+    uint16_t sub_new_buffers;
+    struct server_camera *sub_camera; /* the subscription is for this camera */
+    struct server_conn *sub_next;
+} server_conn_t;
+
+/* Each camera is owned by a worker thread. The event loop queues the
+   commands per connection, the worker takes one step of a connection
+   at a time in round robin order: a short command, or one chunk of a
+   buffer download. While clients are subscribed, the worker also polls
+   the status of the camera and pushes the changes to them. */
+typedef struct server_camera {
+    int index;
+    char device[64];            /* found at start, empty if unknown */
+    char serial[64];
+    pthread_t thread;
+    pthread_cond_t cond;
+    /* protected by the server mutex */
+    server_conn_t *ready;
+    server_conn_t *ready_tail;
+    server_job_t *buffer_owner; /* job streaming the open buffer */
+    bool quit;
+    char name[64];              /* model, while connected */
+    int queued;                 /* jobs waiting or running */
+    uint64_t downloaded;        /* buffer bytes read from the camera */
+    double download_seconds;    /* spent reading them */
+    server_conn_t *subscribers;
+    pslr_status polled;         /* last status compared for the subscribers */
+    bool polled_valid;
+    server_job_t notify;        /* builds the change events */
+    /* used by the worker only */
+    int poll_interval;          /* ms */
+    struct timespec next_poll;
+    pslr_handle_t camhandle;
+    pslr_status status;
+} server_camera_t;
+
+typedef struct {
+    uint64_t count;
+    uint64_t buckets[SERVER_LATENCY_BUCKETS];
+    double seconds;
+} server_command_stats_t;
+
+/* Counters of the server, the event loop owns the first ones */
+typedef struct {
+    uint64_t accepted;
+    uint64_t bytes_sent;
+    uint64_t http_requests;
+    /* protected by the server mutex */
+    server_command_stats_t commands[SERVER_COMMAND_COUNT];
+} server_stats_t;
+
+typedef struct {
+    int epoll_fd;
+    server_endpoint_t listeners[SERVER_MAX_LISTEN];
+    int listener_count;
+    const char *unix_path;  /* removed when the server stops */
+    server_conn_t *conns;
+    server_conn_t *closed;  /* freed once nothing refers to them */
+    int conn_count;
+    bool stop;
+    pthread_mutex_t mutex;  /* of the connection queues and the cameras */
+    server_endpoint_t wakeup;   /* eventfd, signalled when chunks are done */
+    server_chunk_t *done;
+    server_chunk_t *done_tail;
+    bool stopping;          /* stopserver was executed */
+    server_camera_t cameras[SERVER_MAX_CAMERAS];
+    int camera_count;
+    server_stats_t stats;
+} server_t;
+
+static server_t server;
+
+static int set_nonblocking(int fd, bool nonblocking) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) {
+        return -1;
+    }
+    flags = nonblocking ? flags | O_NONBLOCK : flags & ~O_NONBLOCK;
+    return fcntl(fd, F_SETFL, flags);
+}
+
+/* Reads until the end of file, waits for writability while answers are queued */
+static int conn_events(server_conn_t *conn) {
+    struct epoll_event ev;
+    uint32_t events = (conn->closing ? 0 : EPOLLIN) | (conn->out_offset < conn->out_length ? EPOLLOUT : 0);
+    if (conn->events == events) {
+        return 0;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = &conn->ep;
+    conn->events = events;
+    return epoll_ctl(server.epoll_fd, EPOLL_CTL_MOD, conn->ep.fd, &ev);
+}
+
+/* Wakes up every worker, called with the mutex held */
+static void servermode_signal_all(void) {
+    int i;
+    for (i = 0; i < server.camera_count; ++i) {
+        pthread_cond_signal(&server.cameras[i].cond);
+    }
+}
+
+static void conn_close(server_conn_t *conn) {
+    server_conn_t **p;
+    for (p = &server.conns; *p; p = &(*p)->next) {
+        if (*p == conn) {
+            *p = conn->next;
+            break;
+        }
+    }
+    epoll_ctl(server.epoll_fd, EPOLL_CTL_DEL, conn->ep.fd, NULL);
+    close(conn->ep.fd);
+    conn->ep.fd = -1;
+    pthread_mutex_lock(&server.mutex);
+    conn->dead = true;
+    if (conn->sub_camera) {
+        for (p = &conn->sub_camera->subscribers; *p; p = &(*p)->sub_next) {
+            if (*p == conn) {
+                *p = conn->sub_next;
+                break;
+            }
+        }
+        conn->sub_camera = NULL;
+    }
+    // a paused download of the connection can be dropped now
+    servermode_signal_all();
+    pthread_mutex_unlock(&server.mutex);
+    conn->next = server.closed;
+    server.closed = conn;
+    --server.conn_count;
+    DPRINT("Client disconnected, %d left\n", server.conn_count);
+}
+
+/* Accounts answer bytes queued (positive) or sent (negative) by the
+   event loop, a paused download resumes below the low watermark */
+static void conn_backlog(server_conn_t *conn, int64_t delta) {
+    pthread_mutex_lock(&server.mutex);
+    conn->backlog += delta;
+    if (conn->paused && conn->backlog <= SERVER_LOW_WATERMARK) {
+        conn->paused = false;
+        servermode_signal_all();
+    }
+    pthread_mutex_unlock(&server.mutex);
+}
+
+/* Sends as much of the queued answers as the socket takes
+   without blocking. Returns -1 if the connection was closed. */
+static int conn_flush(server_conn_t *conn) {
+    uint64_t start = conn->out_sent;
+
+    while (conn->out_offset < conn->out_length) {
+        size_t length = conn->out_length - conn->out_offset;
+        server_fd_t *f = conn->fds;
+        ssize_t r;
+
+        if (f && f->position == conn->out_sent) {
+            // the descriptor goes with the first byte of its answer
+            char control[CMSG_SPACE(sizeof(int))];
+            struct msghdr msg;
+            struct iovec iov;
+            struct cmsghdr *cmsg;
+
+            memset(&msg, 0, sizeof(msg));
+            memset(control, 0, sizeof(control));
+            iov.iov_base = conn->out + conn->out_offset;
+            iov.iov_len = f->next && f->next->position - conn->out_sent < length ? f->next->position - conn->out_sent : length;
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+            memcpy(CMSG_DATA(cmsg), &f->fd, sizeof(int));
+            r = sendmsg(conn->ep.fd, &msg, MSG_NOSIGNAL);
+            if (r > 0) {
+                conn->fds = f->next;
+                if (!conn->fds) {
+                    conn->fds_tail = NULL;
+                }
+                close(f->fd);
+                free(f);
+            }
+        } else {
+            if (f && f->position - conn->out_sent < length) {
+                length = f->position - conn->out_sent;
+            }
+            r = send(conn->ep.fd, conn->out + conn->out_offset, length, MSG_NOSIGNAL);
+        }
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                conn_events(conn);
+                if (conn->out_sent != start) {
+                    clock_gettime(CLOCK_MONOTONIC, &conn->last_progress);
+                    conn_backlog(conn, -(int64_t) (conn->out_sent - start));
+                    server.stats.bytes_sent += conn->out_sent - start;
+                }
+                return 0;
+            }
+            DPRINT("send failed: %s\n", strerror(errno));
+            conn_close(conn);
+            return -1;
+        }
+        conn->out_offset += r;
+        conn->out_sent += r;
+    }
+    conn->out_offset = conn->out_length = 0;
+    conn_events(conn);
+    if (conn->out_sent != start) {
+        conn_backlog(conn, -(int64_t) (conn->out_sent - start));
+        server.stats.bytes_sent += conn->out_sent - start;
+    }
+    if (conn->closing) {
+        bool busy;
+        pthread_mutex_lock(&server.mutex);
+        busy = conn->pending > 0;
+        pthread_mutex_unlock(&server.mutex);
+        if (!busy) {
+            conn_close(conn);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Queues bytes on the connection, they are sent by conn_flush */
+static void conn_queue( server_conn_t *conn, const uint8_t *data, size_t length ) {
+    if (conn->out_offset == conn->out_length) {
+        // the send timeout counts from here
+        clock_gettime(CLOCK_MONOTONIC, &conn->last_progress);
+    }
+    if (conn->out_offset > 0 && conn->out_length + length > conn->out_size) {
+        memmove(conn->out, conn->out + conn->out_offset, conn->out_length - conn->out_offset);
+        conn->out_length -= conn->out_offset;
+        conn->out_offset = 0;
+    }
+    if (conn->out_length + length > conn->out_size) {
+        size_t size = conn->out_size ? conn->out_size : SERVER_OUT_MIN;
+        uint8_t *out;
+        while (size < conn->out_length + length) {
+            size *= 2;
+        }
+        out = realloc(conn->out, size);
+        if (!out) {
+            fprintf(stderr, "Cannot queue %zu bytes for the client\n", length);
+            conn->closing = true;
+            return;
+        }
+        conn->out = out;
+        conn->out_size = size;
+    }
+    memcpy(conn->out + conn->out_length, data, length);
+    conn->out_length += length;
+}
 
-void write_socket_answer( char *answer ) {
-    ssize_t r = write(client_sock , answer , strlen(answer));
-    if (r != 0) {
-      fprintf(stderr, "write(answer) failed");
+/* Passes fd to the client with the next queued byte, the fd is closed after sending */
+static void conn_queue_fd( server_conn_t *conn, int fd ) {
+    server_fd_t *f = malloc(sizeof(server_fd_t));
+    if (!f) {
+        fprintf(stderr, "Cannot queue the file descriptor for the client\n");
+        close(fd);
+        conn->closing = true;
+        return;
     }
+    f->position = conn->out_sent + conn->out_length - conn->out_offset;
+    f->fd = fd;
+    f->next = NULL;
+    if (conn->fds_tail) {
+        conn->fds_tail->next = f;
+    } else {
+        conn->fds = f;
+    }
+    conn->fds_tail = f;
+}
+
+/* Makes room for length more bytes in the reply of the job */
+static uint8_t *job_reserve( server_job_t *job, size_t length ) {
+    server_chunk_t *reply = job->reply;
+    if (!reply || reply->length + length > reply->size) {
+        size_t size = reply ? reply->size : SERVER_OUT_MIN;
+        while (size < (reply ? reply->length : 0) + length) {
+            size *= 2;
+        }
+        reply = realloc(reply, sizeof(server_chunk_t) + size);
+        if (!reply) {
+            return NULL;
+        }
+        if (!job->reply) {
+            reply->length = 0;
+        }
+        reply->size = size;
+        job->reply = reply;
+    }
+    return reply->data + reply->length;
 }
 
-void write_socket_answer_bin( uint8_t *answer, uint32_t length ) {
-    ssize_t r = write(client_sock , answer , length);
-    if (r != 0) {
-      fprintf(stderr, "write(answer) failed");
+static void write_socket_answer_bin( server_job_t *job, const uint8_t *answer, uint32_t length ) {
+    uint8_t *p = job_reserve(job, length);
+    if (!p) {
+        fprintf(stderr, "Cannot queue %u bytes for the client\n", length);
+        return;
     }
+    memcpy(p, answer, length);
+    job->reply->length += length;
+}
 
+/* The rest of the reply is binary data, e.g. an image */
+static void write_socket_data_begin( server_job_t *job ) {
+    job->data = true;
+    job->data_start = job->reply ? job->reply->length : 0;
+}
+
+static void write_socket_answer( server_job_t *job, const char *answer ) {
+    write_socket_answer_bin(job, (const uint8_t *) answer, strlen(answer));
+}
+
+static void write_socket_printf( server_job_t *job, const char *format, ... ) {
+    char buf[2100];
+    va_list ap;
+    va_start(ap, format);
+    vsnprintf(buf, sizeof(buf), format, ap);
+    va_end(ap);
+    write_socket_answer(job, buf);
 }
 
 void strip(char *s) {
@@ -112,187 +575,2043 @@ void strip(char *s) {
     *p2 = '\0';
 }
 
-int servermode_socket(int servermode_timeout) {
-    int socket_desc, c , read_size;
-    struct sockaddr_in server , client;
-    char client_message[2000];
-    char buf[2100];
-    pslr_handle_t camhandle=NULL;
-    pslr_status status;
+typedef enum {
+    STATUS_UINT16,
+    STATUS_UINT32,
+    STATUS_INT32,
+    STATUS_RATIONAL,
+    STATUS_CAMERA_NAME,
+    STATUS_LENS_NAME
+} server_status_kind;
 
-    //Create socket
-    socket_desc = socket(AF_INET , SOCK_STREAM , 0);
-    if (socket_desc == -1) {
-        fprintf(stderr, "Could not create socket");
+/* A field of the get_status answer */
+typedef struct {
+    const char *name;
+    server_status_kind kind;
+    size_t offset;
+} server_status_field_t;
+
+#define STATUS_FIELD(field, kind) { #field, kind, offsetof(pslr_status, field) }
+
+static const server_status_field_t server_status_fields[] = {
+    { "camera_name", STATUS_CAMERA_NAME, 0 },
+    { "lens_name", STATUS_LENS_NAME, 0 },
+    STATUS_FIELD(bufmask, STATUS_UINT16),
+    STATUS_FIELD(current_iso, STATUS_UINT32),
+    STATUS_FIELD(current_shutter_speed, STATUS_RATIONAL),
+    STATUS_FIELD(current_aperture, STATUS_RATIONAL),
+    STATUS_FIELD(lens_max_aperture, STATUS_RATIONAL),
+    STATUS_FIELD(lens_min_aperture, STATUS_RATIONAL),
+    STATUS_FIELD(set_shutter_speed, STATUS_RATIONAL),
+    STATUS_FIELD(set_aperture, STATUS_RATIONAL),
+    STATUS_FIELD(max_shutter_speed, STATUS_RATIONAL),
+    STATUS_FIELD(auto_bracket_mode, STATUS_UINT32),
+    STATUS_FIELD(auto_bracket_ev, STATUS_RATIONAL),
+    STATUS_FIELD(auto_bracket_picture_count, STATUS_UINT32),
+    STATUS_FIELD(fixed_iso, STATUS_UINT32),
+    STATUS_FIELD(jpeg_resolution, STATUS_UINT32),
+    STATUS_FIELD(jpeg_saturation, STATUS_UINT32),
+    STATUS_FIELD(jpeg_quality, STATUS_UINT32),
+    STATUS_FIELD(jpeg_contrast, STATUS_UINT32),
+    STATUS_FIELD(jpeg_sharpness, STATUS_UINT32),
+    STATUS_FIELD(jpeg_image_tone, STATUS_UINT32),
+    STATUS_FIELD(jpeg_hue, STATUS_UINT32),
+    STATUS_FIELD(zoom, STATUS_RATIONAL),
+    STATUS_FIELD(focus, STATUS_INT32),
+    STATUS_FIELD(image_format, STATUS_UINT32),
+    STATUS_FIELD(raw_format, STATUS_UINT32),
+    STATUS_FIELD(light_meter_flags, STATUS_UINT32),
+    STATUS_FIELD(ec, STATUS_RATIONAL),
+    STATUS_FIELD(custom_ev_steps, STATUS_UINT32),
+    STATUS_FIELD(custom_sensitivity_steps, STATUS_UINT32),
+    STATUS_FIELD(exposure_mode, STATUS_UINT32),
+    STATUS_FIELD(exposure_submode, STATUS_UINT32),
+    STATUS_FIELD(user_mode_flag, STATUS_UINT32),
+    STATUS_FIELD(ae_metering_mode, STATUS_UINT32),
+    STATUS_FIELD(af_mode, STATUS_UINT32),
+    STATUS_FIELD(af_point_select, STATUS_UINT32),
+    STATUS_FIELD(selected_af_point, STATUS_UINT32),
+    STATUS_FIELD(focused_af_point, STATUS_UINT32),
+    STATUS_FIELD(auto_iso_min, STATUS_UINT32),
+    STATUS_FIELD(auto_iso_max, STATUS_UINT32),
+    STATUS_FIELD(drive_mode, STATUS_UINT32),
+    STATUS_FIELD(shake_reduction, STATUS_UINT32),
+    STATUS_FIELD(white_balance_mode, STATUS_UINT32),
+    STATUS_FIELD(white_balance_adjust_mg, STATUS_UINT32),
+    STATUS_FIELD(white_balance_adjust_ba, STATUS_UINT32),
+    STATUS_FIELD(flash_mode, STATUS_UINT32),
+    STATUS_FIELD(flash_exposure_compensation, STATUS_INT32),
+    STATUS_FIELD(manual_mode_ev, STATUS_INT32),
+    STATUS_FIELD(color_space, STATUS_UINT32),
+    STATUS_FIELD(lens_id1, STATUS_UINT32),
+    STATUS_FIELD(lens_id2, STATUS_UINT32),
+    STATUS_FIELD(battery_1, STATUS_UINT32),
+    STATUS_FIELD(battery_2, STATUS_UINT32),
+    STATUS_FIELD(battery_3, STATUS_UINT32),
+    STATUS_FIELD(battery_4, STATUS_UINT32)
+};
+
+#define STATUS_FIELD_COUNT (sizeof(server_status_fields) / sizeof(server_status_fields[0]))
+#define STATUS_MASK_ALL (STATUS_FIELD_COUNT == 64 ? ~(uint64_t) 0 : ((uint64_t) 1 << STATUS_FIELD_COUNT) - 1)
+
+/* Parses a comma separated list of status field names into a bit mask */
+static int servermode_status_mask(const char *list, uint64_t *mask) {
+    *mask = 0;
+    while (*list) {
+        size_t length = strcspn(list, ",");
+        unsigned i;
+        for (i = 0; i < STATUS_FIELD_COUNT; ++i) {
+            if (strlen(server_status_fields[i].name) == length
+                && !strncmp(server_status_fields[i].name, list, length)) {
+                *mask |= (uint64_t) 1 << i;
+                break;
+            }
+        }
+        if (i == STATUS_FIELD_COUNT) {
+            return -1;
+        }
+        list += length;
+        list += *list == ',';
     }
+    return 0;
+}
+
+/* Formats a status field, strings are quoted for JSON */
+static void servermode_status_value(pslr_handle_t camhandle, pslr_status *status, const server_status_field_t *field,
+                                    bool json, char *buf, size_t size) {
+    const uint8_t *p = (const uint8_t *) status + field->offset;
+    const char *str = NULL;
+    pslr_rational_t r;
 
-    int enable = 1;
-    if (setsockopt(socket_desc, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0) {
-      fprintf(stderr, "setsockopt(SO_REUSEADDR) failed");
+    switch (field->kind) {
+    case STATUS_UINT16:
+        snprintf(buf, size, "%u", *(const uint16_t *) p);
+        return;
+    case STATUS_UINT32:
+        snprintf(buf, size, "%u", *(const uint32_t *) p);
+        return;
+    case STATUS_INT32:
+        snprintf(buf, size, "%d", *(const int32_t *) p);
+        return;
+    case STATUS_RATIONAL:
+        memcpy(&r, p, sizeof(r));
+        snprintf(buf, size, json ? "[%d,%d]" : "%d/%d", r.nom, r.denom);
+        return;
+    case STATUS_CAMERA_NAME:
+        str = pslr_camera_name(camhandle);
+        break;
+    case STATUS_LENS_NAME:
+        str = get_lens_name(status->lens_id1, status->lens_id2);
+        break;
+    }
+    if (!json) {
+        snprintf(buf, size, "%s", str);
+    } else {
+        size_t n = 0;
+        buf[n++] = '"';
+        for (; *str && n + 8 < size; ++str) {
+            if (*str == '"' || *str == '\\') {
+                buf[n++] = '\\';
+                buf[n++] = *str;
+            } else if ((unsigned char) *str < 0x20) {
+                n += snprintf(buf + n, size - n, "\\u%04x", *str);
+            } else {
+                buf[n++] = *str;
+            }
+        }
+        buf[n++] = '"';
+        buf[n] = '\0';
     }
-    DPRINT("Socket created\n");
+}
 
-    //Prepare the sockaddr_in structure
-    server.sin_family = AF_INET;
-    server.sin_addr.s_addr = INADDR_ANY;
-    server.sin_port = htons( 8888 );
+static void camera_status_update(server_camera_t *camera, const pslr_status *status);
+static void camera_subscribe(server_camera_t *camera, server_conn_t *conn, uint64_t mask);
 
-    //Bind
-    if( bind(socket_desc,(struct sockaddr *)&server , sizeof(server)) < 0) {
-        fprintf(stderr, "bind failed. Error");
-        return 1;
+/* get_status [json|text] [FIELD,...]: reads the status from the camera
+   and answers the selected fields in one JSON line, or as a count
+   followed by key=value lines */
+static void servermode_get_status(server_camera_t *camera, server_job_t *job, char *args) {
+    uint64_t mask = STATUS_MASK_ALL;
+    bool json = true;
+    char *saveptr = NULL;
+    char *arg;
+    char value[256];
+    unsigned i;
+    bool first = true;
+
+    for (arg = args ? strtok_r(args, " ", &saveptr) : NULL; arg; arg = strtok_r(NULL, " ", &saveptr)) {
+        if (!strcmp(arg, "json") || !strcmp(arg, "text")) {
+            json = !strcmp(arg, "json");
+        } else if (servermode_status_mask(arg, &mask) < 0) {
+            write_socket_printf(job, "%d Unknown status field in %s\n", 1, arg);
+            return;
+        }
+    }
+    if (!camera->camhandle) {
+        write_socket_printf(job, "%d not connected\n", 1);
+        return;
+    }
+    if (pslr_get_status(camera->camhandle, &camera->status)) {
+        write_socket_printf(job, "%d\n", 1);
+        return;
     }
-    DPRINT("bind done\n");
+    camera_status_update(camera, &camera->status);
 
-    //Listen
-    listen(socket_desc , 3);
+    if (json) {
+        write_socket_answer(job, "0 {");
+    } else {
+        unsigned count = 0;
+        for (i = 0; i < STATUS_FIELD_COUNT; ++i) {
+            count += (mask >> i) & 1;
+        }
+        write_socket_printf(job, "%d %u\n", 0, count);
+    }
+    for (i = 0; i < STATUS_FIELD_COUNT; ++i) {
+        if (!((mask >> i) & 1)) {
+            continue;
+        }
+        servermode_status_value(camera->camhandle, &camera->status, &server_status_fields[i], json, value, sizeof(value));
+        if (json) {
+            write_socket_printf(job, "%s\"%s\":%s", first ? "" : ",", server_status_fields[i].name, value);
+        } else {
+            write_socket_printf(job, "%s=%s\n", server_status_fields[i].name, value);
+        }
+        first = false;
+    }
+    if (json) {
+        write_socket_answer(job, "}\n");
+    }
+}
 
-    //Accept and incoming connection
-    DPRINT("Waiting for incoming connections...\n");
-    c = sizeof(struct sockaddr_in);
-
-    while( true ) {
-        fd_set rfds;
-	struct timeval tv;
-	int retval;
-	FD_ZERO(&rfds);
-	FD_SET(socket_desc, &rfds);
-	tv.tv_sec = servermode_timeout;
-	tv.tv_usec = 0;
-	retval = select(socket_desc+1, &rfds, NULL, NULL, &tv);
-
-	if (retval == -1) {
-  	    DPRINT("select error\n");
-	    exit(1);
-        } else if (retval) {
-            client_sock = accept(socket_desc, (struct sockaddr *)&client, (socklen_t*)&c);
-            if (client_sock < 0) {
-  	        fprintf(stderr, "accept failed");
-	        return 1;
-	    }
-            DPRINT("Connection accepted\n");
-	} else {
-            DPRINT("Timeout\n");
-	    close(socket_desc);
-	    exit(0);
-	}
+/* Commands using the camera buffer, only one of them runs at a time */
+static bool command_is(const char *command, const char *name) {
+    size_t length = strlen(name);
+    return !strncmp(command, name, length) && (command[length] == '\0' || command[length] == ' ');
+}
 
-        //Receive a message from client
-        while( (read_size = recv(client_sock , client_message , 2000 , 0)) > 0 ) {
-            client_message[read_size]='\0';
-            strip( client_message );
-            DPRINT(":%s:\n",client_message);
-            if( !strcmp(client_message, "stopserver" ) ) {
-	        if( camhandle ) {
-	            camera_close(camhandle);
-	        }
-	        write_socket_answer("0\n");
-	        exit(0);
-	    } else if( !strcmp(client_message, "disconnect" ) ) {
-	        if( camhandle ) {
-	            camera_close(camhandle);
-	        }
-	        write_socket_answer("0\n");
-            } else if( !strcmp(client_message, "echo") ) {
-	        sprintf( buf, "0 %s\n", client_message);
-	        write_socket_answer(buf);
-            } else if( !strcmp(client_message, "connect") ) {
-	        if( camhandle ) {
-	            write_socket_answer("0\n");
-		} else if( (camhandle = camera_connect( NULL, NULL, -1, buf ))  ) {
-	            write_socket_answer("0\n");
-	        } else {
-	            write_socket_answer(buf);
-	        }
-            } else if( !strcmp(client_message, "update_status") ) {
-	        if( !pslr_get_status(camhandle, &status) ) {
-		    sprintf( buf, "%d\n", 0);
-		} else {
-		    sprintf( buf, "%d\n", 1);
+static double timespec_seconds(const struct timespec *start, const struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Counts a finished command, called with the mutex held */
+static void servermode_record(server_job_t *job) {
+    server_command_stats_t *stats;
+    struct timespec now;
+    double seconds;
+    unsigned i;
+
+    for (i = 0; i < SERVER_COMMAND_COUNT - 1 && !command_is(job->command, server_command_names[i]); ++i)
+        ;
+    stats = &server.stats.commands[i];
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    seconds = timespec_seconds(&job->queued, &now);
+    ++stats->count;
+    stats->seconds += seconds;
+    for (i = 0; i < SERVER_LATENCY_BUCKETS; ++i) {
+        if (seconds <= server_latency_buckets[i]) {
+            ++stats->buckets[i];
+        }
+    }
+}
+
+static bool servermode_uses_buffer(const char *command) {
+    return command_is(command, "get_buffer") || command_is(command, "get_preview_buffer")
+        || command_is(command, "get_buffer_fd");
+}
+
+/* Commands that wait for the end of a running buffer download: closing
+   the camera under it would leave the download without a handle, and a
+   deleted buffer would go out as a complete download */
+static bool servermode_waits_buffer(const char *command) {
+    return servermode_uses_buffer(command) || command_is(command, "disconnect")
+        || command_is(command, "stopserver") || command_is(command, "delete_buffer");
+}
+
+/* Arguments of the buffer commands */
+typedef struct {
+    int index;
+    pslr_buffer_type type;
+    int resolution;
+    bool range;
+    uint32_t offset;
+    uint32_t length;        /* 0: up to the end of the buffer */
+} server_buffer_args_t;
+
+static const struct {
+    const char *name;
+    pslr_buffer_type type;
+} server_buffer_types[] = {
+    { "PEF", PSLR_BUF_PEF },
+    { "DNG", PSLR_BUF_DNG },
+    { "PREVIEW", PSLR_BUF_PREVIEW },
+    { "THUMBNAIL", PSLR_BUF_THUMBNAIL }
+};
+
+/* Parses [INDEX] [index=N] [type=PEF|DNG|JPEG|PREVIEW|THUMBNAIL|N]
+   [quality=STARS] [resolution=N] [offset=N] [length=N]. On error the
+   answer is written and -1 is returned. */
+static int servermode_buffer_args(server_camera_t *camera, server_job_t *job, char *args, server_buffer_args_t *b) {
+    char *saveptr = NULL;
+    char *arg;
+    int quality = camera->status.jpeg_quality;
+    bool jpeg = false;
+    unsigned i;
+
+    memset(b, 0, sizeof(*b));
+    b->type = PSLR_BUF_DNG;
+    for (arg = args ? strtok_r(args, " ", &saveptr) : NULL; arg; arg = strtok_r(NULL, " ", &saveptr)) {
+        char *value = strchr(arg, '=');
+        char *end;
+        unsigned long n;
+
+        if (value) {
+            *value++ = '\0';
+        } else {
+            value = arg;
+            arg = "index";
+        }
+        n = strtoul(value, &end, 10);
+        if (!strcmp(arg, "type")) {
+            for (i = 0; i < sizeof(server_buffer_types) / sizeof(server_buffer_types[0]); ++i) {
+                if (!strcasecmp(value, server_buffer_types[i].name)) {
+                    break;
                 }
-	        write_socket_answer(buf);
-            } else if( !strcmp(client_message, "get_camera_name") ) {
-	        if( camhandle ) {
-	            sprintf(buf, "%d %s\n", 0, pslr_camera_name(camhandle));
-	        } else {
-	            sprintf(buf, "%d not connected\n", 1);
-	        }
-	        write_socket_answer(buf);
-	    } else if( !strcmp(client_message, "get_lens_name") ) {
-	        sprintf(buf, "%d %s\n", 0, get_lens_name(status.lens_id1, status.lens_id2));
-	        write_socket_answer(buf);
-	    } else if( !strcmp(client_message, "get_current_shutter_speed") ) {
-  	        sprintf(buf, "%d %d/%d\n", 0, status.current_shutter_speed.nom, status.current_shutter_speed.denom);
-	        write_socket_answer(buf);
-	    } else if( !strcmp(client_message, "get_current_aperture") ) {
-		sprintf(buf, "%d %s\n", 0, format_rational( status.current_aperture, "%.1f"));
-	        write_socket_answer(buf);
-	    } else if( !strcmp(client_message, "get_current_iso") ) {
-		sprintf(buf, "%d %d\n", 0, status.current_iso);
-	        write_socket_answer(buf);
-	    } else if( !strcmp(client_message, "get_bufmask") ) {
-		sprintf(buf, "%d %d\n", 0, status.bufmask);
-	        write_socket_answer(buf);
-	    } else if( !strcmp(client_message, "focus") ) {
-		pslr_focus(camhandle);
-		sprintf(buf, "%d\n", 0);
-	        write_socket_answer(buf);
-	    } else if( !strcmp(client_message, "shutter") ) {
-		pslr_shutter(camhandle);
-		sprintf(buf, "%d\n", 0);
-	        write_socket_answer(buf);
-	    } else if( !strcmp(client_message, "delete_buffer") ) {
-		// TODO: bufferindex
-		pslr_delete_buffer(camhandle,0);
-		sprintf(buf, "%d\n", 0);
-	        write_socket_answer(buf);
-	    } else if( !strcmp(client_message, "get_preview_buffer") ) {
-		// TODO: bufferindex
-		uint8_t *pImage;
-		uint32_t imageSize;
-		if( pslr_get_buffer(camhandle, 0, PSLR_BUF_PREVIEW, 4, &pImage, &imageSize) ) {
-		    sprintf(buf, "%d %d\n", 1, imageSize);
-		    write_socket_answer(buf);
-		} else {
-		    sprintf(buf, "%d %d\n", 0, imageSize);
-		    write_socket_answer(buf);
-		    write_socket_answer_bin(pImage, imageSize);
-		}
-	    } else if( !strcmp(client_message, "get_buffer") ) {
-		// TODO: bufferindex
-		uint32_t imageSize;
-		if( pslr_buffer_open(camhandle, 0, PSLR_BUF_DNG, 0) ) {
-		    sprintf(buf, "%d\n", 1);
-		    write_socket_answer(buf);
-		} else {
-		    imageSize = pslr_buffer_get_size(camhandle);
-		    sprintf(buf, "%d %d\n", 0, imageSize);
-		    write_socket_answer(buf);
-		    uint32_t current = 0;
-		    while (1) {
-			uint32_t bytes;
-			uint8_t buf[65536];
-			bytes = pslr_buffer_read(camhandle, buf, sizeof (buf));
-			if (bytes == 0) {
-			    break;
-			}
-			write_socket_answer_bin( buf, bytes);
-			current += bytes;
-		    }
-		    pslr_buffer_close(camhandle);
-		}
+            }
+            jpeg = !strcasecmp(value, "JPEG");
+            if (i < sizeof(server_buffer_types) / sizeof(server_buffer_types[0])) {
+                b->type = server_buffer_types[i].type;
+                continue;
+            } else if (jpeg) {
+                continue;
+            } else if (*end == '\0' && *value) {
+                b->type = n;
+                continue;
+            }
+        } else if (*end != '\0' || !*value) {
+            // numbers only from here
+        } else if (!strcmp(arg, "index") && n < 16) {
+            b->index = n;
+            continue;
+        } else if (!strcmp(arg, "quality")) {
+            quality = n;
+            continue;
+        } else if (!strcmp(arg, "resolution")) {
+            b->resolution = n;
+            continue;
+        } else if (!strcmp(arg, "offset") && n <= UINT32_MAX) {
+            b->offset = n;
+            b->range = true;
+            continue;
+        } else if (!strcmp(arg, "length") && n <= UINT32_MAX) {
+            b->length = n;
+            b->range = true;
+            continue;
+        }
+        write_socket_printf(job, "%d Invalid argument %s=%s\n", 1, arg, value);
+        return -1;
+    }
+    if (!camera->camhandle) {
+        write_socket_printf(job, "%d not connected\n", 1);
+        return -1;
+    }
+    if (jpeg) {
+        b->type = pslr_get_jpeg_buffer_type(camera->camhandle, quality);
+    }
+    return 0;
+}
+
+/* Opens the buffer and seeks to the requested range. On error the
+   answer is written and -1 is returned. */
+static int servermode_buffer_open(server_camera_t *camera, server_job_t *job, server_buffer_args_t *b) {
+    uint32_t length;
+
+    if (pslr_buffer_open(camera->camhandle, b->index, b->type, b->resolution)) {
+        write_socket_printf(job, "%d\n", 1);
+        return -1;
+    }
+    job->total = pslr_buffer_get_size(camera->camhandle);
+    if (b->offset > job->total || pslr_buffer_seek(camera->camhandle, b->offset) != PSLR_OK) {
+        pslr_buffer_close(camera->camhandle);
+        write_socket_printf(job, "%d Invalid range, buffer size %u\n", 1, job->total);
+        return -1;
+    }
+    length = job->total - b->offset;
+    if (b->length > 0 && b->length < length) {
+        length = b->length;
+    }
+    job->range = b->range;
+    job->offset = b->offset;
+    job->bufno = b->index;
+    job->buftype = b->type;
+    job->resolution = b->resolution;
+    job->position = b->offset;
+    job->remaining = length;
+    job->transfer = true;
+    return 0;
+}
+
+/* Opens the buffer of a paused download again at the next chunk */
+static int servermode_buffer_reopen(server_camera_t *camera, server_job_t *job) {
+    if (!camera->camhandle || pslr_buffer_open(camera->camhandle, job->bufno, job->buftype, job->resolution)) {
+        return -1;
+    }
+    // a different image of another size cannot be resumed
+    if (pslr_buffer_get_size(camera->camhandle) != job->total
+        || pslr_buffer_seek(camera->camhandle, job->position) != PSLR_OK) {
+        pslr_buffer_close(camera->camhandle);
+        return -1;
+    }
+    return 0;
+}
+
+/* 0 LENGTH, or 0 LENGTH OFFSET TOTAL for a range request */
+static void servermode_buffer_answer(server_job_t *job) {
+    uint32_t length = job->memfd >= 0 ? job->size : job->remaining;
+    if (job->range) {
+        write_socket_printf(job, "%d %u %u %u\n", 0, length, job->offset, job->total);
+    } else {
+        write_socket_printf(job, "%d %u\n", 0, length);
+    }
+}
+
+/* Unmaps and closes the download memfd of the job */
+static void job_release_memfd(server_job_t *job) {
+    if (job->map) {
+        munmap(job->map, job->size);
+        job->map = NULL;
+    }
+    if (job->memfd >= 0) {
+        close(job->memfd);
+        job->memfd = -1;
+    }
+}
+
+/* Seals the downloaded memfd and answers it to the client */
+static void servermode_memfd_done(server_job_t *job, bool complete) {
+#ifdef HAVE_MEMFD
+    if (job->map) {
+        munmap(job->map, job->size);
+        job->map = NULL;
+    }
+    if (complete && fcntl(job->memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == 0) {
+        servermode_buffer_answer(job);
+        job->reply_fd = job->memfd;
+        job->memfd = -1;
+        return;
+    }
+#endif
+    job_release_memfd(job);
+    write_socket_printf(job, "%d\n", 1);
+}
+
+/* Sends the next chunk of the buffer opened by get_buffer.
+   Returns true when the transfer is over. */
+static bool servermode_transfer(server_camera_t *camera, server_job_t *job) {
+    uint32_t length = job->remaining < SERVER_TRANSFER_CHUNK ? job->remaining : SERVER_TRANSFER_CHUNK;
+    uint8_t *p;
+    uint32_t current = 0;
+    struct timespec start, end;
+    bool complete;
+
+    if (job->suspended) {
+        // the buffer was left to other clients during the pause
+        job->suspended = false;
+        if (servermode_buffer_reopen(camera, job)) {
+            fprintf(stderr, "Cannot reopen buffer %d, download aborted\n", job->bufno);
+            job->remaining = 0;
+            job->failed = true;
+            job->transfer = false;
+            return true;
+        }
+    }
+    if (job->memfd >= 0) {
+        p = job->map + (job->size - job->remaining);
+    } else {
+        write_socket_data_begin(job);
+        p = job_reserve(job, length);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (p && camera->camhandle && current < length) {
+        uint32_t bytes = pslr_buffer_read(camera->camhandle, p + current, length - current);
+        if (bytes == 0) {
+            break;
+        }
+        current += bytes;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    pthread_mutex_lock(&server.mutex);
+    camera->downloaded += current;
+    camera->download_seconds += timespec_seconds(&start, &end);
+    pthread_mutex_unlock(&server.mutex);
+    if (p && job->memfd < 0) {
+        job->reply->length += current;
+    }
+    job->remaining -= current;
+    job->position += current;
+    complete = current == length;
+    if (!complete) {
+        fprintf(stderr, "Buffer download failed, %u bytes missing\n", job->remaining);
+        job->remaining = 0;
+        job->failed = true;
+    }
+    if (job->remaining == 0) {
+        if (camera->camhandle) {
+            pslr_buffer_close(camera->camhandle);
+        }
+        job->transfer = false;
+        if (job->memfd >= 0) {
+            servermode_memfd_done(job, complete);
+        }
+        return true;
+    }
+    return false;
+}
+
+/* Connects the camera of the worker. With several cameras the handle
+   is opened on the device found at start. */
+static pslr_handle_t servermode_camera_open(server_camera_t *camera, char *error_message) {
+    pslr_handle_t camhandle;
+    const char *name;
+    int r;
+
+    if (server.camera_count == 1) {
+        camhandle = camera_connect(NULL, NULL, -1, error_message);
+    } else if (!(camhandle = pslr_init_handle(NULL, camera->device))) {
+        snprintf(error_message, 1000, "%d Camera %d not found on %s\n", 1, camera->index, camera->device);
+    } else if ((r = pslr_connect(camhandle))) {
+        if (r != -1) {
+            snprintf(error_message, 1000, "%d Cannot connect to Pentax camera. Please start the program as root.\n", 1);
+        } else {
+            snprintf(error_message, 1000, "%d Unknown Pentax camera found.\n", 1);
+        }
+        pslr_shutdown(camhandle);
+        pslr_free_handle(camhandle);
+        camhandle = NULL;
+    }
+    if (camhandle) {
+        name = pslr_camera_name(camhandle);
+        pthread_mutex_lock(&server.mutex);
+        snprintf(camera->name, sizeof(camera->name), "%s", name ? name : "");
+        pthread_mutex_unlock(&server.mutex);
+    }
+    return camhandle;
+}
+
+static void servermode_camera_close(server_camera_t *camera) {
+    camera_close(camera->camhandle);
+    pslr_free_handle(camera->camhandle);
+    camera->camhandle = NULL;
+    pthread_mutex_lock(&server.mutex);
+    camera->name[0] = '\0';
+    camera->polled_valid = false;
+    pthread_mutex_unlock(&server.mutex);
+}
+
+/* list_cameras: the cameras of the server as a JSON array */
+static void servermode_list_cameras(server_job_t *job) {
+    int i;
+
+    write_socket_answer(job, "0 [");
+    pthread_mutex_lock(&server.mutex);
+    for (i = 0; i < server.camera_count; ++i) {
+        server_camera_t *camera = &server.cameras[i];
+        write_socket_printf(job, "%s{\"id\":%d,\"device\":\"%s\",\"serial\":\"%s\",\"model\":\"%s\",\"connected\":%s}",
+                            i ? "," : "", i, camera->device, camera->serial, camera->name,
+                            camera->name[0] ? "true" : "false");
+    }
+    pthread_mutex_unlock(&server.mutex);
+    write_socket_answer(job, "]\n");
+}
+
+/* Runs one step of a job on the worker thread.
+   Returns true when the job is finished. */
+static bool servermode_command(server_camera_t *camera, server_job_t *job) {
+    char buf[2100];
+    char *client_message = job->command;
+    pslr_status *status = &camera->status;
+
+    if( job->transfer ) {
+        return servermode_transfer(camera, job);
+    }
+
+    DPRINT(":%s:\n",client_message);
+    // the arguments follow the command after a space
+    char *args = strchr(client_message, ' ');
+    if( args ) {
+        *args++ = '\0';
+    }
+    if( !strcmp(client_message, "stopserver" ) ) {
+        if( camera->camhandle ) {
+            servermode_camera_close(camera);
+        }
+        write_socket_answer(job, "0\n");
+        job->stop = true;
+    } else if( !strcmp(client_message, "disconnect" ) ) {
+        if( camera->camhandle ) {
+            servermode_camera_close(camera);
+        }
+        write_socket_answer(job, "0\n");
+    } else if( !strcmp(client_message, "echo") ) {
+        write_socket_printf(job, "0 %s\n", client_message);
+    } else if( !strcmp(client_message, "connect") ) {
+        if( camera->camhandle ) {
+            write_socket_answer(job, "0\n");
+        } else if( (camera->camhandle = servermode_camera_open( camera, buf ))  ) {
+            write_socket_answer(job, "0\n");
+        } else {
+            write_socket_answer(job, buf);
+        }
+    } else if( !strcmp(client_message, "list_cameras") ) {
+        servermode_list_cameras(job);
+    } else if( !strcmp(client_message, "update_status") ) {
+        if( camera->camhandle && !pslr_get_status(camera->camhandle, status) ) {
+            camera_status_update(camera, status);
+            write_socket_printf(job, "%d\n", 0);
+        } else {
+            write_socket_printf(job, "%d\n", 1);
+        }
+    } else if( !strcmp(client_message, "get_camera_name") ) {
+        if( camera->camhandle ) {
+            write_socket_printf(job, "%d %s\n", 0, pslr_camera_name(camera->camhandle));
+        } else {
+            write_socket_printf(job, "%d not connected\n", 1);
+        }
+    } else if( !strcmp(client_message, "get_lens_name") ) {
+        write_socket_printf(job, "%d %s\n", 0, get_lens_name(status->lens_id1, status->lens_id2));
+    } else if( !strcmp(client_message, "get_current_shutter_speed") ) {
+        write_socket_printf(job, "%d %d/%d\n", 0, status->current_shutter_speed.nom, status->current_shutter_speed.denom);
+    } else if( !strcmp(client_message, "get_current_aperture") ) {
+        write_socket_printf(job, "%d %s\n", 0, format_rational( status->current_aperture, "%.1f"));
+    } else if( !strcmp(client_message, "get_current_iso") ) {
+        write_socket_printf(job, "%d %d\n", 0, status->current_iso);
+    } else if( !strcmp(client_message, "get_status") ) {
+        servermode_get_status(camera, job, args);
+    } else if( !strcmp(client_message, "subscribe") ) {
+        uint64_t mask = STATUS_MASK_ALL;
+        if( args && servermode_status_mask(args, &mask) < 0 ) {
+            write_socket_printf(job, "%d Unknown status field in %s\n", 1, args);
+        } else {
+            camera_subscribe(camera, job->conn, mask);
+            write_socket_printf(job, "%d\n", 0);
+        }
+    } else if( !strcmp(client_message, "unsubscribe") ) {
+        camera_subscribe(camera, job->conn, 0);
+        write_socket_printf(job, "%d\n", 0);
+    } else if( !strcmp(client_message, "get_bufmask") ) {
+        write_socket_printf(job, "%d %d\n", 0, status->bufmask);
+    } else if( !camera->camhandle && (!strcmp(client_message, "focus") || !strcmp(client_message, "shutter")
+                                      || !strcmp(client_message, "delete_buffer") || servermode_uses_buffer(client_message)) ) {
+        write_socket_printf(job, "%d not connected\n", 1);
+    } else if( !strcmp(client_message, "focus") ) {
+        pslr_focus(camera->camhandle);
+        write_socket_printf(job, "%d\n", 0);
+    } else if( !strcmp(client_message, "shutter") ) {
+        pslr_shutter(camera->camhandle);
+        write_socket_printf(job, "%d\n", 0);
+    } else if( !strcmp(client_message, "delete_buffer") ) {
+        server_buffer_args_t b;
+        if( !servermode_buffer_args(camera, job, args, &b) ) {
+            pslr_delete_buffer(camera->camhandle, b.index);
+            write_socket_printf(job, "%d\n", 0);
+        }
+    } else if( !strcmp(client_message, "get_preview_buffer") ) {
+        server_buffer_args_t b;
+        pslr_image_t *image;
+        if( servermode_buffer_args(camera, job, args, &b) ) {
+            // the error is answered already
+        } else if( !(image = pslr_get_image(camera->camhandle, b.index, PSLR_BUF_PREVIEW, 4)) ) {
+            write_socket_printf(job, "%d %d\n", 1, 0);
+        } else {
+            write_socket_printf(job, "%d %d\n", 0, image->length);
+            write_socket_data_begin(job);
+            write_socket_answer_bin(job, image->data, image->length);
+            pslr_image_unref(image);
+        }
+    } else if( !strcmp(client_message, "get_buffer") || !strcmp(client_message, "get_buffer_fd") ) {
+        server_buffer_args_t b;
+        bool fd = !strcmp(client_message, "get_buffer_fd");
+        if( fd && !job->conn->local ) {
+            write_socket_printf(job, "%d Not a local connection\n", 1);
+        } else if( !servermode_buffer_args(camera, job, args, &b) && !servermode_buffer_open(camera, job, &b) ) {
+            if( !fd ) {
+                servermode_buffer_answer(job);
+                // the data follows in chunks, other commands can run in between
+                return job->remaining == 0 && servermode_transfer(camera, job);
+            }
+            job->size = job->remaining;
+#ifdef HAVE_MEMFD
+            job->memfd = memfd_create("pktriggercord-buffer", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#endif
+            if( job->memfd < 0 || ftruncate(job->memfd, job->size) < 0
+                || (job->size > 0 && (job->map = mmap(NULL, job->size, PROT_READ | PROT_WRITE, MAP_SHARED, job->memfd, 0)) == MAP_FAILED) ) {
+                job->map = NULL;
+                job_release_memfd(job);
+                pslr_buffer_close(camera->camhandle);
+                job->transfer = false;
+                write_socket_printf(job, "%d Cannot create memfd\n", 1);
             } else {
-	        write_socket_answer("1 Invalid servermode command\n");
+                // downloaded in chunks like get_buffer, answered when complete
+                return job->remaining == 0 && servermode_transfer(camera, job);
             }
-	}
+        }
+    } else {
+        write_socket_answer(job, "1 Invalid servermode command\n");
+    }
+    return true;
+}
 
-	if(read_size == 0) {
-	    DPRINT("Client disconnected\n");
-	    fflush(stdout);
-	} else if(read_size == -1) {
-	    fprintf(stderr, "recv failed\n");
-	}
+/* The job after job the worker may run before job is finished. Text
+   answers go out in order, only the parts of a broadcast run together,
+   binary requests can overtake each other. */
+static server_job_t *conn_next_runnable(server_conn_t *conn, server_job_t *job) {
+    if (conn->binary || (job->parent && job->next && job->next->parent == job->parent)) {
+        return job->next;
+    }
+    return NULL;
+}
+
+/* Next connection the worker can serve, called with the mutex held.
+   Connections waiting for the buffer held by another job are skipped. */
+static server_conn_t *camera_next_ready(server_camera_t *camera, server_job_t **pjob) {
+    int k = camera->index;
+    server_conn_t *prev = NULL, *conn;
+    for (conn = camera->ready; conn; prev = conn, conn = conn->ready_next[k]) {
+        server_job_t *job;
+        for (job = conn->jobs; job; job = conn_next_runnable(conn, job)) {
+            if (job->camera != camera) {
+                continue;
+            }
+            if (!conn->dead && job->transfer && job->memfd < 0) {
+                // a slow client holds back its own download only
+                if (!conn->paused && conn->backlog >= SERVER_HIGH_WATERMARK) {
+                    DPRINT("Client backlog %lld, download paused\n", (long long) conn->backlog);
+                    conn->paused = true;
+                }
+                if (conn->paused) {
+                    if (camera->buffer_owner == job) {
+                        // other clients download in the meantime, the
+                        // handle is this worker's and closing it is cheap
+                        if (camera->camhandle) {
+                            pslr_buffer_close(camera->camhandle);
+                        }
+                        job->suspended = true;
+                        camera->buffer_owner = NULL;
+                    }
+                    continue;
+                }
+            }
+            if (conn->dead || !camera->buffer_owner || camera->buffer_owner == job
+                || !servermode_waits_buffer(job->command)) {
+                break;
+            }
+        }
+        if (!job) {
+            continue;
+        }
+        *pjob = job;
+        if (prev) {
+            prev->ready_next[k] = conn->ready_next[k];
+        } else {
+            camera->ready = conn->ready_next[k];
+        }
+        if (camera->ready_tail == conn) {
+            camera->ready_tail = prev;
+        }
+        conn->ready_next[k] = NULL;
+        conn->ready &= ~(1u << k);
+        return conn;
+    }
+    return NULL;
+}
+
+/* Removes a job from the queue of its connection, called with the mutex held */
+static void conn_unlink_job(server_conn_t *conn, server_job_t *job) {
+    server_job_t *prev = NULL, *j;
+    for (j = conn->jobs; j != job; prev = j, j = j->next)
+        ;
+    if (prev) {
+        prev->next = job->next;
+    } else {
+        conn->jobs = job->next;
+    }
+    if (conn->jobs_tail == job) {
+        conn->jobs_tail = prev;
+    }
+    job->next = NULL;
+}
+
+static void camera_ready_push(server_camera_t *camera, server_conn_t *conn) {
+    int k = camera->index;
+    if (conn->ready & (1u << k)) {
+        return;
+    }
+    conn->ready |= 1u << k;
+    conn->ready_next[k] = NULL;
+    if (camera->ready_tail) {
+        camera->ready_tail->ready_next[k] = conn;
+    } else {
+        camera->ready = conn;
+    }
+    camera->ready_tail = conn;
+}
+
+/* Offers the connection to the workers of its queued jobs, called
+   with the mutex held. A worker may have skipped the connection while
+   another worker ran the job before, so they are all woken up. */
+static void conn_ready_push(server_conn_t *conn) {
+    uint32_t signalled = 0;
+    server_job_t *job;
+    for (job = conn->jobs; job; job = job->next) {
+        uint32_t bit = 1u << job->camera->index;
+        if (!(signalled & bit)) {
+            camera_ready_push(job->camera, conn);
+            pthread_cond_signal(&job->camera->cond);
+            signalled |= bit;
+        }
+    }
+}
+
+static void servermode_wakeup(void) {
+    uint64_t one = 1;
+    if (write(server.wakeup.fd, &one, sizeof(one)) < 0) {
+        DPRINT("eventfd write failed: %s\n", strerror(errno));
+    }
+}
+
+static void frame_header(uint8_t *p, uint32_t length, uint32_t id, uint8_t type, uint8_t flags) {
+    int i;
+    for (i = 0; i < 4; ++i) {
+        p[i] = (length >> (8 * i)) & 0xff;
+        p[4 + i] = (id >> (8 * i)) & 0xff;
+    }
+    p[8] = type;
+    p[9] = flags;
+    p[10] = p[11] = 0;
+}
+
+/* Wraps the reply of a step into frames for a binary connection: the
+   answer line into a response frame, the binary data into a data frame.
+   The last frame of a request has no SERVERMODE_FRAME_MORE flag. */
+static server_chunk_t *frame_reply(server_chunk_t *reply, server_job_t *job, bool done) {
+    size_t length = reply ? reply->length : 0;
+    size_t text = job->data ? job->data_start : length;
+    size_t data = length - text;
+    server_chunk_t *framed;
+    uint8_t *p;
+
+    if (length == 0 && !(done && job->more_sent)) {
+        free(reply);
+        return NULL;
+    }
+    framed = malloc(sizeof(server_chunk_t) + length + 2 * SERVERMODE_FRAME_HEADER);
+    if (!framed) {
+        fprintf(stderr, "Cannot frame %zu bytes for the client\n", length);
+        free(reply);
+        return NULL;
+    }
+    p = framed->data;
+    if (job->event) {
+        frame_header(p, length, 0, SERVERMODE_FRAME_EVENT, 0);
+        memcpy(p + SERVERMODE_FRAME_HEADER, reply->data, length);
+        p += SERVERMODE_FRAME_HEADER + length;
+    } else {
+        if (text > 0) {
+            job->more_sent = data > 0 || !done;
+            frame_header(p, text, job->id, SERVERMODE_FRAME_RESPONSE, job->more_sent ? SERVERMODE_FRAME_MORE : 0);
+            memcpy(p + SERVERMODE_FRAME_HEADER, reply->data, text);
+            p += SERVERMODE_FRAME_HEADER + text;
+        }
+        if (data > 0 || text == 0) {
+            job->more_sent = !done;
+            frame_header(p, data, job->id, SERVERMODE_FRAME_DATA,
+                         !done ? SERVERMODE_FRAME_MORE : job->failed ? SERVERMODE_FRAME_ERROR : 0);
+            if (data > 0) {
+                memcpy(p + SERVERMODE_FRAME_HEADER, reply->data + text, data);
+            }
+            p += SERVERMODE_FRAME_HEADER + data;
+        }
+    }
+    framed->length = p - framed->data;
+    framed->size = length + 2 * SERVERMODE_FRAME_HEADER;
+    free(reply);
+    return framed;
+}
+
+/* Hands the reply of the job over to the event loop, called with the mutex held */
+static void camera_post(server_conn_t *conn, server_job_t *job, bool done) {
+    server_chunk_t *reply = job->reply;
+    int fd = job->reply_fd;
+    // a text client cannot tell a short download from a complete one
+    bool close_after = done && job->failed && !conn->binary && job->memfd < 0;
+    job->reply = NULL;
+    job->reply_fd = -1;
+    if (!conn->dead && conn->binary) {
+        reply = frame_reply(reply, job, done);
+    }
+    job->data = false;
+    if (!conn->dead && close_after && !reply) {
+        reply = calloc(1, sizeof(server_chunk_t));
+    }
+    if (conn->dead || !reply || (reply->length == 0 && !close_after)) {
+        free(reply);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+    reply->fd = fd;
+    reply->close = close_after;
+    conn->backlog += reply->length;
+    reply->conn = conn;
+    reply->next = NULL;
+    if (server.done_tail) {
+        server.done_tail->next = reply;
+    } else {
+        server.done = reply;
+    }
+    server.done_tail = reply;
+    ++conn->pending;
+    if (close_after) {
+        // drop the commands queued after the broken answer
+        conn->dead = true;
+    }
+}
+
+/* Sends the status fields changed since the last event to a
+   subscriber, called with the mutex held. Nothing is inserted into
+   a running buffer download, the event waits for its end. */
+static void camera_notify(server_camera_t *camera, server_conn_t *conn) {
+    server_job_t *event = &camera->notify;
+    char value[256];
+    bool first = true;
+    unsigned i;
+
+    if (conn->dead || (!conn->sub_changed && !conn->sub_new_buffers)
+        || (!conn->binary && conn->jobs && conn->jobs->transfer && conn->jobs->memfd < 0) || !camera->polled_valid) {
+        return;
+    }
+    write_socket_answer(event, "event status {");
+    if (server.camera_count > 1) {
+        write_socket_printf(event, "\"camera\":%d", camera->index);
+        first = false;
+    }
+    for (i = 0; i < STATUS_FIELD_COUNT; ++i) {
+        if (!((conn->sub_changed >> i) & 1)) {
+            continue;
+        }
+        servermode_status_value(camera->camhandle, &camera->polled, &server_status_fields[i], true, value, sizeof(value));
+        write_socket_printf(event, "%s\"%s\":%s", first ? "" : ",", server_status_fields[i].name, value);
+        first = false;
+    }
+    if (conn->sub_new_buffers) {
+        write_socket_printf(event, "%s\"new_buffers\":[", first ? "" : ",");
+        first = true;
+        for (i = 0; i < 16; ++i) {
+            if ((conn->sub_new_buffers >> i) & 1) {
+                write_socket_printf(event, "%s%u", first ? "" : ",", i);
+                first = false;
+            }
+        }
+        write_socket_answer(event, "]");
+    }
+    write_socket_answer(event, "}\n");
+    conn->sub_changed = 0;
+    conn->sub_new_buffers = 0;
+    event->conn = conn;
+    camera_post(conn, event, true);
+}
+
+static bool status_field_equal(const server_status_field_t *field, const pslr_status *a, const pslr_status *b) {
+    switch (field->kind) {
+    case STATUS_UINT16:
+        return !memcmp((const uint8_t *) a + field->offset, (const uint8_t *) b + field->offset, sizeof(uint16_t));
+    case STATUS_UINT32:
+    case STATUS_INT32:
+        return !memcmp((const uint8_t *) a + field->offset, (const uint8_t *) b + field->offset, sizeof(uint32_t));
+    case STATUS_RATIONAL:
+        return !memcmp((const uint8_t *) a + field->offset, (const uint8_t *) b + field->offset, sizeof(pslr_rational_t));
+    case STATUS_LENS_NAME:
+        return a->lens_id1 == b->lens_id1 && a->lens_id2 == b->lens_id2;
+    case STATUS_CAMERA_NAME:
+        break;
+    }
+    return true;
+}
+
+/* Compares a freshly read status with the previous one and queues the
+   differences for the subscribers. Every status read by the worker
+   goes through here, not only the periodic polls. */
+static void camera_status_update(server_camera_t *camera, const pslr_status *status) {
+    uint64_t changed = 0;
+    uint16_t new_buffers = 0;
+    server_conn_t *conn;
+    unsigned i;
+
+    pthread_mutex_lock(&server.mutex);
+    if (!camera->polled_valid) {
+        changed = STATUS_MASK_ALL;
+    } else {
+        for (i = 0; i < STATUS_FIELD_COUNT; ++i) {
+            if (!status_field_equal(&server_status_fields[i], &camera->polled, status)) {
+                changed |= (uint64_t) 1 << i;
+            }
+        }
+        new_buffers = status->bufmask & ~camera->polled.bufmask;
+    }
+    camera->polled = *status;
+    camera->polled_valid = true;
+    for (conn = camera->subscribers; conn; conn = conn->sub_next) {
+        conn->sub_changed |= changed & conn->sub_mask;
+        conn->sub_new_buffers |= new_buffers;
+        camera_notify(camera, conn);
+    }
+    pthread_mutex_unlock(&server.mutex);
+}
+
+/* Sets the subscribed fields of a connection, 0 unsubscribes. The
+   first event after subscribing reports every selected field. */
+static void camera_subscribe(server_camera_t *camera, server_conn_t *conn, uint64_t mask) {
+    server_conn_t **p;
+
+    pthread_mutex_lock(&server.mutex);
+    if (conn->sub_camera && (conn->sub_camera != camera || !mask)) {
+        // a connection follows one camera at a time
+        for (p = &conn->sub_camera->subscribers; *p != conn; p = &(*p)->sub_next)
+            ;
+        *p = conn->sub_next;
+        conn->sub_camera = NULL;
+    }
+    if (mask && !conn->sub_camera && !conn->dead) {
+        conn->sub_next = camera->subscribers;
+        camera->subscribers = conn;
+        conn->sub_camera = camera;
+        clock_gettime(CLOCK_MONOTONIC, &camera->next_poll);
+    }
+    conn->sub_mask = mask;
+    conn->sub_changed = mask;
+    conn->sub_new_buffers = 0;
+    pthread_mutex_unlock(&server.mutex);
+}
+
+/* Whether the shared status poll is due, called with the mutex held */
+static bool camera_poll_due(server_camera_t *camera) {
+    struct timespec now;
+    if (!camera->subscribers || !camera->camhandle) {
+        return false;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec > camera->next_poll.tv_sec
+        || (now.tv_sec == camera->next_poll.tv_sec && now.tv_nsec >= camera->next_poll.tv_nsec);
+}
+
+/* Reads the status for the subscribers, called with the mutex held */
+static void camera_poll(server_camera_t *camera) {
+    pslr_status status;
+    int r;
+
+    pthread_mutex_unlock(&server.mutex);
+    r = pslr_get_status(camera->camhandle, &status);
+    if (!r) {
+        camera->status = status;
+        camera_status_update(camera, &status);
+    }
+    pthread_mutex_lock(&server.mutex);
+
+    clock_gettime(CLOCK_MONOTONIC, &camera->next_poll);
+    camera->next_poll.tv_sec += camera->poll_interval / 1000;
+    camera->next_poll.tv_nsec += (long) (camera->poll_interval % 1000) * 1000000;
+    if (camera->next_poll.tv_nsec >= 1000000000) {
+        camera->next_poll.tv_sec++;
+        camera->next_poll.tv_nsec -= 1000000000;
+    }
+    servermode_wakeup();
+}
+
+/* Collects the answer of one camera of a broadcast, the answer of the
+   broadcast is posted with the last one: the result and ID=RESULT for
+   every camera. Called with the mutex held. */
+static void camera_part_done(server_conn_t *conn, server_job_t *job) {
+    server_job_t *parent = job->parent;
+    int i;
+
+    if (!job->reply || job->reply->length == 0 || job->reply->data[0] != '0') {
+        parent->failures |= 1u << job->camera->index;
+    }
+    if (--parent->parts > 0) {
+        return;
+    }
+    write_socket_printf(parent, "%d", parent->failures ? 1 : 0);
+    for (i = 0; i < server.camera_count; ++i) {
+        if ((parent->targets >> i) & 1) {
+            write_socket_printf(parent, " %d=%d", i, (parent->failures >> i) & 1);
+        }
+    }
+    write_socket_answer(parent, "\n");
+    servermode_record(parent);
+    camera_post(conn, parent, true);
+    free(parent->reply);
+    free(parent);
+}
+
+static void *camera_worker(void *arg) {
+    server_camera_t *camera = arg;
+
+    pthread_mutex_lock(&server.mutex);
+    while (!camera->quit && !server.stopping) {
+        server_conn_t *conn;
+        server_job_t *job;
+        bool dead;
+        bool done;
+
+        if (camera_poll_due(camera)) {
+            camera_poll(camera);
+            continue;
+        }
+        conn = camera_next_ready(camera, &job);
+        if (!conn) {
+            if (camera->subscribers && camera->camhandle) {
+                pthread_cond_timedwait(&camera->cond, &server.mutex, &camera->next_poll);
+            } else {
+                pthread_cond_wait(&camera->cond, &server.mutex);
+            }
+            continue;
+        }
+        dead = conn->dead;
+        if (!dead && servermode_uses_buffer(job->command)) {
+            camera->buffer_owner = job;
+        }
+        pthread_mutex_unlock(&server.mutex);
+
+        if (dead) {
+            // nobody reads the answer, stop the download
+            if (job->transfer && !job->suspended && camera->camhandle) {
+                pslr_buffer_close(camera->camhandle);
+            }
+            job->transfer = false;
+            job_release_memfd(job);
+            done = true;
+        } else if (job->answered) {
+            done = true;
+        } else {
+            done = servermode_command(camera, job);
+        }
+
+        pthread_mutex_lock(&server.mutex);
+        if (job->parent) {
+            camera_part_done(conn, job);
+        } else {
+            camera_post(conn, job, done);
+        }
+        if (!done && conn->binary && job->next) {
+            // a download takes turns with the other requests of the connection
+            conn_unlink_job(conn, job);
+            conn->jobs_tail->next = job;
+            conn->jobs_tail = job;
+        }
+        if (done) {
+            conn_unlink_job(conn, job);
+            if (camera->buffer_owner == job) {
+                camera->buffer_owner = NULL;
+            }
+            --conn->pending;
+            --camera->queued;
+            if (!job->parent) {
+                servermode_record(job);
+            }
+            server.stopping = server.stopping || job->stop;
+            job_release_memfd(job);
+            free(job->reply);
+            free(job);
+            // events held back during a download
+            if (conn->sub_camera == camera) {
+                camera_notify(camera, conn);
+            }
+        }
+        conn_ready_push(conn);
+        servermode_wakeup();
+    }
+    pthread_mutex_unlock(&server.mutex);
+    return NULL;
+}
+
+static int camera_start(server_camera_t *camera) {
+    pthread_condattr_t attr;
+
+    camera->notify.event = true;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&camera->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    if (pthread_create(&camera->thread, NULL, camera_worker, camera) != 0) {
+        fprintf(stderr, "Could not start the camera thread\n");
+        pthread_cond_destroy(&camera->cond);
+        return -1;
+    }
+    return 0;
+}
+
+/* Stops the worker, the queues are freed by servermode_cleanup */
+static void camera_stop(server_camera_t *camera) {
+    pthread_mutex_lock(&server.mutex);
+    camera->quit = true;
+    pthread_cond_signal(&camera->cond);
+    pthread_mutex_unlock(&server.mutex);
+    pthread_join(camera->thread, NULL);
+
+    if (camera->buffer_owner && camera->camhandle) {
+        pslr_buffer_close(camera->camhandle);
+    }
+    camera->buffer_owner = NULL;
+    free(camera->notify.reply);
+    camera->notify.reply = NULL;
+    if (camera->camhandle) {
+        servermode_camera_close(camera);
+    }
+    pthread_cond_destroy(&camera->cond);
+}
+
+/* Finds the attached cameras and starts a worker for each of them.
+   With a single camera (or none yet) the worker connects to the
+   first camera found, as without routing. */
+static int servermode_start_cameras(const servermode_options_t *options) {
+    struct epoll_event ev;
+    char **devices;
+    int count = 0;
+    int i;
+
+    server.wakeup.kind = SERVER_WAKEUP;
+    server.wakeup.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (server.wakeup.fd < 0) {
+        fprintf(stderr, "Could not create eventfd\n");
+        return -1;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = &server.wakeup;
+    if (epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.wakeup.fd, &ev) < 0) {
+        close(server.wakeup.fd);
+        return -1;
+    }
+
+    devices = pslr_find_cameras(&count);
+    if (count > SERVER_MAX_CAMERAS) {
+        fprintf(stderr, "Only the first %d cameras are used\n", SERVER_MAX_CAMERAS);
+    }
+    server.camera_count = count < 1 ? 1 : count > SERVER_MAX_CAMERAS ? SERVER_MAX_CAMERAS : count;
+    for (i = 0; i < count; ++i) {
+        if (i < server.camera_count) {
+            server_camera_t *camera = &server.cameras[i];
+            snprintf(camera->device, sizeof(camera->device), "%s", devices[i]);
+            pslr_get_device_serial(devices[i], camera->serial, sizeof(camera->serial));
+            DPRINT("Camera %d: %s %s\n", i, camera->device, camera->serial);
+        }
+        free(devices[i]);
+    }
+    free(devices);
+
+    for (i = 0; i < server.camera_count; ++i) {
+        server.cameras[i].index = i;
+        server.cameras[i].poll_interval = options->poll_interval;
+    }
+    pthread_mutex_init(&server.mutex, NULL);
+    for (i = 0; i < server.camera_count; ++i) {
+        if (camera_start(&server.cameras[i]) < 0) {
+            while (--i >= 0) {
+                camera_stop(&server.cameras[i]);
+            }
+            pthread_mutex_destroy(&server.mutex);
+            close(server.wakeup.fd);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static server_job_t *job_new(server_conn_t *conn, const char *command, uint32_t id) {
+    server_job_t *job = calloc(1, sizeof(server_job_t));
+
+    if (!job) {
+        return NULL;
+    }
+    job->conn = conn;
+    job->camera = &server.cameras[0];
+    job->id = id;
+    job->memfd = -1;
+    job->reply_fd = -1;
+    clock_gettime(CLOCK_MONOTONIC, &job->queued);
+    snprintf(job->command, sizeof(job->command), "%s", command);
+    strip(job->command);
+    return job;
+}
+
+/* Queues a job for its camera, called with the mutex held */
+static void conn_push_job(server_conn_t *conn, server_job_t *job) {
+    if (conn->jobs_tail) {
+        conn->jobs_tail->next = job;
+    } else {
+        conn->jobs = job;
+    }
+    conn->jobs_tail = job;
+    ++conn->pending;
+    ++job->camera->queued;
+    camera_ready_push(job->camera, conn);
+    pthread_cond_signal(&job->camera->cond);
+}
+
+/* The cameras selected by a comma separated list of camera ids,
+   device names, serial numbers, models or "all", called with the
+   mutex held. Returns 0 if a term matches no camera. */
+static uint32_t servermode_select(const char *selector) {
+    uint32_t mask = 0;
+    const char *p = selector;
+
+    while (*p) {
+        size_t n = strcspn(p, ",");
+        uint32_t term = 0;
+        char *end;
+        long id = strtol(p, &end, 10);
+        int i;
+
+        for (i = 0; i < server.camera_count; ++i) {
+            server_camera_t *camera = &server.cameras[i];
+            if ((n == 3 && !strncmp(p, "all", 3))
+                || (end == p + n && n > 0 && id == i)
+                || (camera->device[0] && strlen(camera->device) == n && !strncmp(p, camera->device, n))
+                || (camera->serial[0] && strlen(camera->serial) == n && !strncmp(p, camera->serial, n))
+                || (camera->name[0] && strlen(camera->name) == n && !strncasecmp(p, camera->name, n))) {
+                term |= 1u << i;
+            }
+        }
+        if (!term) {
+            return 0;
+        }
+        mask |= term;
+        p += n;
+        if (*p == ',') {
+            ++p;
+        }
+    }
+    return mask;
+}
+
+/* Commands without data in the answer, they can go to several cameras */
+static bool servermode_broadcasts(const char *command) {
+    return command_is(command, "connect") || command_is(command, "disconnect")
+        || command_is(command, "update_status") || command_is(command, "focus")
+        || command_is(command, "shutter") || command_is(command, "delete_buffer");
+}
+
+/* Writes the statistics in the Prometheus text format, called on the
+   event loop with the mutex held */
+static void servermode_metrics(server_job_t *page) {
+    pslr_io_counters_t io;
+    unsigned i, j;
+
+    write_socket_answer(page, "# HELP pktriggercord_requests_total Server mode commands executed.\n"
+                        "# TYPE pktriggercord_requests_total counter\n");
+    for (i = 0; i < SERVER_COMMAND_COUNT; ++i) {
+        if (server.stats.commands[i].count > 0) {
+            write_socket_printf(page, "pktriggercord_requests_total{command=\"%s\"} %llu\n",
+                                server_command_names[i], (unsigned long long) server.stats.commands[i].count);
+        }
+    }
+    write_socket_answer(page, "# HELP pktriggercord_request_duration_seconds Time from queueing a command until the camera finished it.\n"
+                        "# TYPE pktriggercord_request_duration_seconds histogram\n");
+    for (i = 0; i < SERVER_COMMAND_COUNT; ++i) {
+        const server_command_stats_t *stats = &server.stats.commands[i];
+        if (stats->count == 0) {
+            continue;
+        }
+        for (j = 0; j < SERVER_LATENCY_BUCKETS; ++j) {
+            write_socket_printf(page, "pktriggercord_request_duration_seconds_bucket{command=\"%s\",le=\"%g\"} %llu\n",
+                                server_command_names[i], server_latency_buckets[j], (unsigned long long) stats->buckets[j]);
+        }
+        write_socket_printf(page, "pktriggercord_request_duration_seconds_bucket{command=\"%s\",le=\"+Inf\"} %llu\n"
+                            "pktriggercord_request_duration_seconds_sum{command=\"%s\"} %.6f\n"
+                            "pktriggercord_request_duration_seconds_count{command=\"%s\"} %llu\n",
+                            server_command_names[i], (unsigned long long) stats->count,
+                            server_command_names[i], stats->seconds,
+                            server_command_names[i], (unsigned long long) stats->count);
+    }
+    write_socket_printf(page, "# HELP pktriggercord_connections Connected clients.\n"
+                        "# TYPE pktriggercord_connections gauge\n"
+                        "pktriggercord_connections %d\n"
+                        "# HELP pktriggercord_connections_total Clients accepted.\n"
+                        "# TYPE pktriggercord_connections_total counter\n"
+                        "pktriggercord_connections_total %llu\n",
+                        server.conn_count, (unsigned long long) server.stats.accepted);
+    write_socket_printf(page, "# HELP pktriggercord_sent_bytes_total Answer bytes sent to the clients.\n"
+                        "# TYPE pktriggercord_sent_bytes_total counter\n"
+                        "pktriggercord_sent_bytes_total %llu\n"
+                        "# HELP pktriggercord_http_requests_total Metrics pages served.\n"
+                        "# TYPE pktriggercord_http_requests_total counter\n"
+                        "pktriggercord_http_requests_total %llu\n",
+                        (unsigned long long) server.stats.bytes_sent, (unsigned long long) server.stats.http_requests);
+    write_socket_answer(page, "# HELP pktriggercord_queued_commands Commands waiting or running on the camera.\n"
+                        "# TYPE pktriggercord_queued_commands gauge\n");
+    for (i = 0; i < (unsigned) server.camera_count; ++i) {
+        write_socket_printf(page, "pktriggercord_queued_commands{camera=\"%u\"} %d\n", i, server.cameras[i].queued);
+    }
+    write_socket_answer(page, "# HELP pktriggercord_download_bytes_total Buffer bytes read from the camera.\n"
+                        "# TYPE pktriggercord_download_bytes_total counter\n");
+    for (i = 0; i < (unsigned) server.camera_count; ++i) {
+        write_socket_printf(page, "pktriggercord_download_bytes_total{camera=\"%u\"} %llu\n",
+                            i, (unsigned long long) server.cameras[i].downloaded);
+    }
+    write_socket_answer(page, "# HELP pktriggercord_download_seconds_total Time spent reading buffers from the camera.\n"
+                        "# TYPE pktriggercord_download_seconds_total counter\n");
+    for (i = 0; i < (unsigned) server.camera_count; ++i) {
+        write_socket_printf(page, "pktriggercord_download_seconds_total{camera=\"%u\"} %.6f\n",
+                            i, server.cameras[i].download_seconds);
+    }
+    pslr_get_io_counters(&io);
+    write_socket_printf(page, "# HELP pktriggercord_usb_errors_total Failed SCSI transfers.\n"
+                        "# TYPE pktriggercord_usb_errors_total counter\n"
+                        "pktriggercord_usb_errors_total %u\n"
+                        "# HELP pktriggercord_camera_errors_total Camera commands answered with an error status.\n"
+                        "# TYPE pktriggercord_camera_errors_total counter\n"
+                        "pktriggercord_camera_errors_total %u\n"
+                        "# HELP pktriggercord_download_retries_total Download blocks read again.\n"
+                        "# TYPE pktriggercord_download_retries_total counter\n"
+                        "pktriggercord_download_retries_total %u\n"
+                        "# HELP pktriggercord_select_retries_total Buffer selections recovered after a desync.\n"
+                        "# TYPE pktriggercord_select_retries_total counter\n"
+                        "pktriggercord_select_retries_total %u\n"
+                        "# HELP pktriggercord_busy_polls_total Status reads while the camera was busy.\n"
+                        "# TYPE pktriggercord_busy_polls_total counter\n"
+                        "pktriggercord_busy_polls_total %u\n",
+                        io.usb_errors, io.camera_errors, io.download_retries, io.select_retries, io.busy_polls);
+}
+
+/* stats: the statistics as data after the length, like a buffer */
+static void servermode_stats(server_job_t *job) {
+    server_job_t page;
+    size_t length;
+
+    memset(&page, 0, sizeof(page));
+    servermode_metrics(&page);
+    length = page.reply ? page.reply->length : 0;
+    write_socket_printf(job, "%d %zu\n", 0, length);
+    write_socket_data_begin(job);
+    if (length > 0) {
+        write_socket_answer_bin(job, page.reply->data, length);
+    }
+    free(page.reply);
+}
+
+/* Queues a command of a client. "@SELECTOR command" sends it to other
+   cameras than the first one, the parts of a command selecting several
+   cameras run in parallel. */
+static void servermode_enqueue(server_conn_t *conn, const char *command, uint32_t id) {
+    server_job_t *job = job_new(conn, command, id);
+    uint32_t targets;
+    int i;
+
+    if (!job) {
+        fprintf(stderr, "Cannot queue the command\n");
+        conn->closing = true;
+        return;
+    }
+    pthread_mutex_lock(&server.mutex);
+    if (job->command[0] == '@') {
+        char *rest = strchr(job->command, ' ');
+        if (rest) {
+            *rest++ = '\0';
+        }
+        targets = servermode_select(job->command + 1);
+        if (!targets) {
+            write_socket_printf(job, "%d Unknown camera %s\n", 1, job->command + 1);
+            job->answered = true;
+        }
+        memmove(job->command, rest ? rest : "", rest ? strlen(rest) + 1 : 1);
+        if (targets && !(targets & (targets - 1))) {
+            job->camera = &server.cameras[ffs(targets) - 1];
+        } else if (targets && !servermode_broadcasts(job->command)) {
+            write_socket_printf(job, "%d Cannot send %s to several cameras\n", 1, job->command);
+            job->answered = true;
+        } else if (targets) {
+            job->targets = targets;
+            for (i = 0; i < server.camera_count; ++i) {
+                server_job_t *part;
+                if (!((targets >> i) & 1)) {
+                    continue;
+                }
+                part = job_new(conn, job->command, id);
+                if (!part) {
+                    fprintf(stderr, "Cannot queue the command\n");
+                    job->failures |= 1u << i;
+                    continue;
+                }
+                part->camera = &server.cameras[i];
+                part->parent = job;
+                ++job->parts;
+                conn_push_job(conn, part);
+            }
+            if (job->parts == 0) {
+                write_socket_printf(job, "%d\n", 1);
+                job->answered = true;
+            } else {
+                job = NULL;
+            }
+        }
+    }
+    if (job && !job->answered && command_is(job->command, "stats")) {
+        // answered here, the worker only keeps the order of the answers
+        servermode_stats(job);
+        job->answered = true;
+    }
+    if (job) {
+        conn_push_job(conn, job);
+    }
+    pthread_mutex_unlock(&server.mutex);
+}
+
+/* Moves the answers of the worker to the connections */
+static void servermode_deliver(void) {
+    server_chunk_t *chunk;
+    uint64_t count;
+
+    if (read(server.wakeup.fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        DPRINT("eventfd read failed: %s\n", strerror(errno));
+    }
+    pthread_mutex_lock(&server.mutex);
+    chunk = server.done;
+    server.done = server.done_tail = NULL;
+    server.stop = server.stopping;
+    pthread_mutex_unlock(&server.mutex);
+
+    while (chunk) {
+        server_chunk_t *next = chunk->next;
+        server_conn_t *conn = chunk->conn;
+
+        pthread_mutex_lock(&server.mutex);
+        --conn->pending;
+        pthread_mutex_unlock(&server.mutex);
+        if (conn->ep.fd >= 0) {
+            if (chunk->fd >= 0) {
+                conn_queue_fd(conn, chunk->fd);
+                chunk->fd = -1;
+            }
+            conn_queue(conn, chunk->data, chunk->length);
+            if (chunk->close) {
+                conn->closing = true;
+            }
+            conn_flush(conn);
+        } else {
+            conn_backlog(conn, -(int64_t) chunk->length);
+        }
+        if (chunk->fd >= 0) {
+            close(chunk->fd);
+        }
+        free(chunk);
+        chunk = next;
+    }
+
+    // connections waiting for their last job before closing
+    for (server_conn_t *conn = server.conns; conn; ) {
+        server_conn_t *next = conn->next;
+        if (conn->closing && conn->out_offset == conn->out_length) {
+            conn_flush(conn);
+        }
+        conn = next;
+    }
+}
+
+/* Queues an answer of the event loop itself */
+static void conn_queue_local(server_conn_t *conn, const uint8_t *data, size_t length) {
+    conn_backlog(conn, length);
+    conn_queue(conn, data, length);
+}
+
+static void conn_queue_frame(server_conn_t *conn, uint32_t id, uint8_t type, const char *payload) {
+    uint8_t header[SERVERMODE_FRAME_HEADER];
+    frame_header(header, strlen(payload), id, type, 0);
+    conn_queue_local(conn, header, sizeof(header));
+    conn_queue_local(conn, (const uint8_t *) payload, strlen(payload));
+}
+
+/* Queues the complete request frames of the input buffer */
+static void conn_read_frames(server_conn_t *conn) {
+    size_t offset = 0;
+
+    while (!conn->closing) {
+        const uint8_t *p = (const uint8_t *) conn->in + offset;
+        size_t available = conn->in_length - offset;
+        char command[SERVER_LINE_MAX+1];
+        uint32_t length, id;
+
+        if (conn->skip > 0) {
+            size_t n = available < conn->skip ? available : conn->skip;
+            conn->skip -= n;
+            offset += n;
+            if (conn->skip > 0) {
+                break;
+            }
+            continue;
+        }
+        if (available < SERVERMODE_FRAME_HEADER) {
+            break;
+        }
+        length = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+        id = p[4] | (p[5] << 8) | (p[6] << 16) | ((uint32_t) p[7] << 24);
+        if (p[8] != SERVERMODE_FRAME_REQUEST || length > SERVER_LINE_MAX - SERVERMODE_FRAME_HEADER) {
+            conn_queue_frame(conn, id, SERVERMODE_FRAME_RESPONSE,
+                             p[8] != SERVERMODE_FRAME_REQUEST ? "1 Invalid frame type\n" : "1 Command too long\n");
+            conn->skip = length;
+            offset += SERVERMODE_FRAME_HEADER;
+            continue;
+        }
+        if (available < SERVERMODE_FRAME_HEADER + length) {
+            break;
+        }
+        memcpy(command, p + SERVERMODE_FRAME_HEADER, length);
+        command[length] = '\0';
+        servermode_enqueue(conn, command, id);
+        offset += SERVERMODE_FRAME_HEADER + length;
+    }
+    conn->in_length -= offset;
+    memmove(conn->in, conn->in + offset, conn->in_length);
+}
+
+/* A connection starting with SERVERMODE_MAGIC uses the binary protocol,
+   one starting with "GET " is a web client asking for the metrics,
+   anything else is a text client. Returns false while undecided. */
+static bool conn_detect(server_conn_t *conn, bool drained) {
+    size_t n = conn->in_length < 4 ? conn->in_length : 4;
+    bool http = !memcmp(conn->in, "GET ", n);
+
+    if ((memcmp(conn->in, SERVERMODE_MAGIC, n) != 0 && !http) || (drained && n < 4)) {
+        conn->detected = true;
+    } else if (n == 4 && http) {
+        conn->detected = true;
+        conn->http = true;
+    } else if (n == 4) {
+        conn->detected = true;
+        conn->binary = true;
+        conn->in_length -= 4;
+        memmove(conn->in, conn->in + 4, conn->in_length);
+        conn_queue_local(conn, (const uint8_t *) SERVERMODE_MAGIC, 4);
+        DPRINT("Binary protocol\n");
+    }
+    return conn->detected;
+}
+
+/* Answers the metrics once the request header is complete, the
+   connection is closed after the answer */
+static void conn_read_http(server_conn_t *conn) {
+    server_job_t page;
+    char header[256];
+    size_t length;
+    bool found;
+
+    conn->in[conn->in_length] = '\0';
+    if (!strstr(conn->in, "\r\n\r\n") && !strstr(conn->in, "\n\n") && conn->in_length < SERVER_LINE_MAX) {
+        return;
+    }
+    found = !strncmp(conn->in, "GET /metrics ", 13) || !strncmp(conn->in, "GET / ", 6);
+    memset(&page, 0, sizeof(page));
+    if (found) {
+        ++server.stats.http_requests;
+        pthread_mutex_lock(&server.mutex);
+        servermode_metrics(&page);
+        pthread_mutex_unlock(&server.mutex);
+    }
+    length = page.reply ? page.reply->length : 0;
+    snprintf(header, sizeof(header), "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\n"
+             "Content-Length: %zu\r\nConnection: close\r\n\r\n", found ? "200 OK" : "404 Not Found", length);
+    conn_queue_local(conn, (const uint8_t *) header, strlen(header));
+    if (length > 0) {
+        conn_queue_local(conn, page.reply->data, length);
+    }
+    free(page.reply);
+    conn->in_length = 0;
+    conn->closing = true;
+}
+
+/* Splits the received bytes into newline terminated commands, or
+   request frames for the binary protocol. Older text clients send a
+   bare command per write and wait for the answer, so whatever is left
+   once the socket is drained is taken as a complete command too. */
+static void conn_read(server_conn_t *conn) {
+    while (!conn->closing) {
+        ssize_t r = recv(conn->ep.fd, conn->in + conn->in_length, SERVER_LINE_MAX - conn->in_length, 0);
+        char *line, *nl;
+
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            fprintf(stderr, "recv failed\n");
+            conn_close(conn);
+            return;
+        }
+        if (r <= 0) {
+            if (!conn->binary && !conn->http && conn->in_length > 0 && conn_detect(conn, true)) {
+                if (!conn->discard) {
+                    conn->in[conn->in_length] = '\0';
+                    servermode_enqueue(conn, conn->in, 0);
+                }
+                conn->in_length = 0;
+            }
+            conn->discard = false;
+            conn->closing = conn->closing || r == 0;
+            break;
+        }
+
+        conn->in_length += r;
+        if (!conn->detected && !conn_detect(conn, false)) {
+            continue;
+        }
+        if (conn->binary) {
+            conn_read_frames(conn);
+            continue;
+        }
+        if (conn->http) {
+            conn_read_http(conn);
+            continue;
+        }
+        conn->in[conn->in_length] = '\0';
+        line = conn->in;
+        while ((nl = memchr(line, '\n', conn->in + conn->in_length - line))) {
+            *nl = '\0';
+            if (conn->discard) {
+                conn->discard = false;
+            } else {
+                servermode_enqueue(conn, line, 0);
+            }
+            line = nl + 1;
+        }
+        conn->in_length -= line - conn->in;
+        memmove(conn->in, line, conn->in_length);
+        if (conn->in_length == SERVER_LINE_MAX) {
+            const char *answer = "1 Command too long\n";
+            conn_queue_local(conn, (const uint8_t *) answer, strlen(answer));
+            conn->in_length = 0;
+            conn->discard = true;
+        }
+    }
+    conn_flush(conn);
+}
+
+static void servermode_accept(server_endpoint_t *listener) {
+    while (true) {
+        struct sockaddr_storage client;
+        socklen_t c = sizeof(client);
+        struct epoll_event ev;
+        server_conn_t *conn;
+        int fd = accept(listener->fd, (struct sockaddr *)&client, &c);
+
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                fprintf(stderr, "accept failed: %s\n", strerror(errno));
+            }
+            return;
+        }
+        conn = calloc(1, sizeof(server_conn_t));
+        if (!conn || set_nonblocking(fd, true) < 0) {
+            fprintf(stderr, "Cannot set up the client connection\n");
+            free(conn);
+            close(fd);
+            continue;
+        }
+        conn->ep.kind = SERVER_CLIENT;
+        conn->ep.fd = fd;
+        conn->local = client.ss_family == AF_UNIX;
+        conn->events = EPOLLIN;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = conn->events;
+        ev.data.ptr = &conn->ep;
+        if (epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            fprintf(stderr, "epoll_ctl failed: %s\n", strerror(errno));
+            free(conn);
+            close(fd);
+            continue;
+        }
+        conn->next = server.conns;
+        server.conns = conn;
+        ++server.stats.accepted;
+        ++server.conn_count;
+        DPRINT("Connection accepted, %d clients\n", server.conn_count);
+    }
+}
+
+static int servermode_add_listener(int socket_desc) {
+    struct epoll_event ev;
+
+    if (listen(socket_desc, SOMAXCONN) < 0 || set_nonblocking(socket_desc, true) < 0) {
+        return -1;
+    }
+    server.listeners[server.listener_count].kind = SERVER_LISTENER;
+    server.listeners[server.listener_count].fd = socket_desc;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = &server.listeners[server.listener_count];
+    if (epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, socket_desc, &ev) < 0) {
+        return -1;
+    }
+    ++server.listener_count;
+    return 0;
+}
+
+/* Local clients on the unix socket can get the images as memfds */
+static int servermode_listen_unix(const char *path) {
+    struct sockaddr_un addr;
+    int socket_desc;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Unix socket path too long: %s\n", path);
+        return -1;
+    }
+    socket_desc = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (socket_desc == -1) {
+        fprintf(stderr, "Could not create unix socket\n");
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    // a socket left behind by an earlier server
+    unlink(path);
+    if (bind(socket_desc, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "bind(%s) failed: %s\n", path, strerror(errno));
+        close(socket_desc);
+        return -1;
+    }
+    server.unix_path = path;
+    if (servermode_add_listener(socket_desc) < 0) {
+        close(socket_desc);
+        return -1;
+    }
+    DPRINT("Listening on %s\n", path);
+    return 0;
+}
+
+static int servermode_listen(const servermode_options_t *options) {
+    struct addrinfo hints, *res, *ai;
+    char port[16];
+    int r;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    snprintf(port, sizeof(port), "%d", options->port);
+    if ((r = getaddrinfo(options->bind_address, port, &hints, &res)) != 0) {
+        fprintf(stderr, "Cannot resolve %s: %s\n", options->bind_address ? options->bind_address : "*", gai_strerror(r));
+        return -1;
+    }
+
+    for (ai = res; ai && server.listener_count < SERVER_MAX_LISTEN - 1; ai = ai->ai_next) {
+        int enable = 1;
+        int socket_desc = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (socket_desc == -1) {
+            continue;
+        }
+        if (setsockopt(socket_desc, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0) {
+            fprintf(stderr, "setsockopt(SO_REUSEADDR) failed\n");
+        }
+        if (ai->ai_family == AF_INET6) {
+            // the IPv4 wildcard address gets its own socket
+            setsockopt(socket_desc, IPPROTO_IPV6, IPV6_V6ONLY, &enable, sizeof(int));
+        }
+        if (bind(socket_desc, ai->ai_addr, ai->ai_addrlen) < 0 || servermode_add_listener(socket_desc) < 0) {
+            DPRINT("bind failed: %s\n", strerror(errno));
+            close(socket_desc);
+            continue;
+        }
+    }
+    freeaddrinfo(res);
+
+    if (server.listener_count == 0) {
+        fprintf(stderr, "bind failed. Error\n");
+        return -1;
+    }
+    DPRINT("Listening on %d socket(s), port %d\n", server.listener_count, options->port);
+    if (options->unix_path && servermode_listen_unix(options->unix_path) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static void conn_free(server_conn_t *conn) {
+    while (conn->jobs) {
+        server_job_t *job = conn->jobs;
+        conn->jobs = job->next;
+        if (job->parent && --job->parent->parts == 0) {
+            free(job->parent->reply);
+            free(job->parent);
+        }
+        job_release_memfd(job);
+        free(job->reply);
+        free(job);
+    }
+    while (conn->fds) {
+        server_fd_t *f = conn->fds;
+        conn->fds = f->next;
+        close(f->fd);
+        free(f);
+    }
+    free(conn->out);
+    free(conn);
+}
+
+/* Frees the closed connections the worker does not refer to any more */
+static void servermode_free_closed(void) {
+    server_conn_t **p = &server.closed;
+    pthread_mutex_lock(&server.mutex);
+    while (*p) {
+        server_conn_t *conn = *p;
+        if (conn->pending > 0) {
+            p = &conn->next;
+            continue;
+        }
+        *p = conn->next;
+        conn_free(conn);
+    }
+    pthread_mutex_unlock(&server.mutex);
+}
+
+static void servermode_cleanup(void) {
+    int i;
+    for (server_conn_t *conn = server.conns; conn; conn = conn->next) {
+        // deliver the last answers (e.g. to stopserver) before closing
+        if (conn->out_offset < conn->out_length && set_nonblocking(conn->ep.fd, false) == 0) {
+            send(conn->ep.fd, conn->out + conn->out_offset, conn->out_length - conn->out_offset, MSG_NOSIGNAL);
+        }
+    }
+    for (i = 0; i < server.camera_count; ++i) {
+        camera_stop(&server.cameras[i]);
+    }
+    while (server.done) {
+        server_chunk_t *chunk = server.done;
+        server.done = chunk->next;
+        if (chunk->fd >= 0) {
+            close(chunk->fd);
+        }
+        free(chunk);
+    }
+    server.done_tail = NULL;
+    pthread_mutex_destroy(&server.mutex);
+    close(server.wakeup.fd);
+    while (server.conns) {
+        server_conn_t *conn = server.conns;
+        server.conns = conn->next;
+        close(conn->ep.fd);
+        conn_free(conn);
+    }
+    while (server.closed) {
+        server_conn_t *conn = server.closed;
+        server.closed = conn->next;
+        conn_free(conn);
+    }
+    for (i = 0; i < server.listener_count; ++i) {
+        close(server.listeners[i].fd);
+    }
+    server.listener_count = 0;
+    if (server.unix_path) {
+        unlink(server.unix_path);
+    }
+    close(server.epoll_fd);
+}
+
+/* Closes the connections whose answers were not read for timeout
+   seconds. Returns true if some connection still has unsent answers. */
+static bool servermode_check_stalled(int timeout) {
+    struct timespec now;
+    bool waiting = false;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (server_conn_t *conn = server.conns; conn; ) {
+        server_conn_t *next = conn->next;
+        if (conn->out_offset < conn->out_length) {
+            if (now.tv_sec - conn->last_progress.tv_sec >= timeout) {
+                fprintf(stderr, "Client did not read its answers for %d seconds, disconnecting\n", timeout);
+                conn_close(conn);
+            } else {
+                waiting = true;
+            }
+        }
+        conn = next;
+    }
+    servermode_free_closed();
+    return waiting;
+}
+
+int servermode_socket(const servermode_options_t *options) {
+    struct epoll_event events[SERVER_MAX_EVENTS];
+
+    memset(&server, 0, sizeof(server));
+    server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (server.epoll_fd < 0) {
+        fprintf(stderr, "Could not create epoll instance\n");
+        return 1;
+    }
+    if (servermode_start_cameras(options) < 0) {
+        close(server.epoll_fd);
+        return 1;
+    }
+    if (servermode_listen(options) < 0) {
+        servermode_cleanup();
+        return 1;
+    }
+
+    DPRINT("Waiting for incoming connections...\n");
+    while( !server.stop ) {
+        // the timeout only applies while no client is connected,
+        // clients with unsent answers are checked every second
+        int timeout = server.conn_count == 0 ? options->timeout * 1000 : -1;
+        int n;
+        int i;
+
+        if (options->send_timeout > 0 && servermode_check_stalled(options->send_timeout)) {
+            timeout = 1000;
+        }
+        n = epoll_wait(server.epoll_fd, events, SERVER_MAX_EVENTS, timeout);
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            DPRINT("epoll_wait error\n");
+            servermode_cleanup();
+            return 1;
+        } else if (n == 0 && server.conn_count == 0) {
+            DPRINT("Timeout\n");
+            break;
+        }
+
+        for (i = 0; i < n && !server.stop; ++i) {
+            server_endpoint_t *ep = events[i].data.ptr;
+            if (ep->kind == SERVER_LISTENER) {
+                servermode_accept(ep);
+            } else if (ep->kind == SERVER_WAKEUP) {
+                servermode_deliver();
+            } else {
+                server_conn_t *conn = (server_conn_t *) ep;
+                if (conn->ep.fd < 0) {
+                    // closed while handling an earlier event of this batch
+                    continue;
+                }
+                if (events[i].events & EPOLLERR) {
+                    conn_close(conn);
+                    continue;
+                }
+                if ((events[i].events & EPOLLOUT) && conn_flush(conn) < 0) {
+                    continue;
+                }
+                if (conn->closing && (events[i].events & EPOLLHUP)) {
+                    // the answers of the queued commands cannot be sent any more
+                    conn_close(conn);
+                } else if (events[i].events & (EPOLLIN | EPOLLHUP)) {
+                    // a hangup is read as end of file after the last commands
+                    conn_read(conn);
+                }
+            }
+        }
+        servermode_free_closed();
     }
+    servermode_cleanup();
     return 0;
 }
 #endif
@@ -29,7 +29,34 @@
 #ifndef PKTRIGGERCORD_SERVERMODE_H
 #define PKTRIGGERCORD_SERVERMODE_H
 
-int servermode_socket();
+#define SERVERMODE_PORT 8888
+#define SERVERMODE_POLL_INTERVAL 500
+#define SERVERMODE_SEND_TIMEOUT 30
+
+/* Binary protocol: the client starts with SERVERMODE_MAGIC, the server
+   answers with the same magic, then both sides send frames. A frame is
+   a header of SERVERMODE_FRAME_HEADER bytes (little endian payload
+   length and request id, one byte type, one byte flags, two reserved
+   bytes) followed by the payload. */
+#define SERVERMODE_MAGIC "PKTB"
+#define SERVERMODE_FRAME_HEADER 12
+#define SERVERMODE_FRAME_REQUEST 1      /* client: command line */
+#define SERVERMODE_FRAME_RESPONSE 2     /* server: answer line of a request */
+#define SERVERMODE_FRAME_DATA 3         /* server: binary data of a request */
+#define SERVERMODE_FRAME_EVENT 4        /* server: status event, request id 0 */
+#define SERVERMODE_FRAME_MORE 0x01      /* more frames follow for the request */
+#define SERVERMODE_FRAME_ERROR 0x02     /* the data of the request is incomplete */
+
+typedef struct {
+    const char *bind_address;   /* NULL: every local address */
+    int port;
+    int timeout;                /* seconds to wait while no client is connected */
+    int poll_interval;          /* ms between status polls for the subscribers */
+    const char *unix_path;      /* unix socket for local clients, or NULL */
+    int send_timeout;           /* seconds a client may not read its answers */
+} servermode_options_t;
+
+int servermode_socket(const servermode_options_t *options);
 
 pslr_handle_t camera_connect( char *model, char *device, int timeout, char *error_message );
 
@@ -0,0 +1,123 @@
+/*
+    pkTriggerCord
+    Copyright (C) 2011-2016 Andras Salamon <andras.salamon@melda.info>
+    Remote control of Pentax DSLR cameras.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    and GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * Decompresses the .zst files written by pktriggercord-cli --compress.
+ *
+ *   pktriggercord-unzstd [FILE.zst ...]
+ *
+ * FILE.zst is decompressed into FILE, without arguments standard input
+ * is decompressed to standard output.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zstd.h>
+
+static int decompress(FILE *in, FILE *out, const char *name) {
+    ZSTD_DStream *ds = ZSTD_createDStream();
+    size_t in_size = ZSTD_DStreamInSize();
+    size_t out_size = ZSTD_DStreamOutSize();
+    void *in_buf = malloc(in_size);
+    void *out_buf = malloc(out_size);
+    size_t n;
+    size_t ret = 0;
+    int result = 0;
+
+    if (!ds || !in_buf || !out_buf) {
+        fprintf(stderr, "%s: out of memory\n", name);
+        result = -1;
+        goto the_end;
+    }
+    ZSTD_initDStream(ds);
+    while ((n = fread(in_buf, 1, in_size, in)) > 0) {
+        ZSTD_inBuffer input = { in_buf, n, 0 };
+        while (input.pos < input.size) {
+            ZSTD_outBuffer output = { out_buf, out_size, 0 };
+            ret = ZSTD_decompressStream(ds, &output, &input);
+            if (ZSTD_isError(ret)) {
+                fprintf(stderr, "%s: %s\n", name, ZSTD_getErrorName(ret));
+                result = -1;
+                goto the_end;
+            }
+            if (fwrite(out_buf, 1, output.pos, out) != output.pos) {
+                perror(name);
+                result = -1;
+                goto the_end;
+            }
+        }
+    }
+    if (ferror(in)) {
+        perror(name);
+        result = -1;
+    } else if (ret != 0) {
+        /* the last frame is not complete */
+        fprintf(stderr, "%s: truncated file\n", name);
+        result = -1;
+    }
+  the_end:
+    ZSTD_freeDStream(ds);
+    free(in_buf);
+    free(out_buf);
+    return result;
+}
+
+int main(int argc, char **argv) {
+    char out_name[4096];
+    FILE *in, *out;
+    size_t len;
+    int result = 0;
+    int i;
+
+    if (argc < 2) {
+        return decompress(stdin, stdout, "stdin") ? 1 : 0;
+    }
+    for (i = 1; i < argc; i++) {
+        len = strlen(argv[i]);
+        if (len <= 4 || strcmp(argv[i] + len - 4, ".zst") || len - 4 >= sizeof(out_name)) {
+            fprintf(stderr, "%s: unknown suffix, ignored\n", argv[i]);
+            result = 1;
+            continue;
+        }
+        memcpy(out_name, argv[i], len - 4);
+        out_name[len - 4] = '\0';
+        in = fopen(argv[i], "rb");
+        if (!in) {
+            perror(argv[i]);
+            result = 1;
+            continue;
+        }
+        out = fopen(out_name, "wb");
+        if (!out) {
+            perror(out_name);
+            fclose(in);
+            result = 1;
+            continue;
+        }
+        if (decompress(in, out, argv[i])) {
+            result = 1;
+        }
+        fclose(in);
+        if (fclose(out)) {
+            perror(out_name);
+            result = 1;
+        }
+    }
+    return result;
+}
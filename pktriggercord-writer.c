@@ -0,0 +1,929 @@
+/*
+    pkTriggerCord
+    Copyright (C) 2011-2016 Andras Salamon <andras.salamon@melda.info>
+    Remote control of Pentax DSLR cameras.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    and GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#ifndef WIN32
+#include <pthread.h>
+#include <semaphore.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#if defined(__has_include) && defined(__NR_io_uring_setup)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define WRITER_IO_URING
+#endif
+#endif
+#endif
+
+#include "pslr.h"
+#include "pktriggercord-writer.h"
+
+#define WRITER_ALIGN 4096
+// requested pipe size in splice mode
+#define WRITER_PIPE_SIZE (1024 * 1024)
+
+typedef struct {
+    uint8_t *data;
+    uint32_t length;
+} writer_block_t;
+
+#ifdef WRITER_IO_URING
+/* Minimal io_uring submission/completion queue, without liburing */
+typedef struct {
+    int fd;
+    void *sq_ptr;
+    size_t sq_size;
+    void *cq_ptr;
+    size_t cq_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+} writer_uring_t;
+#endif
+
+/* Single producer, single consumer ring. The producer owns head, the
+ * writer thread owns tail; the two semaphores count the free and the
+ * queued blocks and order the accesses to the blocks. Each side has to
+ * sleep while the other one is slow (USB or disk), so it waits on a
+ * semaphore instead of spinning on atomic head and tail indices. */
+struct writer {
+    int fd;
+    int error;                       // errno of the first failed write
+    uint8_t *pool;
+    writer_block_t *ring;
+    unsigned int nblocks;
+    unsigned int head;
+    unsigned int tail;
+    uint8_t *current;                // block being filled by writer_sink
+    uint32_t fill;
+    bool positional;                 // pwrite() at offset instead of write()
+    bool direct;                     // the fd is in O_DIRECT mode
+    off_t start;
+    off_t offset;                    // next pwrite() offset
+    uint64_t written;
+    uint64_t preallocated;
+    bool splice;                     // vmsplice() into a pipe, blocks are mapped one by one
+#ifdef WRITER_IO_URING
+    writer_uring_t *uring;
+    off_t uring_offset[WRITER_BLOCKS];
+    bool uring_done[WRITER_BLOCKS];
+    unsigned int uring_release;      // oldest block still in flight
+    unsigned int uring_inflight;
+#endif
+#ifndef WIN32
+    pthread_t thread;
+    sem_t free_blocks;
+    sem_t queued_blocks;
+#endif
+};
+
+/* Group commit: the files closed since the last sync are synced
+ * together when one of the limits is reached */
+static int fsync_batch = 0;
+static double fsync_seconds = 0;
+static uint64_t fsync_bytes = 0;
+static int fsync_pending = 0;
+static uint64_t fsync_pending_bytes = 0;
+static struct timeval fsync_start;
+static unsigned int fsync_count = 0;
+static bool fsync_manual = false;   // the caller runs writer_sync_batch
+#ifdef __linux__
+static int fsync_fd = -1;           // syncfs covers every file of the filesystem
+#else
+static int *fsync_fds = NULL;       // one fsync per file
+#endif
+
+/* write() or pwrite() the rest of the block, retrying short writes */
+static void writer_write(writer_t *w, uint8_t *data, uint32_t length, off_t offset) {
+    uint32_t done = 0;
+    ssize_t r;
+
+    if (w->error) {
+        return;
+    }
+    while (done < length) {
+#ifdef __linux__
+        if (w->positional) {
+            r = pwrite(w->fd, data + done, length - done, offset + done);
+        } else
+#endif
+        {
+            r = write(w->fd, data + done, length - done);
+        }
+        if (r == -1 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            w->error = r == 0 ? EIO : errno;
+            perror("write(buf)");
+            return;
+        }
+        done += r;
+    }
+}
+
+/* O_DIRECT needs aligned lengths; the short last block is written
+ * through the page cache */
+static void writer_direct_off(writer_t *w) {
+#ifdef __linux__
+    if (w->direct) {
+        DPRINT("writer: O_DIRECT off at %ld\n", (long) w->offset);
+        fcntl(w->fd, F_SETFL, fcntl(w->fd, F_GETFL) & ~O_DIRECT);
+        w->direct = false;
+    }
+#endif
+}
+
+#ifdef __linux__
+static uint8_t *writer_block_map(void) {
+    void *data = mmap(NULL, WRITER_BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return data == MAP_FAILED ? NULL : data;
+}
+
+/* Gift the pages of the block to the pipe. The pipe references them
+ * until the reader consumes them, so they are never written again: the
+ * block is unmapped and replaced by fresh pages. */
+static void writer_vmsplice(writer_t *w, writer_block_t *b) {
+    struct iovec iov;
+    uint8_t *data;
+    ssize_t r;
+
+    if (w->error) {
+        return;
+    }
+    iov.iov_base = b->data;
+    iov.iov_len = b->length;
+    while (iov.iov_len > 0) {
+        r = vmsplice(w->fd, &iov, 1, SPLICE_F_GIFT);
+        if (r == -1 && errno == EINTR) {
+            continue;
+        }
+        if (r == -1 && iov.iov_len == b->length && (errno == EINVAL || errno == ENOSYS)) {
+            DPRINT("writer: vmsplice: %s, using write\n", strerror(errno));
+            w->splice = false;
+            writer_write(w, b->data, b->length, 0);
+            return;
+        }
+        if (r <= 0) {
+            w->error = r == 0 ? EIO : errno;
+            perror("vmsplice");
+            return;
+        }
+        iov.iov_base = (uint8_t *) iov.iov_base + r;
+        iov.iov_len -= r;
+    }
+    data = writer_block_map();
+    if (!data) {
+        w->error = errno;
+        perror("mmap");
+        return;
+    }
+    munmap(b->data, WRITER_BLOCK_SIZE);
+    b->data = data;
+}
+
+static void writer_setup_splice(writer_t *w) {
+    struct stat st;
+    int size;
+
+    if (fstat(w->fd, &st) == -1 || !S_ISFIFO(st.st_mode)) {
+        return;
+    }
+    size = fcntl(w->fd, F_SETPIPE_SZ, WRITER_PIPE_SIZE);
+    if (size == -1) {
+        size = fcntl(w->fd, F_GETPIPE_SZ);
+    }
+    if (size <= 0) {
+        return;
+    }
+    w->splice = true;
+    DPRINT("writer: pipe size %d, vmsplice\n", size);
+}
+#endif
+
+static int writer_alloc_blocks(writer_t *w) {
+    void *pool;
+    unsigned int i;
+
+#ifdef __linux__
+    if (w->splice) {
+        // gifted pages are replaced, not reused (writer_vmsplice)
+        for (i = 0; i < w->nblocks; i++) {
+            w->ring[i].data = writer_block_map();
+            if (!w->ring[i].data) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+#endif
+#ifndef WIN32
+    if (posix_memalign(&pool, WRITER_ALIGN, (size_t) w->nblocks * WRITER_BLOCK_SIZE)) {
+        return -1;
+    }
+#else
+    pool = malloc((size_t) w->nblocks * WRITER_BLOCK_SIZE);
+    if (!pool) {
+        return -1;
+    }
+#endif
+    w->pool = pool;
+    for (i = 0; i < w->nblocks; i++) {
+        w->ring[i].data = w->pool + (size_t) i * WRITER_BLOCK_SIZE;
+    }
+    return 0;
+}
+
+static void writer_free_blocks(writer_t *w) {
+#ifdef __linux__
+    unsigned int i;
+
+    // without a pool the blocks are mapped one by one
+    for (i = 0; w->ring && !w->pool && i < w->nblocks; i++) {
+        if (w->ring[i].data) {
+            munmap(w->ring[i].data, WRITER_BLOCK_SIZE);
+        }
+    }
+#endif
+    free(w->pool);
+    free(w->ring);
+}
+
+static void writer_block(writer_t *w, writer_block_t *b) {
+    if (w->direct && b->length % WRITER_ALIGN) {
+        writer_direct_off(w);
+    }
+#ifdef __linux__
+    if (w->splice) {
+        writer_vmsplice(w, b);
+        w->written += b->length;
+        return;
+    }
+#endif
+    writer_write(w, b->data, b->length, w->offset);
+    w->offset += b->length;
+    w->written += b->length;
+}
+
+#ifdef WRITER_IO_URING
+static void writer_uring_free(writer_uring_t *u) {
+    if (u->sqes) {
+        munmap(u->sqes, u->sqes_size);
+    }
+    if (u->cq_ptr && u->cq_ptr != u->sq_ptr) {
+        munmap(u->cq_ptr, u->cq_size);
+    }
+    if (u->sq_ptr) {
+        munmap(u->sq_ptr, u->sq_size);
+    }
+    close(u->fd);
+    free(u);
+}
+
+static writer_uring_t *writer_uring_new(unsigned entries) {
+    struct io_uring_params params;
+    writer_uring_t *u;
+    uint8_t *sq;
+    uint8_t *cq;
+
+    u = calloc(1, sizeof(writer_uring_t));
+    if (!u) {
+        return NULL;
+    }
+    memset(&params, 0, sizeof(params));
+    u->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (u->fd < 0) {
+        DPRINT("writer: io_uring_setup: %s\n", strerror(errno));
+        free(u);
+        return NULL;
+    }
+    u->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    u->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_size > u->sq_size) {
+            u->sq_size = u->cq_size;
+        }
+        u->cq_size = u->sq_size;
+    }
+    u->sq_ptr = mmap(NULL, u->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ptr == MAP_FAILED) {
+        u->sq_ptr = NULL;
+        writer_uring_free(u);
+        return NULL;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        u->cq_ptr = u->sq_ptr;
+    } else {
+        u->cq_ptr = mmap(NULL, u->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+        if (u->cq_ptr == MAP_FAILED) {
+            u->cq_ptr = NULL;
+            writer_uring_free(u);
+            return NULL;
+        }
+    }
+    u->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        u->sqes = NULL;
+        writer_uring_free(u);
+        return NULL;
+    }
+    sq = u->sq_ptr;
+    cq = u->cq_ptr;
+    u->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    u->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    u->sq_array = (unsigned *) (sq + params.sq_off.array);
+    u->cq_head = (unsigned *) (cq + params.cq_off.head);
+    u->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    u->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    return u;
+}
+
+static int writer_uring_submit(writer_uring_t *u, int fd, uint8_t *buf, uint32_t length, off_t offset, uint64_t user_data) {
+    unsigned tail = *u->sq_tail;
+    unsigned index = tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[index];
+    int r;
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t) buf;
+    sqe->len = length;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+    u->sq_array[index] = index;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    do {
+        r = syscall(__NR_io_uring_enter, u->fd, 1, 0, 0, NULL, 0);
+    } while (r == -1 && errno == EINTR);
+    return r == 1 ? 0 : -1;
+}
+
+static int writer_uring_wait(writer_uring_t *u, uint64_t *user_data, int *res) {
+    unsigned head = *u->cq_head;
+    struct io_uring_cqe *cqe;
+
+    while (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+        if (syscall(__NR_io_uring_enter, u->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) == -1 && errno != EINTR) {
+            return -1;
+        }
+    }
+    cqe = &u->cqes[head & *u->cq_mask];
+    *user_data = cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* Blocks are given back to the producer in ring order */
+static void writer_uring_complete(writer_t *w, unsigned int seq) {
+    w->uring_done[seq % WRITER_BLOCKS] = true;
+    w->uring_inflight--;
+    while (w->uring_release != w->tail && w->uring_done[w->uring_release % WRITER_BLOCKS]) {
+        w->uring_done[w->uring_release % WRITER_BLOCKS] = false;
+        w->uring_release++;
+        sem_post(&w->free_blocks);
+    }
+}
+
+/* Wait for one completion. Failed or short writes are finished with
+ * pwrite(). */
+static void writer_uring_reap(writer_t *w) {
+    uint64_t seq;
+    int res;
+    writer_block_t *b;
+
+    if (writer_uring_wait(w->uring, &seq, &res) == -1) {
+        /* should not happen; give up on the blocks in flight, closing
+         * the ring cancels them */
+        w->error = errno;
+        perror("io_uring_enter");
+        while (w->uring_inflight) {
+            writer_uring_complete(w, w->uring_release);
+        }
+        return;
+    }
+    b = &w->ring[seq % w->nblocks];
+    if (res < 0) {
+        DPRINT("writer: io_uring write: %s\n", strerror(-res));
+        res = 0;
+    }
+    if (res < b->length) {
+        writer_write(w, b->data + res, b->length - res, w->uring_offset[seq % WRITER_BLOCKS] + res);
+    }
+    writer_uring_complete(w, seq);
+}
+
+/* Keep up to WRITER_BLOCKS writes in flight */
+static void writer_uring_loop(writer_t *w) {
+    writer_block_t *b;
+    unsigned int seq;
+    bool end = false;
+
+    w->uring_release = w->tail;
+    while (!end || w->uring_inflight) {
+        if (!end) {
+            if (w->uring_inflight == 0) {
+                while (sem_wait(&w->queued_blocks) == -1 && errno == EINTR)
+                    ;
+            } else if (sem_trywait(&w->queued_blocks) == -1) {
+                writer_uring_reap(w);
+                continue;
+            }
+            seq = w->tail;
+            b = &w->ring[seq % w->nblocks];
+            if (b->length == 0) {
+                end = true;
+                continue;
+            }
+            if (b->length % WRITER_ALIGN) {
+                // unaligned tail: drain the ring, then write it synchronously
+                while (w->uring_inflight) {
+                    writer_uring_reap(w);
+                }
+                w->tail++;
+                w->uring_release = w->tail;
+                writer_block(w, b);
+                sem_post(&w->free_blocks);
+                continue;
+            }
+            w->tail++;
+            w->uring_offset[seq % WRITER_BLOCKS] = w->offset;
+            w->uring_inflight++;
+            if (writer_uring_submit(w->uring, w->fd, b->data, b->length, w->offset, seq) == -1) {
+                writer_write(w, b->data, b->length, w->offset);
+                writer_uring_complete(w, seq);
+            }
+            w->offset += b->length;
+            w->written += b->length;
+        } else {
+            writer_uring_reap(w);
+        }
+    }
+}
+#endif
+
+#ifndef WIN32
+static void *writer_thread(void *arg) {
+    writer_t *w = (writer_t *) arg;
+    writer_block_t *b;
+
+#ifdef WRITER_IO_URING
+    if (w->uring) {
+        writer_uring_loop(w);
+        return NULL;
+    }
+#endif
+    while (1) {
+        while (sem_wait(&w->queued_blocks) == -1 && errno == EINTR)
+            ;
+        b = &w->ring[w->tail % w->nblocks];
+        w->tail++;
+        if (b->length == 0) {
+            // end of stream
+            break;
+        }
+        writer_block(w, b);
+        sem_post(&w->free_blocks);
+    }
+    return NULL;
+}
+#endif
+
+/* Prepare positional O_DIRECT writes, falls back to plain writes if
+ * the target does not support them (pipes, tmpfs) */
+static void writer_setup_direct(writer_t *w) {
+#ifdef __linux__
+    int flags;
+
+    if (w->start == (off_t) -1 || w->start % WRITER_ALIGN) {
+        DPRINT("writer: target is not seekable or not aligned, no direct io\n");
+        return;
+    }
+    w->positional = true;
+    w->offset = w->start;
+    flags = fcntl(w->fd, F_GETFL);
+    if (flags == -1 || fcntl(w->fd, F_SETFL, flags | O_DIRECT) == -1) {
+        DPRINT("writer: O_DIRECT is not supported: %s\n", strerror(errno));
+    } else {
+        w->direct = true;
+    }
+#ifdef WRITER_IO_URING
+    w->uring = writer_uring_new(WRITER_BLOCKS);
+#endif
+#endif
+}
+
+writer_t *writer_open(int fd, uint64_t size, int flags) {
+    writer_t *w;
+
+    w = calloc(1, sizeof(writer_t));
+    if (!w) {
+        return NULL;
+    }
+    w->fd = fd;
+    w->nblocks = WRITER_BLOCKS;
+#ifdef __linux__
+    if (!(flags & WRITER_DIRECT)) {
+        writer_setup_splice(w);
+    }
+#endif
+    w->ring = calloc(w->nblocks, sizeof(writer_block_t));
+    if (!w->ring || writer_alloc_blocks(w) == -1) {
+        writer_free_blocks(w);
+        free(w);
+        return NULL;
+    }
+    w->start = lseek(fd, 0, SEEK_CUR);
+#ifdef __linux__
+    if (size > 0 && w->start != (off_t) -1) {
+        if (fallocate(fd, 0, w->start, size) == 0) {
+            w->preallocated = size;
+        } else {
+            DPRINT("writer: fallocate: %s\n", strerror(errno));
+        }
+    }
+#endif
+    if (flags & WRITER_DIRECT) {
+        writer_setup_direct(w);
+    }
+#ifndef WIN32
+    sem_init(&w->free_blocks, 0, w->nblocks);
+    sem_init(&w->queued_blocks, 0, 0);
+    if (pthread_create(&w->thread, NULL, writer_thread, w)) {
+        sem_destroy(&w->free_blocks);
+        sem_destroy(&w->queued_blocks);
+        writer_direct_off(w);
+#ifdef WRITER_IO_URING
+        if (w->uring) {
+            writer_uring_free(w->uring);
+        }
+#endif
+        writer_free_blocks(w);
+        free(w);
+        return NULL;
+    }
+#endif
+    return w;
+}
+
+/* Returns the next free block, waits if all of them are queued */
+uint8_t *writer_get_block(writer_t *w) {
+#ifndef WIN32
+    while (sem_wait(&w->free_blocks) == -1 && errno == EINTR)
+        ;
+#endif
+    return w->ring[w->head % w->nblocks].data;
+}
+
+/* Queue the block returned by writer_get_block. length 0 releases the
+ * block without writing it. In direct mode only the last block may be
+ * shorter than WRITER_BLOCK_SIZE. */
+void writer_commit(writer_t *w, uint32_t length) {
+    writer_block_t *b = &w->ring[w->head % w->nblocks];
+    if (length == 0) {
+#ifndef WIN32
+        sem_post(&w->free_blocks);
+#endif
+        return;
+    }
+    b->length = length;
+#ifndef WIN32
+    w->head++;
+    sem_post(&w->queued_blocks);
+#else
+    writer_block(w, b);
+#endif
+}
+
+void writer_set_fsync_batch(int files) {
+    fsync_batch = files;
+}
+
+void writer_set_sync_limits(double seconds, uint64_t bytes) {
+    fsync_seconds = seconds;
+    fsync_bytes = bytes;
+}
+
+void writer_set_sync_manual(bool manual) {
+    fsync_manual = manual;
+}
+
+static bool writer_sync_enabled(void) {
+    return fsync_batch > 0 || fsync_seconds > 0 || fsync_bytes > 0;
+}
+
+int writer_sync_due(void) {
+    struct timeval now;
+
+    if (fsync_pending == 0) {
+        return 0;
+    }
+    if (fsync_batch > 0 && fsync_pending >= fsync_batch) {
+        return 1;
+    }
+    if (fsync_bytes > 0 && fsync_pending_bytes >= fsync_bytes) {
+        return 1;
+    }
+    if (fsync_seconds > 0) {
+        gettimeofday(&now, NULL);
+        if ((now.tv_sec - fsync_start.tv_sec) + (now.tv_usec - fsync_start.tv_usec) / 1000000.0 >= fsync_seconds) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+unsigned int writer_sync_count(void) {
+    return fsync_count;
+}
+
+/* Keeps a descriptor of the closed file for the next sync */
+static void writer_sync_add(int fd, uint64_t bytes) {
+#ifndef WIN32
+#ifdef __linux__
+    if (fsync_fd == -1) {
+        fsync_fd = dup(fd);
+    }
+#else
+    int *fds = realloc(fsync_fds, (fsync_pending + 1) * sizeof(int));
+    if (fds) {
+        fsync_fds = fds;
+        fsync_fds[fsync_pending] = dup(fd);
+    }
+#endif
+#endif
+    if (fsync_pending == 0) {
+        gettimeofday(&fsync_start, NULL);
+    }
+    fsync_pending++;
+    fsync_pending_bytes += bytes;
+}
+
+/* Flush the files closed since the last batch. Returns 0 or the errno
+ * of the failed sync, writer_sync_count() is only advanced on
+ * success. */
+int writer_sync_batch(void) {
+    int ret = 0;
+
+    if (fsync_pending == 0) {
+        return 0;
+    }
+    DPRINT("writer: sync %d files, %llu bytes\n", fsync_pending, (unsigned long long) fsync_pending_bytes);
+#ifndef WIN32
+#ifdef __linux__
+    if (fsync_fd != -1) {
+        if (syncfs(fsync_fd) == -1) {
+            ret = errno;
+        }
+        close(fsync_fd);
+        fsync_fd = -1;
+    }
+#else
+    int i;
+    for (i = 0; fsync_fds && i < fsync_pending; i++) {
+        if (fsync_fds[i] != -1) {
+            if (fsync(fsync_fds[i]) == -1 && !ret) {
+                ret = errno;
+            }
+            close(fsync_fds[i]);
+        }
+    }
+    free(fsync_fds);
+    fsync_fds = NULL;
+#endif
+#endif
+    if (ret) {
+        fprintf(stderr, "Cannot sync the output files: %s\n", strerror(ret));
+    } else {
+        fsync_count++;
+    }
+    fsync_pending = 0;
+    fsync_pending_bytes = 0;
+    return ret;
+}
+
+/* Wait for the queued blocks and free the writer. The file descriptor
+ * is not closed. Returns 0 or the errno of the first failed write. */
+int writer_close(writer_t *w) {
+    int ret;
+
+    writer_flush(w);
+#ifndef WIN32
+    writer_block_t *b;
+
+    while (sem_wait(&w->free_blocks) == -1 && errno == EINTR)
+        ;
+    b = &w->ring[w->head % w->nblocks];
+    b->length = 0;
+    w->head++;
+    sem_post(&w->queued_blocks);
+    pthread_join(w->thread, NULL);
+    sem_destroy(&w->free_blocks);
+    sem_destroy(&w->queued_blocks);
+#endif
+#ifdef WRITER_IO_URING
+    if (w->uring) {
+        writer_uring_free(w->uring);
+    }
+#endif
+#ifdef __linux__
+    writer_direct_off(w);
+    if (w->preallocated && w->written < w->preallocated) {
+        // aborted download, drop the preallocated tail
+        if (ftruncate(w->fd, w->start + w->written) == -1) {
+            perror("ftruncate");
+        }
+    }
+    if (w->positional && lseek(w->fd, w->start + w->written, SEEK_SET) == (off_t) -1) {
+        perror("lseek");
+    }
+#endif
+    if (writer_sync_enabled()) {
+        writer_sync_add(w->fd, w->written);
+        if (!fsync_manual && writer_sync_due()) {
+            writer_sync_batch();
+        }
+    }
+    ret = w->error;
+    writer_free_blocks(w);
+    free(w);
+    return ret;
+}
+
+void writer_flush(writer_t *w) {
+    if (w->current) {
+        writer_commit(w, w->fill);
+        w->current = NULL;
+    }
+}
+
+/* Copies into full blocks, so writes stay aligned */
+int writer_sink(uint8_t *buf, uint32_t length, uint32_t offset, uint32_t total, uintptr_t user_data) {
+    writer_t *w = (writer_t *) user_data;
+    uint32_t n;
+
+    while (length > 0) {
+        if (!w->current) {
+            w->current = writer_get_block(w);
+            w->fill = 0;
+        }
+        n = WRITER_BLOCK_SIZE - w->fill;
+        if (n > length) {
+            n = length;
+        }
+        memcpy(w->current + w->fill, buf, n);
+        w->fill += n;
+        buf += n;
+        length -= n;
+        if (w->fill == WRITER_BLOCK_SIZE) {
+            writer_commit(w, w->fill);
+            w->current = NULL;
+        }
+    }
+    return w->error ? PSLR_DEVICE_ERROR : PSLR_OK;
+}
+
+void writer_map_init(writer_map_t *m, int fd) {
+    memset(m, 0, sizeof(writer_map_t));
+    m->fd = fd;
+}
+
+/* Preallocate and map size bytes at the start of the file. Returns
+ * NULL if the target cannot be mapped (pipe, Windows). */
+uint8_t *writer_map(writer_map_t *m, uint64_t size) {
+#ifndef WIN32
+    void *map;
+
+    if (lseek(m->fd, 0, SEEK_CUR) != 0) {
+        return NULL;
+    }
+#ifdef __linux__
+    // no SIGBUS on a full disk when the pages are touched
+    if (fallocate(m->fd, 0, 0, size) == -1 && ftruncate(m->fd, size) == -1) {
+        return NULL;
+    }
+#else
+    if (ftruncate(m->fd, size) == -1) {
+        return NULL;
+    }
+#endif
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, m->fd, 0);
+    if (map == MAP_FAILED) {
+        DPRINT("writer: mmap: %s\n", strerror(errno));
+        if (ftruncate(m->fd, 0) == -1) {
+            perror("ftruncate");
+        }
+        return NULL;
+    }
+#ifdef MADV_SEQUENTIAL
+    madvise(map, size, MADV_SEQUENTIAL);
+#endif
+    m->map = map;
+    m->size = size;
+    return m->map;
+#else
+    return NULL;
+#endif
+}
+
+/* Unmap and cut the file to the downloaded size. Returns 0 or errno. */
+int writer_unmap(writer_map_t *m) {
+    int ret = 0;
+#ifndef WIN32
+    if (!m->map) {
+        return 0;
+    }
+    if (munmap(m->map, m->size) == -1) {
+        ret = errno;
+    }
+    if (m->written < m->size && ftruncate(m->fd, m->written) == -1) {
+        ret = errno;
+    }
+    if (lseek(m->fd, m->written, SEEK_SET) == (off_t) -1) {
+        ret = errno;
+    }
+    m->map = NULL;
+    if (writer_sync_enabled()) {
+        writer_sync_add(m->fd, m->written);
+        if (!fsync_manual && writer_sync_due()) {
+            writer_sync_batch();
+        }
+    }
+#endif
+    return ret;
+}
+
+uint8_t *writer_map_target(uint32_t total, uintptr_t user_data) {
+    return writer_map((writer_map_t *) user_data, total);
+}
+
+int writer_map_sink(uint8_t *buf, uint32_t length, uint32_t offset, uint32_t total, uintptr_t user_data) {
+    writer_map_t *m = (writer_map_t *) user_data;
+    uint32_t done = 0;
+    ssize_t r;
+
+    if (m->map) {
+        // already in place
+        m->written = offset + length;
+        return PSLR_OK;
+    }
+    while (done < length) {
+        r = write(m->fd, buf + done, length - done);
+        if (r == -1 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            perror("write(buf)");
+            return PSLR_DEVICE_ERROR;
+        }
+        done += r;
+    }
+    m->written = offset + length;
+    return PSLR_OK;
+}
@@ -0,0 +1,93 @@
+/*
+    pkTriggerCord
+    Copyright (C) 2011-2016 Andras Salamon <andras.salamon@melda.info>
+    Remote control of Pentax DSLR cameras.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    and GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef PKTRIGGERCORD_WRITER_H
+#define PKTRIGGERCORD_WRITER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Size of one block, same as the camera transfer block */
+#define WRITER_BLOCK_SIZE 65536
+/* Number of blocks in the ring */
+#define WRITER_BLOCKS 8
+
+/* writer_open flags */
+#define WRITER_DIRECT 1              // O_DIRECT, positional writes through io_uring or pwrite
+#define WRITER_MMAP   2              // download into the mapped file (see writer_map)
+
+/* The writer runs write() on a separate thread, so the camera transfer
+ * only waits for the disk if all blocks of the ring are queued.
+ *
+ * Usage (single producer):
+ *   w = writer_open(fd, size, flags);  // size is preallocated if not 0
+ *   while (...) {
+ *       buf = writer_get_block(w);     // WRITER_BLOCK_SIZE bytes
+ *       fill buf
+ *       writer_commit(w, length);
+ *   }
+ *   ret = writer_close(w);             // waits for the queued blocks
+ */
+typedef struct writer writer_t;
+
+writer_t *writer_open(int fd, uint64_t size, int flags);
+uint8_t *writer_get_block(writer_t *w);
+void writer_commit(writer_t *w, uint32_t length);
+int writer_close(writer_t *w);
+
+/* Group commit of the closed files: they are synced together after
+ * every files closed writers, after seconds since the first of them or
+ * after bytes written, 0 disables a limit. writer_close syncs when a
+ * limit is reached, unless the caller does it (writer_set_sync_manual)
+ * after it has finished the file, e.g. renamed it. writer_sync_count
+ * tells the number of successful syncs, a file closed before it
+ * changes is on the disk. */
+void writer_set_fsync_batch(int files);
+void writer_set_sync_limits(double seconds, uint64_t bytes);
+void writer_set_sync_manual(bool manual);
+int writer_sync_due(void);
+int writer_sync_batch(void);
+unsigned int writer_sync_count(void);
+
+/* pslr_buffer_sink_t adapter, user_data is the writer */
+int writer_sink(uint8_t *buf, uint32_t length, uint32_t offset, uint32_t total, uintptr_t user_data);
+/* Queue the partial block of writer_sink, needed before mixing
+ * writer_sink and writer_get_block */
+void writer_flush(writer_t *w);
+
+/* mmap mode: the file is preallocated and mapped, and the image is
+ * downloaded straight into the mapping, without a transfer buffer and
+ * without write() */
+typedef struct {
+    int fd;
+    uint8_t *map;
+    uint64_t size;
+    uint64_t written;
+} writer_map_t;
+
+void writer_map_init(writer_map_t *m, int fd);
+uint8_t *writer_map(writer_map_t *m, uint64_t size);
+int writer_unmap(writer_map_t *m);
+
+/* pslr_buffer_target_t and pslr_buffer_sink_t adapters, user_data is
+ * the writer_map_t. Without a mapping the sink writes to the fd. */
+uint8_t *writer_map_target(uint32_t total, uintptr_t user_data);
+int writer_map_sink(uint8_t *buf, uint32_t length, uint32_t offset, uint32_t total, uintptr_t user_data);
+
+#endif
@@ -39,12 +39,8 @@
 
 #include "pslr.h"
 #include "pslr_lens.h"
-
-#ifdef WIN32
-#define FILE_ACCESS O_WRONLY | O_CREAT | O_TRUNC | O_BINARY
-#else
-#define FILE_ACCESS O_WRONLY | O_CREAT | O_TRUNC
-#endif
+#include "pktriggercord-writer.h"
+#include "pktriggercord-output.h"
 
 #define GW(name) GTK_WIDGET (gtk_builder_get_object (xml, name))
 
@@ -83,7 +79,7 @@ static void which_iso_table(pslr_status *st, const int **table, int *steps);
 static void which_ec_table(pslr_status *st, const int **table, int *steps);
 static bool is_inside(int rect_x, int rect_y, int rect_w, int rect_h, int px, int py);
 
-static void save_buffer(int bufno, const char *filename);
+static void save_buffer(output_t *out, int bufno, const char *filename);
 
 /* ----------------------------------------------------------------------- */
 
@@ -196,6 +192,9 @@ static guint sbar_download_ctx;
 bool need_histogram=false;
 static GtkListStore *list_store;
 
+/* Buffer whose embedded jpeg was shown during the last raw download */
+static int embedded_preview_buffer = -1;
+
 bool debug = false;
 bool in_initcontrols = false;
 
@@ -822,9 +821,11 @@ static void manage_camera_buffers(pslr_status *st_new, pslr_status *st_old)
 {
     uint32_t new_pictures;
     bool deleted;
+    bool raw_autosave;
     int new_picture;
     int format;
     int i;
+    GtkWidget *pw;
 
     if (!st_new) {
         for (i=0; i<MAX_BUFFERS; i++) {
@@ -852,11 +853,21 @@ static void manage_camera_buffers(pslr_status *st_new, pslr_status *st_old)
             break;
 	}
     }
-    if (new_picture >= 0) {
-        update_main_area(new_picture);
-    }
 
     format = get_user_file_format(st_new);
+    pw = GTK_WIDGET (gtk_builder_get_object (xml, "auto_save_check"));
+    /* Raw files are auto-saved with their embedded jpeg, which is shown
+     * during the download; only the thumbnail is needed */
+    raw_autosave = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(pw)) &&
+                   (format == USER_FILE_FORMAT_PEF || format == USER_FILE_FORMAT_DNG);
+    embedded_preview_buffer = -1;
+    if (new_picture >= 0) {
+        if (raw_autosave) {
+            update_preview_area(new_picture);
+        } else {
+            update_main_area(new_picture);
+        }
+    }
 
     /* auto-save check buffers */
     for (i=0; i<MAX_BUFFERS; i++) {
@@ -867,16 +878,21 @@ static void manage_camera_buffers(pslr_status *st_new, pslr_status *st_old)
 	    }
         }
     }
+    if (raw_autosave && new_picture >= 0 && embedded_preview_buffer != new_picture
+        && (new_pictures & (1<<new_picture))) {
+        /* no embedded jpeg found, download the preview */
+        update_main_area(new_picture);
+    }
 
     /* Update buffer window for buffers that were not deleted by
-     * auto_save_check */
+     * auto_save_check. The newest one already got its thumbnail
+     * together with the preview. */
     for (i=0; i<MAX_BUFFERS; i++) {
-        if (new_pictures & (1<<i)) {
+        if (i != new_picture && (new_pictures & (1<<i))) {
             update_preview_area(i);
 	}
     }
     /* Select the new picture in the buffer window */
-    GtkWidget *pw;
     pw = GTK_WIDGET (gtk_builder_get_object (xml, "preview_icon_view"));
 
     GtkTreePath *path;
@@ -889,7 +905,6 @@ static void manage_camera_buffers(pslr_status *st_new, pslr_status *st_old)
 
 static void manage_camera_buffers_limited() {
     update_main_area(0);
-    update_preview_area(0);
 }
 
 
@@ -926,6 +941,22 @@ G_MODULE_EXPORT void auto_folder_entry_changed_cb(GtkAction *action)
     plugin_config.autosave_path = g_strdup(gtk_entry_get_text(widget));
 }
 
+/* Output of the auto-save folder, reopened when the folder changes */
+static output_t *autosave_output = NULL;
+static gchar *autosave_output_path = NULL;
+
+static output_t *autosave_output_open(void)
+{
+    if (autosave_output && !g_strcmp0(autosave_output_path, plugin_config.autosave_path)) {
+        return autosave_output;
+    }
+    output_free(autosave_output);
+    g_free(autosave_output_path);
+    autosave_output_path = g_strdup(plugin_config.autosave_path);
+    autosave_output = output_open(plugin_config.autosave_path, NULL);
+    return autosave_output;
+}
+
 static bool auto_save_check(int format, int buffer)
 {
     GtkWidget *pw;
@@ -935,7 +966,6 @@ static bool auto_save_check(int format, int buffer)
     gint counter;
     int ret;
     GtkSpinButton *spin;
-    char *old_path = NULL;
     GtkProgressBar *pbar;
     bool deleted = false;
     char filename[256];
@@ -957,18 +987,14 @@ static bool auto_save_check(int format, int buffer)
     pw = GTK_WIDGET (gtk_builder_get_object (xml, "auto_name_entry"));
     filebase = gtk_entry_get_text(GTK_ENTRY(pw));
 
-    /* Change to auto-save path */
-    if (plugin_config.autosave_path) {
-        old_path = getcwd(NULL, 0);
-        if (chdir(plugin_config.autosave_path) == -1) {
-            char msg[256];
-
-            snprintf(msg, sizeof(msg), "Could not save in folder %s: %s",
-                     plugin_config.autosave_path, strerror(errno));
-            error_message(msg);
-            free(old_path);
-            return false;
-        }
+    /* the files are created relative to the auto-save folder */
+    if (!autosave_output_open()) {
+        char msg[256];
+
+        snprintf(msg, sizeof(msg), "Could not save in folder %s: %s",
+                 plugin_config.autosave_path ? plugin_config.autosave_path : ".", strerror(errno));
+        error_message(msg);
+        return false;
     }
 
     gtk_statusbar_push(statusbar, sbar_download_ctx, "Auto-saving");
@@ -978,7 +1004,7 @@ static bool auto_save_check(int format, int buffer)
     snprintf(filename, sizeof(filename), "%s%04d.%s", filebase, counter, file_formats[format].extension);
     DPRINT("Save buffer %d\n", buffer);
     gtk_progress_bar_set_text(pbar, filename);
-    save_buffer(buffer, filename);
+    save_buffer(autosave_output, buffer, filename);
     gtk_progress_bar_set_text(pbar, NULL);
 
     if (autodelete) {
@@ -1010,15 +1036,6 @@ static bool auto_save_check(int format, int buffer)
     DPRINT("Set counter -> %d\n", counter);
     gtk_spin_button_set_value(spin, counter);
 
-    if (old_path) {
-        ssize_t r = chdir(old_path);
-        if (r != 0) {
-          fprintf(stderr, "chdir(old_path) failed");
-        }
-
-        free(old_path);
-    }
-
     gtk_statusbar_pop(statusbar, sbar_download_ctx);
 
     //printf("auto_save_check done\n");
@@ -1029,76 +1046,94 @@ bool buf_updated = false;
 GdkPixbuf *pMainPixbuf = NULL;
 //static GdkPixbuf *pThumbPixbuf[MAX_BUFFERS];
 
+static GdkPixbuf *pixbuf_from_data(uint8_t *pImage, uint32_t imageSize)
+{
+    GError *pError = NULL;
+    GdkPixbuf *pixBuf;
+
+    DPRINT("got %d bytes at %p\n", imageSize, pImage);
+    GInputStream *ginput = g_memory_input_stream_new_from_data (pImage, imageSize, NULL);
+    pixBuf = gdk_pixbuf_new_from_stream( ginput, NULL, &pError);
+    /* the image is decoded, the caller can release the data */
+    g_object_unref(ginput);
+    if (!pixBuf) {
+        printf("No pixbuf from loader.\n");
+        g_clear_error(&pError);
+        return NULL;
+    }
+    return pixBuf;
+}
+
+/* Takes over the reference of pixBuf */
+static void set_main_pixbuf(GdkPixbuf *pixBuf)
+{
+    if (pMainPixbuf) {
+        g_object_unref(pMainPixbuf);
+    }
+    pMainPixbuf = pixBuf;
+}
+
+/*
+ * Fetch the preview and the thumbnail of a new picture in one buffer
+ * session. The preview comes first so the main area is updated as
+ * soon as possible.
+ */
 static void update_main_area(int buffer)
 {
-    GError *pError;
-    uint8_t *pImage;
-    uint32_t imageSize;
-    int r;
+    pslr_memory_sink_t preview = { NULL, 0, camhandle };
+    pslr_memory_sink_t thumbnail = { NULL, 0, camhandle };
+    pslr_rendition_t renditions[] = {
+        { PSLR_BUF_PREVIEW, 4, pslr_memory_sink, (uintptr_t) &preview, 0 },
+        { PSLR_BUF_THUMBNAIL, 4, pslr_memory_sink, (uintptr_t) &thumbnail, 0 }
+    };
     GdkPixbuf *pixBuf;
 
     gtk_statusbar_push(statusbar, sbar_download_ctx, "Getting preview");
     while (gtk_events_pending())
         gtk_main_iteration();
 
-    pError = NULL;
     DPRINT("Trying to read buffer %d\n", buffer);
-    r = pslr_get_buffer(camhandle, buffer, PSLR_BUF_PREVIEW, 4, &pImage, &imageSize);
-    if (r != PSLR_OK) {
+    pslr_buffer_fetch(camhandle, buffer, renditions, 2);
+    if (renditions[0].result != PSLR_OK) {
         printf("Could not get buffer data\n");
-        goto the_end;
+    } else if ((pixBuf = pixbuf_from_data(preview.data, preview.length))) {
+        set_main_pixbuf(pixBuf);
     }
-
-    GInputStream *ginput = g_memory_input_stream_new_from_data (pImage, imageSize, NULL);
-    pixBuf = gdk_pixbuf_new_from_stream( ginput, NULL, &pError);
-    if (!pixBuf) {
-        printf("No pixbuf from loader.\n");
-        goto the_end;
+    if (renditions[1].result != PSLR_OK) {
+        printf("Could not get thumbnail data\n");
+    } else if ((pixBuf = pixbuf_from_data(thumbnail.data, thumbnail.length))) {
+        set_preview_icon(buffer, pixBuf);
+        g_object_unref(pixBuf);
     }
-    g_object_ref(pixBuf);
-    pError = NULL;
-    pMainPixbuf = pixBuf;
+    pslr_buffer_release(camhandle, preview.data);
+    pslr_buffer_release(camhandle, thumbnail.data);
 
-  the_end:
     gtk_statusbar_pop(statusbar, sbar_download_ctx);
-
 }
 
 static void update_preview_area(int buffer)
 {
-    GError *pError;
-    uint8_t *pImage;
-    uint32_t imageSize;
-    int r;
+    pslr_image_t *image;
     GdkPixbuf *pixBuf;
-    //    GtkWidget *pw;
-
-    //    pw = GTK_WIDGET (gtk_builder_get_object (xml, "test_draw_area"));
 
     gtk_statusbar_push(statusbar, sbar_download_ctx, "Getting thumbnails");
     while (gtk_events_pending())
         gtk_main_iteration();
 
     DPRINT("buffer %d has new contents\n", buffer);
-    pError = NULL;
 
     DPRINT("Trying to get thumbnail\n");
-    r = pslr_get_buffer(camhandle, buffer, PSLR_BUF_THUMBNAIL, 4, &pImage, &imageSize);
-    if (r != PSLR_OK) {
+    image = pslr_get_image(camhandle, buffer, PSLR_BUF_THUMBNAIL, 4);
+    if (!image) {
         printf("Could not get buffer data\n");
         goto the_end;
     }
-    DPRINT("got %d bytes at %p\n", imageSize, pImage);
-    GInputStream *ginput = g_memory_input_stream_new_from_data (pImage, imageSize, NULL);
-
-    pixBuf = gdk_pixbuf_new_from_stream( ginput, NULL, &pError);
-    if (!pixBuf) {
-        printf("No pixbuf from loader.\n");
-        goto the_end;
+    pixBuf = pixbuf_from_data(image->data, image->length);
+    pslr_image_unref(image);
+    if (pixBuf) {
+        set_preview_icon(buffer, pixBuf);
+        g_object_unref(pixBuf);
     }
-    g_object_ref(pixBuf);
-    set_preview_icon(buffer, pixBuf);
-    pError = NULL;
   the_end:
     gtk_statusbar_pop(statusbar, sbar_download_ctx);
 }
@@ -1366,6 +1401,7 @@ GdkPixmap *calculate_histogram( GdkPixbuf *input, int hist_w, int hist_h ) {
             gdk_draw_rectangle(output, gc, TRUE, wx1, wy1, wx2-wx1, wy2-wy1);
         }
     }
+    g_object_unref(gc);
 
     return output;
 }
@@ -1579,9 +1615,13 @@ void init_preview_area(void)
     gtk_icon_view_set_model(GTK_ICON_VIEW(pw), GTK_TREE_MODEL(list_store));
 }
 
+/* Returns a new reference */
 GdkPixbuf *merge_preview_icons( GdkPixbuf *thumb, GdkPixmap *histogram ) {
     GdkPixbuf *output;
-    if( need_histogram ) {
+    if( !thumb ) {
+	return NULL;
+    }
+    if( need_histogram && histogram ) {
 	GdkPixmap *mMerged = gdk_pixmap_new(NULL, 2*HISTOGRAM_WIDTH, HISTOGRAM_HEIGHT, 24);
 	GdkGC *gc = gdk_gc_new( mMerged );
 	GdkPixbuf *scaledThumb = gdk_pixbuf_scale_simple( thumb, HISTOGRAM_WIDTH, HISTOGRAM_HEIGHT, GDK_INTERP_BILINEAR);
@@ -1589,8 +1629,12 @@ GdkPixbuf *merge_preview_icons( GdkPixbuf *thumb, GdkPixmap *histogram ) {
 	gdk_draw_drawable( mMerged, gc, histogram, 0, 0, HISTOGRAM_WIDTH, 0, HISTOGRAM_WIDTH, HISTOGRAM_HEIGHT);
 	GdkPixbuf *pMerged = gdk_pixbuf_get_from_drawable( NULL, mMerged, GDK_COLORSPACE_RGB, 0, 0, 0, 0, 2*HISTOGRAM_WIDTH, HISTOGRAM_HEIGHT );
 	output = gdk_pixbuf_scale_simple( pMerged, 2*THUMBNAIL_WIDTH, THUMBNAIL_HEIGHT, GDK_INTERP_BILINEAR);
+	g_object_unref(pMerged);
+	g_object_unref(scaledThumb);
+	g_object_unref(gc);
+	g_object_unref(mMerged);
     } else {
-	output = thumb;
+	output = g_object_ref(thumb);
     }
     return output;
 }
@@ -1617,6 +1661,11 @@ G_MODULE_EXPORT void menu_histogram_window_toggled_cb(GtkAction *action, gpointe
 	if( thumb ) {
 	    GdkPixbuf *pMerged = merge_preview_icons( thumb, hist );
 	    gtk_list_store_set (list_store, &iter, 0, thumb, 1, hist, 2, pMerged, -1);
+	    g_object_unref(pMerged);
+	    g_object_unref(thumb);
+	}
+	if( hist ) {
+	    g_object_unref(hist);
 	}
     }
 }
@@ -1634,7 +1683,14 @@ void set_preview_icon(int n, GdkPixbuf *pBuf)
     GdkPixmap *gpm = calculate_histogram( pBuf, HISTOGRAM_WIDTH, HISTOGRAM_HEIGHT/3 );
 
     GdkPixbuf *pMerged = merge_preview_icons( pBuf, gpm );
+    /* the list store keeps its own references */
     gtk_list_store_set (list_store, &iter, 0, pBuf, 1, gpm, 2, pMerged, -1);
+    if (gpm) {
+        g_object_unref(gpm);
+    }
+    if (pMerged) {
+        g_object_unref(pMerged);
+    }
 }
 
 G_MODULE_EXPORT gchar* shutter_scale_format_value_cb(GtkAction *action, gdouble value)
@@ -1968,18 +2024,100 @@ G_MODULE_EXPORT void preview_icon_view_selection_changed_cb(GtkAction *action)
  * settings.  Updates the progress bar periodically & runs the GTK
  * main loop to show it.
  */
-static void save_buffer(int bufno, const char *filename)
+/* While a file is downloaded, the camera is checked for new pictures
+ * this often (seconds). Their previews preempt the file download. */
+#define PREVIEW_POLL_INTERVAL 1.0
+
+typedef struct {
+    writer_t *writer;
+    writer_map_t *map;               // mmap mode
+    GtkWidget *progress;
+} file_sink_t;
+
+typedef struct {
+    pslr_rendition_t rendition;
+    pslr_memory_sink_t mem;
+} preview_job_t;
+
+typedef struct {
+    int bufno;
+    pslr_memory_sink_t mem;
+} embedded_preview_t;
+
+/* Download straight into memory mapped files (--mmap) */
+static bool save_mmap = false;
+
+static int file_sink(uint8_t *buf, uint32_t length, uint32_t offset, uint32_t total, uintptr_t user_data)
+{
+    file_sink_t *fs = (file_sink_t *) user_data;
+    gtk_progress_bar_update(GTK_PROGRESS_BAR(fs->progress), (gdouble) (offset + length) / (gdouble) total);
+    if (fs->map) {
+        return writer_map_sink(buf, length, offset, total, (uintptr_t) fs->map);
+    }
+    return writer_sink(buf, length, offset, total, (uintptr_t) fs->writer);
+}
+
+static uint8_t *file_target(uint32_t total, uintptr_t user_data)
+{
+    file_sink_t *fs = (file_sink_t *) user_data;
+    return writer_map(fs->map, total);
+}
+
+/* Receives the jpeg embedded in a raw file while the file is saved */
+static int embedded_preview_sink(uint8_t *buf, uint32_t length, uint32_t offset, uint32_t total, uintptr_t user_data)
+{
+    embedded_preview_t *ep = (embedded_preview_t *) user_data;
+    GdkPixbuf *pixBuf;
+    int ret;
+
+    ret = pslr_memory_sink(buf, length, offset, total, (uintptr_t) &ep->mem);
+    if (ret != PSLR_OK) {
+        return ret;
+    }
+    if (offset + length == total && (pixBuf = pixbuf_from_data(ep->mem.data, ep->mem.length))) {
+        set_main_pixbuf(pixBuf);
+        embedded_preview_buffer = ep->bufno;
+        gtk_widget_queue_draw(GTK_WIDGET (gtk_builder_get_object (xml, "main_drawing_area")));
+    }
+    return PSLR_OK;
+}
+
+static void download_done(int bufno, pslr_rendition_t *rendition, uintptr_t user_data)
+{
+    preview_job_t *job;
+    GdkPixbuf *pixBuf;
+
+    if (rendition->type != PSLR_BUF_PREVIEW) {
+        return;
+    }
+    job = (preview_job_t *) rendition;
+    if (rendition->result == PSLR_OK && (pixBuf = pixbuf_from_data(job->mem.data, job->mem.length))) {
+        set_main_pixbuf(pixBuf);
+        gtk_widget_queue_draw(GTK_WIDGET (gtk_builder_get_object (xml, "main_drawing_area")));
+    }
+    pslr_buffer_release(camhandle, job->mem.data);
+    free(job);
+}
+
+/* filename is relative to the directory of out */
+static void save_buffer(output_t *out, int bufno, const char *filename)
 {
     int r;
-    int fd;
     GtkWidget *pw;
     int quality;
     int resolution;
     int filefmt;
     pslr_buffer_type imagetype;
-    uint8_t buf[65536];
-    uint32_t length;
-    uint32_t current;
+    int fd;
+    pslr_scheduler_t *sched;
+    pslr_rendition_t rendition;
+    file_sink_t fs;
+    writer_map_t map;
+    pslr_preview_extractor_t extractor;
+    embedded_preview_t ep;
+    pslr_status st;
+    uint32_t known_mask;
+    GTimer *timer;
 
     pw = GTK_WIDGET (gtk_builder_get_object (xml, "jpeg_quality_combo"));
     quality = gtk_combo_box_get_active(GTK_COMBO_BOX(pw));
@@ -1997,46 +2135,99 @@ static void save_buffer(int bufno, const char *filename)
     }
     DPRINT("get buffer %d type %d res %d\n", bufno, imagetype, resolution);
 
-    r = pslr_buffer_open(camhandle, bufno, imagetype, resolution);
-    if (r != PSLR_OK) {
-        DPRINT("Could not open buffer: %d\n", r);
+    sched = pslr_scheduler_new(camhandle, download_done, 0);
+    if (!sched) {
         return;
     }
 
-    length = pslr_buffer_get_size(camhandle);
-    current = 0;
-
-    fd = open(filename, FILE_ACCESS, 0664);
+    /* the file gets its name when it is complete, mapping needs read access */
+    fd = output_create(out, filename, save_mmap);
     if (fd == -1) {
-        perror("could not open target");
+        pslr_scheduler_free(sched);
         return;
     }
-
-    pw = GTK_WIDGET (gtk_builder_get_object (xml, "download_progress"));
-
-    while (1) {
-        uint32_t bytes;
-        bytes = pslr_buffer_read(camhandle, buf, sizeof(buf));
-        //printf("Read %d bytes\n", bytes);
-        if (bytes == 0)
-            break;
-        ssize_t r = write(fd, buf, bytes);
-        if (r == 0) {
-            DPRINT("write(buf): Nothing has been written to buf.\n");
-        } else if (r == -1) {
-            perror("write(buf)");
-        } else if (r < bytes) {
-            DPRINT("write(buf): only write %d bytes, should be %d bytes.\n", r, bytes);
+    fs.writer = NULL;
+    fs.map = NULL;
+    if (save_mmap) {
+        /* the image is downloaded straight into the mapped file */
+        writer_map_init(&map, fd);
+        fs.map = &map;
+    } else {
+        /* the disk writes run on the writer thread */
+        fs.writer = writer_open(fd, 0, 0);
+        if (!fs.writer) {
+            output_publish(out, fd, filename, false);
+            pslr_scheduler_free(sched);
+            return;
+        }
+    }
+    fs.progress = GTK_WIDGET (gtk_builder_get_object (xml, "download_progress"));
+
+    rendition.type = imagetype;
+    rendition.resolution = resolution;
+    rendition.sink = file_sink;
+    rendition.user_data = (uintptr_t) &fs;
+    rendition.result = PSLR_OK;
+    rendition.target = save_mmap ? file_target : NULL;
+    if (imagetype == PSLR_BUF_PEF || imagetype == PSLR_BUF_DNG) {
+        /* show the embedded jpeg instead of downloading the preview */
+        ep.bufno = bufno;
+        ep.mem.data = NULL;
+        ep.mem.length = 0;
+        ep.mem.pool = camhandle;
+        pslr_preview_extractor_init(&extractor, file_sink, (uintptr_t) &fs, embedded_preview_sink, (uintptr_t) &ep);
+        extractor.target = rendition.target;
+        rendition.sink = pslr_preview_extractor_sink;
+        rendition.user_data = (uintptr_t) &extractor;
+        rendition.target = save_mmap ? pslr_preview_extractor_target : NULL;
+    }
+    pslr_scheduler_add(sched, bufno, &rendition, pslr_get_buffer_type_priority(imagetype));
+
+    known_mask = status_new ? status_new->bufmask : 0;
+    timer = g_timer_new();
+
+    while (pslr_scheduler_step(sched) > 0) {
+        if (g_timer_elapsed(timer, NULL) >= PREVIEW_POLL_INTERVAL) {
+            g_timer_start(timer);
+            if (pslr_get_status(camhandle, &st) == PSLR_OK && (st.bufmask & ~known_mask)) {
+                /* only the newest picture is shown */
+                int newest = 31 - __builtin_clz(st.bufmask & ~known_mask);
+                preview_job_t *job = calloc(1, sizeof(preview_job_t));
+                known_mask = st.bufmask;
+                if (job) {
+                    job->rendition.type = PSLR_BUF_PREVIEW;
+                    job->rendition.resolution = 0;
+                    job->rendition.sink = pslr_memory_sink;
+                    job->rendition.user_data = (uintptr_t) &job->mem;
+                    job->mem.pool = camhandle;
+                    pslr_scheduler_add(sched, newest, &job->rendition, PSLR_PRIORITY_PREVIEW);
+                }
+            }
         }
-        
-        current += bytes;
-        gtk_progress_bar_update(GTK_PROGRESS_BAR(pw), (gdouble) current / (gdouble) length);
         /* process pending events */
         while (gtk_events_pending())
             gtk_main_iteration();
     }
-    close(fd);
-    pslr_buffer_close(camhandle);
+    g_timer_destroy(timer);
+    pslr_scheduler_free(sched);
+    if (rendition.sink == pslr_preview_extractor_sink) {
+        pslr_preview_extractor_free(&extractor);
+        pslr_buffer_release(camhandle, ep.mem.data);
+    }
+    if (fs.map) {
+        r = writer_unmap(fs.map);
+    } else {
+        r = writer_close(fs.writer);
+    }
+    if (r) {
+        DPRINT("write(buf): %s\n", strerror(r));
+    }
+    output_publish(out, fd, filename, r == 0 && rendition.result == PSLR_OK);
+
+    r = rendition.result;
+    if (r != PSLR_OK) {
+        DPRINT("Could not read buffer: %d\n", r);
+    }
 }
 
 G_MODULE_EXPORT void preview_save_as_cb(GtkAction *action)
@@ -2065,11 +2256,23 @@ G_MODULE_EXPORT void preview_save_as_cb(GtkAction *action)
         gtk_widget_hide(pw);
         if (res > 0) {
             char *filename;
+            gchar *dir;
+            gchar *base;
+            output_t *out;
             filename = gtk_file_chooser_get_filename (GTK_FILE_CHOOSER (pw));
             DPRINT("Save to: %s\n", filename);
-            gtk_progress_bar_set_text(pbar, filename);
-            save_buffer(*pi, filename);
-            gtk_progress_bar_set_text(pbar, NULL);
+            dir = g_path_get_dirname(filename);
+            base = g_path_get_basename(filename);
+            out = output_open(dir, NULL);
+            if (out) {
+                gtk_progress_bar_set_text(pbar, filename);
+                save_buffer(out, *pi, base);
+                gtk_progress_bar_set_text(pbar, NULL);
+                output_free(out);
+            }
+            g_free(base);
+            g_free(dir);
+            g_free(filename);
         }
     }
 
@@ -2107,7 +2310,6 @@ G_MODULE_EXPORT void preview_delete_button_clicked_cb(GtkAction *action)
         pi = gtk_tree_path_get_indices(p);
         DPRINT("Selected item = %d\n", *pi);
 
-        // needed? : g_object_unref(thumbpixbufs[i])?
         set_preview_icon(*pi, NULL);
 
         ret = pslr_delete_buffer(camhandle, *pi);
@@ -2193,6 +2395,7 @@ static void which_shutter_table(pslr_status *st, pslr_rational_t **table, int *s
 
 static struct option const longopts[] ={
     {"debug", no_argument, NULL, 4},
+    {"mmap", no_argument, NULL, 5},
     { NULL, 0, NULL, 0}
 };
 
@@ -2203,6 +2406,9 @@ void gui_getopt(int argc, char **argv) {
             case 4:
                 debug = true;
                 break;
+            case 5:
+                save_mmap = true;
+                break;
         }
     }
     return;
@@ -84,16 +84,21 @@ static int ipslr_status(ipslr_handle_t *p, uint8_t *buf);
 static int ipslr_status_full(ipslr_handle_t *p, pslr_status *status);
 static int ipslr_press_shutter(ipslr_handle_t *p, bool fullpress);
 static int ipslr_select_buffer(ipslr_handle_t *p, int bufno, pslr_buffer_type buftype, int bufres);
+static int ipslr_buffer_check(ipslr_handle_t *p, int bufno);
+static int ipslr_buffer_select_segments(ipslr_handle_t *p, int bufno, pslr_buffer_type buftype, int bufres);
 static int ipslr_buffer_segment_info(ipslr_handle_t *p, pslr_buffer_segment_info *pInfo);
 static int ipslr_next_segment(ipslr_handle_t *p);
 static int ipslr_download(ipslr_handle_t *p, uint32_t addr, uint32_t length, uint8_t *buf);
 static int ipslr_identify(ipslr_handle_t *p);
+static void ipslr_pool_drain(ipslr_handle_t *p);
 static int _ipslr_write_args(uint8_t cmd_2, ipslr_handle_t *p, int n, ...);
 #define ipslr_write_args(p,n,...) _ipslr_write_args(0,(p),(n),__VA_ARGS__)
 #define ipslr_write_args_special(p,n,...) _ipslr_write_args(4,(p),(n),__VA_ARGS__)
 
 static int command(int fd, int a, int b, int c);
 static int get_status(int fd);
+static int io_scsi_read(int fd, uint8_t *cmd, uint32_t cmdLen, uint8_t *buf, uint32_t bufLen);
+static int io_scsi_write(int fd, uint8_t *cmd, uint32_t cmdLen, uint8_t *buf, uint32_t bufLen);
 static int get_result(int fd);
 static int read_result(int fd, uint8_t *buf, uint32_t n);
 
@@ -101,6 +106,10 @@ void hexdump(uint8_t *buf, uint32_t bufLen);
 
 static pslr_progress_callback_t progress_callback = NULL;
 
+/* Transport counters of all the cameras, see pslr_get_io_counters */
+static pslr_io_counters_t io_counters;
+#define IO_COUNT(field) __sync_fetch_and_add(&io_counters.field, 1)
+
 user_file_format_t file_formats[3] = {
     { USER_FILE_FORMAT_PEF, "PEF", "pef"},
     { USER_FILE_FORMAT_DNG, "DNG", "dng"},
@@ -348,7 +357,8 @@ pslr_gui_exposure_mode_t exposure_mode_conversion( pslr_exposure_mode_t exp ) {
     return 0;
 }
 
-pslr_handle_t pslr_init( char *model, char *device ) {
+/* Looks for the camera and opens it into the handle p */
+static pslr_handle_t ipslr_init( ipslr_handle_t *p, char *model, char *device ) {
     int fd;
     char vendorId[20];
     char productId[20];
@@ -376,21 +386,21 @@ pslr_handle_t pslr_init( char *model, char *device ) {
 	    && find_in_array( valid_models, sizeof(valid_models)/sizeof(valid_models[0]), productId) != -1 ) {
 	    if( result == PSLR_OK ) {
 		DPRINT("\tFound camera %s %s\n", vendorId, productId);
-		pslr.fd = fd;
+		p->fd = fd;
 		if( model != NULL ) {
 		    // user specified the camera model
-		    camera_name = pslr_camera_name( &pslr );
+		    camera_name = pslr_camera_name( p );
 		    DPRINT("\tName of the camera: %s\n", camera_name);
 		    if( str_comparison_i( camera_name, model, strlen( camera_name) ) == 0 ) {
-			return &pslr;
+			return p;
 		    } else {
 			DPRINT("\tIgnoring camera %s %s\n", vendorId, productId);
-			pslr_shutdown ( &pslr );
-			pslr.id = 0;
-			pslr.model = NULL;
+			pslr_shutdown ( p );
+			p->id = 0;
+			p->model = NULL;
 		    }
 		} else {
-		    return &pslr;
+		    return p;
 		}
 	    } else {
 		DPRINT("\tCannot get drive info of Pentax camera. Please do not forget to install the program using 'make install'\n");
@@ -407,6 +417,70 @@ pslr_handle_t pslr_init( char *model, char *device ) {
     return NULL;
 }
 
+pslr_handle_t pslr_init( char *model, char *device ) {
+    return ipslr_init( &pslr, model, device );
+}
+
+/* Like pslr_init, but the handle is allocated: several cameras can be
+   open at the same time. Free it with pslr_free_handle after pslr_shutdown. */
+pslr_handle_t pslr_init_handle( char *model, char *device ) {
+    ipslr_handle_t *p = calloc( 1, sizeof(ipslr_handle_t) );
+    if( !p ) {
+        return NULL;
+    }
+    if( !ipslr_init( p, model, device ) ) {
+        free( p );
+        return NULL;
+    }
+    return p;
+}
+
+void pslr_free_handle( pslr_handle_t h ) {
+    if( h != &pslr ) {
+        free( h );
+    }
+}
+
+/* Device names of the attached cameras, the caller frees the array
+   and the names */
+char **pslr_find_cameras( int *count ) {
+    int fd;
+    char vendorId[20];
+    char productId[20];
+    int driveNum;
+    char **drives;
+    char **found;
+    int i;
+
+    *count = 0;
+    drives = get_drives(&driveNum);
+    if( !drives ) {
+        return NULL;
+    }
+    found = malloc( (driveNum > 0 ? driveNum : 1) * sizeof(char*) );
+    for( i=0; i<driveNum; ++i ) {
+        pslr_result result = get_drive_info( drives[i], &fd, vendorId, sizeof(vendorId), productId, sizeof(productId));
+        if( result == PSLR_OK ) {
+            close_drive( &fd );
+        }
+        if( found && result == PSLR_OK
+            && find_in_array( valid_vendors, sizeof(valid_vendors)/sizeof(valid_vendors[0]),vendorId) != -1
+            && find_in_array( valid_models, sizeof(valid_models)/sizeof(valid_models[0]), productId) != -1 ) {
+            DPRINT("\tFound camera %s %s on %s\n", vendorId, productId, drives[i]);
+            found[(*count)++] = drives[i];
+        } else {
+            free( drives[i] );
+        }
+    }
+    free( drives );
+    return found;
+}
+
+/* USB serial number of the camera on the device */
+int pslr_get_device_serial( char *device, char *serial, int size ) {
+    return get_drive_serial( device, serial, size );
+}
+
 int pslr_connect(pslr_handle_t h) {
     DPRINT("[C]\tpslr_connect()\n");
     ipslr_handle_t *p = (ipslr_handle_t *) h;
@@ -447,6 +521,7 @@ int pslr_shutdown(pslr_handle_t h) {
     DPRINT("[C]\tpslr_shutdown()\n");
     ipslr_handle_t *p = (ipslr_handle_t *) h;
     close_drive(&p->fd);
+    ipslr_pool_drain(p);
     return PSLR_OK;
 }
 
@@ -562,38 +637,441 @@ int pslr_get_status_buffer(pslr_handle_t h, uint8_t *st_buf) {
     return PSLR_OK;
 }
 
+struct ipslr_pool_block {
+    ipslr_pool_block_t *next;
+    uint32_t size_class;
+};
+
+/* keeps the data behind the block header aligned */
+#define POOL_HEADER_SIZE ((sizeof(ipslr_pool_block_t) + 15) & ~15)
+
+/* POOL_CLASSES if the size is too large to be pooled */
+static int ipslr_pool_class(uint32_t size) {
+    uint32_t class_size = POOL_MIN_SIZE;
+    int c = 0;
+    while (c < POOL_CLASSES && class_size < size) {
+	class_size <<= 1;
+	c++;
+    }
+    return c;
+}
+
+static void ipslr_pool_drain(ipslr_handle_t *p) {
+    ipslr_pool_block_t *b;
+    int c;
+    for (c = 0; c < POOL_CLASSES; c++) {
+	while ((b = p->pool.free[c])) {
+	    p->pool.free[c] = b->next;
+	    free(b);
+	}
+	p->pool.free_count[c] = 0;
+    }
+}
+
+uint8_t *pslr_buffer_alloc(pslr_handle_t h, uint32_t size) {
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+    ipslr_pool_block_t *b;
+    int c = ipslr_pool_class(size);
+
+    if (c < POOL_CLASSES && p->pool.free[c]) {
+	b = p->pool.free[c];
+	p->pool.free[c] = b->next;
+	p->pool.free_count[c]--;
+    } else {
+	b = malloc(POOL_HEADER_SIZE + (c < POOL_CLASSES ? (uint32_t) POOL_MIN_SIZE << c : size));
+	if (!b) {
+	    return NULL;
+	}
+	b->size_class = c;
+    }
+    b->next = NULL;
+    return (uint8_t *) b + POOL_HEADER_SIZE;
+}
+
+void pslr_buffer_release(pslr_handle_t h, uint8_t *data) {
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+    ipslr_pool_block_t *b;
+    int c;
+
+    if (!data) {
+	return;
+    }
+    b = (ipslr_pool_block_t *) (data - POOL_HEADER_SIZE);
+    c = b->size_class;
+    if (c < POOL_CLASSES && p->pool.free_count[c] < POOL_KEEP) {
+	b->next = p->pool.free[c];
+	p->pool.free[c] = b;
+	p->pool.free_count[c]++;
+    } else {
+	free(b);
+    }
+}
+
 int pslr_get_buffer(pslr_handle_t h, int bufno, pslr_buffer_type type, int resolution,
         uint8_t **ppData, uint32_t *pLen) {
     DPRINT("[C]\tpslr_get_buffer()\n");
-    uint8_t *buf = 0;
+    pslr_memory_sink_t mem = { NULL, 0, h };
+    pslr_rendition_t rendition = { type, resolution, pslr_memory_sink, (uintptr_t) &mem, 0 };
     int ret;
-    ret = pslr_buffer_open(h, bufno, type, resolution);
+
+    ret = pslr_buffer_fetch(h, bufno, &rendition, 1);
     if( ret != PSLR_OK ) {
+	pslr_buffer_release(h, mem.data);
+	return ret;
+    }
+    if (ppData) {
+	*ppData = mem.data;
+    } else {
+	pslr_buffer_release(h, mem.data);
+    }
+    if (pLen) {
+	*pLen = mem.length;
+    }
+
+    return PSLR_OK;
+}
+
+pslr_image_t *pslr_get_image(pslr_handle_t h, int bufno, pslr_buffer_type type, int resolution) {
+    DPRINT("[C]\tpslr_get_image()\n");
+    pslr_image_t *image = calloc(1, sizeof(pslr_image_t));
+    if (!image) {
+	return NULL;
+    }
+    if (pslr_get_buffer(h, bufno, type, resolution, &image->data, &image->length) != PSLR_OK) {
+	free(image);
+	return NULL;
+    }
+    image->type = type;
+    image->refcount = 1;
+    image->handle = h;
+    return image;
+}
+
+pslr_image_t *pslr_image_ref(pslr_image_t *image) {
+    image->refcount++;
+    return image;
+}
+
+void pslr_image_unref(pslr_image_t *image) {
+    if (!image || --image->refcount > 0) {
+	return;
+    }
+    pslr_buffer_release(image->handle, image->data);
+    free(image);
+}
+
+int pslr_memory_sink(uint8_t *buf, uint32_t length, uint32_t offset, uint32_t total,
+                     uintptr_t user_data) {
+    pslr_memory_sink_t *mem = (pslr_memory_sink_t *) user_data;
+    if (offset == 0) {
+	if (mem->pool) {
+	    pslr_buffer_release(mem->pool, mem->data);
+	    mem->data = pslr_buffer_alloc(mem->pool, total);
+	} else {
+	    free(mem->data);
+	    mem->data = malloc(total);
+	}
+	mem->length = total;
+	if (!mem->data) {
+	    mem->length = 0;
+	    return PSLR_NO_MEMORY;
+	}
+    }
+    if (!mem->data || offset + length > mem->length) {
+	return PSLR_PARAM;
+    }
+    memcpy(mem->data + offset, buf, length);
+    return PSLR_OK;
+}
+
+/* Download the whole selected buffer through the rendition's sink,
+ * using buf (BLKSZ bytes) as the transfer area. */
+static int ipslr_buffer_stream(ipslr_handle_t *p, int bufno, pslr_rendition_t *r, uint8_t *buf) {
+    uint32_t total;
+    uint32_t current = 0;
+    uint32_t bytes;
+    uint8_t *dest = NULL;
+    int ret;
+
+    ret = ipslr_buffer_select_segments(p, bufno, r->type, r->resolution);
+    if (ret != PSLR_OK) {
 	return ret;
     }
+    total = pslr_buffer_get_size(p);
+    if (r->target && total > 0) {
+	dest = r->target(total, r->user_data);
+    }
+    while (current < total) {
+	if (dest) {
+	    buf = dest + current;
+	}
+	bytes = pslr_buffer_read(p, buf, BLKSZ);
+	if (bytes == 0) {
+	    ret = PSLR_READ_ERROR;
+	    break;
+	}
+	ret = r->sink(buf, bytes, current, total, r->user_data);
+	if (ret != PSLR_OK) {
+	    break;
+	}
+	current += bytes;
+    }
+    pslr_buffer_close(p);
+    return ret;
+}
 
-    uint32_t size = pslr_buffer_get_size(h);
-    buf = malloc(size);
+/* Fetch several renditions (preview, thumbnail, raw, jpeg) of the
+ * same buffer back to back, in array order. The status read and the
+ * buffer check are done only once, and the transfer area is shared. */
+int pslr_buffer_fetch(pslr_handle_t h, int bufno, pslr_rendition_t *renditions, int count) {
+    DPRINT("[C]\tpslr_buffer_fetch(#%X, %d renditions)\n", bufno, count);
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+    uint8_t *buf;
+    int ret = PSLR_OK;
+    int i;
+
+    if (!renditions || count <= 0) {
+	return PSLR_PARAM;
+    }
+    CHECK(ipslr_buffer_check(p, bufno));
+
+    buf = malloc(BLKSZ);
     if (!buf) {
 	return PSLR_NO_MEMORY;
     }
+    for (i = 0; i < count; i++) {
+	DPRINT("\trendition %d: type=%X res=%X\n", i, renditions[i].type, renditions[i].resolution);
+	renditions[i].result = ipslr_buffer_stream(p, bufno, &renditions[i], buf);
+	if (renditions[i].result != PSLR_OK) {
+	    ret = renditions[i].result;
+	}
+    }
+    free(buf);
+    return ret;
+}
 
-    int bytes = pslr_buffer_read(h, buf, size);
+/* ----------------------------------------------------------------------- */
+/* Download scheduler: transfers are split into blocks, and before every
+ * block the most urgent job is selected (highest priority, then the
+ * newest). A preempted job keeps its segment layout, so it can be
+ * resumed without selecting the buffer again. */
+
+typedef struct ipslr_download_job {
+    int bufno;
+    pslr_rendition_t *rendition;
+    int priority;
+    uint32_t seq;
+    bool opened;
+    ipslr_segment_t segments[MAX_SEGMENTS];
+    uint32_t segment_count;
+    uint32_t offset;
+    uint32_t total;
+    uint8_t *dest;                     // rendition target, NULL: s->buf
+    struct ipslr_download_job *next;
+} ipslr_download_job_t;
+
+struct pslr_scheduler {
+    ipslr_handle_t *p;
+    ipslr_download_job_t *jobs;
+    ipslr_download_job_t *current;     // job whose layout is loaded in the handle
+    uint32_t seq;
+    uint8_t *buf;
+    pslr_download_done_t done;
+    uintptr_t user_data;
+};
 
-    if( bytes != size ) {
-	return PSLR_READ_ERROR;
+int pslr_get_buffer_type_priority(pslr_buffer_type type) {
+    switch (type) {
+    case PSLR_BUF_PREVIEW:
+    case PSLR_BUF_THUMBNAIL:
+        return PSLR_PRIORITY_PREVIEW;
+    case PSLR_BUF_PEF:
+    case PSLR_BUF_DNG:
+        return PSLR_PRIORITY_RAW;
+    default:
+        return PSLR_PRIORITY_JPEG;
     }
-    pslr_buffer_close(h);
-    if (ppData) {
-	*ppData = buf;
+}
+
+pslr_scheduler_t *pslr_scheduler_new(pslr_handle_t h, pslr_download_done_t done, uintptr_t user_data) {
+    pslr_scheduler_t *s = calloc(1, sizeof(pslr_scheduler_t));
+    if (!s) {
+        return NULL;
     }
-    if (pLen) {
-	*pLen = size;
+    s->buf = malloc(BLKSZ);
+    if (!s->buf) {
+        free(s);
+        return NULL;
     }
+    s->p = (ipslr_handle_t *) h;
+    s->done = done;
+    s->user_data = user_data;
+    return s;
+}
 
+int pslr_scheduler_add(pslr_scheduler_t *s, int bufno, pslr_rendition_t *rendition, int priority) {
+    DPRINT("[C]\tpslr_scheduler_add(#%X, type=%X, priority=%d)\n", bufno, rendition->type, priority);
+    ipslr_download_job_t *job = calloc(1, sizeof(ipslr_download_job_t));
+    if (!job) {
+        return PSLR_NO_MEMORY;
+    }
+    job->bufno = bufno;
+    job->rendition = rendition;
+    job->priority = priority;
+    job->seq = s->seq++;
+    job->next = s->jobs;
+    s->jobs = job;
     return PSLR_OK;
 }
 
+static ipslr_download_job_t *ipslr_scheduler_pick(pslr_scheduler_t *s) {
+    ipslr_download_job_t *job;
+    ipslr_download_job_t *best = NULL;
+    for (job = s->jobs; job; job = job->next) {
+        if (!best || job->priority > best->priority ||
+            (job->priority == best->priority && job->seq > best->seq)) {
+            best = job;
+        }
+    }
+    return best;
+}
+
+/* Make job the one loaded in the handle, saving the layout of the
+ * preempted job */
+static int ipslr_scheduler_load(pslr_scheduler_t *s, ipslr_download_job_t *job) {
+    ipslr_handle_t *p = s->p;
+    ipslr_download_job_t *prev = s->current;
+    int ret;
+
+    if (prev == job) {
+        return PSLR_OK;
+    }
+    if (prev) {
+        DPRINT("\tpreempt buffer %d at %d\n", prev->bufno, prev->offset);
+        memcpy(prev->segments, p->segments, sizeof(p->segments));
+        prev->segment_count = p->segment_count;
+    }
+    s->current = NULL;
+    if (!job->opened) {
+        ret = pslr_buffer_open(p, job->bufno, job->rendition->type, job->rendition->resolution);
+        if (ret != PSLR_OK) {
+            return ret;
+        }
+        job->opened = true;
+        job->total = pslr_buffer_get_size(p);
+        if (job->rendition->target && job->total > 0 && !job->dest) {
+            job->dest = job->rendition->target(job->total, job->rendition->user_data);
+        }
+    } else {
+        /* the camera has another buffer selected since the preemption,
+         * only the walk of the segment infos is saved */
+        DPRINT("\tresume buffer %d at %d\n", job->bufno, job->offset);
+        ret = ipslr_select_buffer(p, job->bufno, job->rendition->type, job->rendition->resolution);
+        if (ret == PSLR_OK) {
+            memcpy(p->segments, job->segments, sizeof(p->segments));
+            p->segment_count = job->segment_count;
+        } else {
+            /* recover from a desync like pslr_buffer_open */
+            ret = ipslr_buffer_select_segments(p, job->bufno, job->rendition->type, job->rendition->resolution);
+            if (ret != PSLR_OK) {
+                return ret;
+            }
+        }
+    }
+    p->offset = job->offset;
+    s->current = job;
+    return PSLR_OK;
+}
+
+static void ipslr_scheduler_finish(pslr_scheduler_t *s, ipslr_download_job_t *job, int result) {
+    ipslr_download_job_t **pp;
+    for (pp = &s->jobs; *pp != job; pp = &(*pp)->next)
+        ;
+    *pp = job->next;
+    if (s->current == job) {
+        pslr_buffer_close(s->p);
+        s->current = NULL;
+    }
+    job->rendition->result = result;
+    if (s->done) {
+        s->done(job->bufno, job->rendition, s->user_data);
+    }
+    free(job);
+}
+
+static int ipslr_scheduler_pending(pslr_scheduler_t *s) {
+    ipslr_download_job_t *job;
+    int n = 0;
+    for (job = s->jobs; job; job = job->next) {
+        n++;
+    }
+    return n;
+}
+
+/* Transfer one block of the most urgent job. Returns the number of
+ * jobs still pending. */
+int pslr_scheduler_step(pslr_scheduler_t *s) {
+    ipslr_download_job_t *job = ipslr_scheduler_pick(s);
+    bool resumed;
+    uint32_t bytes = 0;
+    uint8_t *buf;
+    int ret;
+
+    if (!job) {
+        return 0;
+    }
+    resumed = job->opened && s->current != job;
+    ret = ipslr_scheduler_load(s, job);
+    buf = job->dest ? job->dest + job->offset : s->buf;
+    if (ret == PSLR_OK && job->offset < job->total) {
+        bytes = pslr_buffer_read(s->p, buf, BLKSZ);
+        if (bytes == 0 && resumed) {
+            /* the cached layout did not work, select the buffer again */
+            DPRINT("\treopen buffer %d\n", job->bufno);
+            s->current = NULL;
+            job->opened = false;
+            ret = ipslr_scheduler_load(s, job);
+            if (ret == PSLR_OK) {
+                bytes = pslr_buffer_read(s->p, buf, BLKSZ);
+            }
+        }
+        if (ret == PSLR_OK && bytes == 0) {
+            ret = PSLR_READ_ERROR;
+        }
+        if (ret == PSLR_OK) {
+            ret = job->rendition->sink(buf, bytes, job->offset, job->total, job->rendition->user_data);
+            job->offset += bytes;
+        }
+    }
+    if (ret != PSLR_OK || job->offset >= job->total) {
+        ipslr_scheduler_finish(s, job, ret);
+    }
+    return ipslr_scheduler_pending(s);
+}
+
+int pslr_scheduler_run(pslr_scheduler_t *s) {
+    while (pslr_scheduler_step(s) > 0)
+        ;
+    return PSLR_OK;
+}
+
+void pslr_scheduler_free(pslr_scheduler_t *s) {
+    ipslr_download_job_t *job;
+    if (!s) {
+        return;
+    }
+    if (s->current) {
+        pslr_buffer_close(s->p);
+    }
+    while (s->jobs) {
+        job = s->jobs;
+        s->jobs = job->next;
+        free(job);
+    }
+    free(s->buf);
+    free(s);
+}
+
 int pslr_set_progress_callback(pslr_handle_t h, pslr_progress_callback_t cb, uintptr_t user_data) {
     progress_callback = cb;
     return PSLR_OK;
@@ -887,30 +1365,30 @@ int pslr_set_exposure_mode(pslr_handle_t h, pslr_exposure_mode_t mode) {
     return ipslr_handle_command_x18( p, true, X18_EXPOSURE_MODE, 2, 1, mode, 0);
 }
 
-int pslr_buffer_open(pslr_handle_t h, int bufno, pslr_buffer_type buftype, int bufres) {
-    DPRINT("[C]\tpslr_buffer_open(#%X, type=%X, res=%X)\n", bufno, buftype, bufres);
+/* Check that the camera has data in the given buffer */
+static int ipslr_buffer_check(ipslr_handle_t *p, int bufno) {
+    CHECK(ipslr_status_full(p, &p->status));
+    DPRINT("\tp->status.bufmask = %x\n", p->status.bufmask);
+
+    if( p->model->parser_function && (p->status.bufmask & (1 << bufno)) == 0) {
+	// do not check this for limited support cameras
+        DPRINT("\tNo buffer data (%d)\n", bufno);
+        return PSLR_READ_ERROR;
+    }
+    return PSLR_OK;
+}
+
+/* Select the buffer and read its segment layout */
+static int ipslr_buffer_select_segments(ipslr_handle_t *p, int bufno, pslr_buffer_type buftype, int bufres) {
     pslr_buffer_segment_info info;
-    uint16_t bufs;
     uint32_t buf_total = 0;
     int i, j;
     int ret;
     int retry = 0;
     int retry2 = 0;
 
-    ipslr_handle_t *p = (ipslr_handle_t *) h;
-
     memset(&info, 0, sizeof (info));
 
-    CHECK(ipslr_status_full(p, &p->status));
-    bufs = p->status.bufmask;
-    DPRINT("\tp->status.bufmask = %x\n", p->status.bufmask);
-
-    if( p->model->parser_function && (bufs & (1 << bufno)) == 0) {
-	// do not check this for limited support cameras
-        DPRINT("\tNo buffer data (%d)\n", bufno);
-        return PSLR_READ_ERROR;
-    }
-
     while (retry < 3) {
         /* If we get response 0x82 from the camera, there is a
          * desynch. We can recover by stepping through segment infos
@@ -921,6 +1399,7 @@ int pslr_buffer_open(pslr_handle_t h, int bufno, pslr_buffer_type buftype, int b
 
         retry++;
         retry2 = 0;
+        IO_COUNT(select_retries);
         /* Try up to 9 times to reach segment info type 2 (last
          * segment) */
         do {
@@ -958,6 +1437,14 @@ int pslr_buffer_open(pslr_handle_t h, int bufno, pslr_buffer_type buftype, int b
     return PSLR_OK;
 }
 
+int pslr_buffer_open(pslr_handle_t h, int bufno, pslr_buffer_type buftype, int bufres) {
+    DPRINT("[C]\tpslr_buffer_open(#%X, type=%X, res=%X)\n", bufno, buftype, bufres);
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+
+    CHECK(ipslr_buffer_check(p, bufno));
+    return ipslr_buffer_select_segments(p, bufno, buftype, bufres);
+}
+
 uint32_t pslr_buffer_read(pslr_handle_t h, uint8_t *buf, uint32_t size) {
     ipslr_handle_t *p = (ipslr_handle_t *) h;
     int i;
@@ -975,6 +1462,10 @@ uint32_t pslr_buffer_read(pslr_handle_t h, uint8_t *buf, uint32_t size) {
             break;
         pos += p->segments[i].length;
     }
+    if (i == p->segment_count) {
+        /* end of buffer */
+        return 0;
+    }
 
     seg_offs = p->offset - pos;
     addr = p->segments[i].addr + seg_offs;
@@ -1007,6 +1498,71 @@ uint32_t pslr_buffer_get_size(pslr_handle_t h) {
     return len;
 }
 
+/* Position the next pslr_buffer_read() anywhere inside the opened
+ * buffer. The segment layout is already known, so no camera command
+ * is needed. */
+int pslr_buffer_seek(pslr_handle_t h, uint32_t offset) {
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+    if (offset > pslr_buffer_get_size(h)) {
+        return PSLR_PARAM;
+    }
+    p->offset = offset;
+    return PSLR_OK;
+}
+
+/* Read length bytes from offset of the opened buffer. Returns the
+ * number of bytes read, which is less than length at the end of the
+ * buffer or on error. */
+uint32_t pslr_buffer_read_range(pslr_handle_t h, uint32_t offset, uint8_t *buf, uint32_t length) {
+    DPRINT("[C]\tpslr_buffer_read_range(%d, %d)\n", offset, length);
+    uint32_t current = 0;
+    uint32_t bytes;
+
+    if (pslr_buffer_seek(h, offset) != PSLR_OK) {
+        return 0;
+    }
+    while (current < length) {
+        bytes = pslr_buffer_read(h, buf + current, length - current);
+        if (bytes == 0) {
+            break;
+        }
+        current += bytes;
+    }
+    return current;
+}
+
+/* Download only the first prefix_size bytes of the image and parse
+ * its TIFF/EXIF metadata. */
+int pslr_get_buffer_metadata(pslr_handle_t h, int bufno, pslr_buffer_type type, int resolution,
+                             uint32_t prefix_size, pslr_image_metadata_t *meta) {
+    DPRINT("[C]\tpslr_get_buffer_metadata(#%X, type=%X, prefix=%d)\n", bufno, type, prefix_size);
+    uint8_t *buf;
+    uint32_t size;
+    int ret;
+
+    if (prefix_size == 0) {
+        prefix_size = PSLR_METADATA_PREFIX_SIZE;
+    }
+    CHECK(pslr_buffer_open(h, bufno, type, resolution));
+    size = pslr_buffer_get_size(h);
+    if (size > prefix_size) {
+        size = prefix_size;
+    }
+    buf = malloc(size);
+    if (!buf) {
+        pslr_buffer_close(h);
+        return PSLR_NO_MEMORY;
+    }
+    if (pslr_buffer_read_range(h, 0, buf, size) != size) {
+        ret = PSLR_READ_ERROR;
+    } else {
+        ret = pslr_tiff_parse_metadata(buf, size, meta);
+    }
+    free(buf);
+    pslr_buffer_close(h);
+    return ret;
+}
+
 void pslr_buffer_close(pslr_handle_t h) {
     ipslr_handle_t *p = (ipslr_handle_t *) h;
     memset(&p->segments[0], 0, sizeof (p->segments));
@@ -1096,10 +1652,8 @@ const char *pslr_camera_name(pslr_handle_t h) {
     if (p->model)
         return p->model->name;
     else {
-        static char unk_name[256];
-        snprintf(unk_name, sizeof (unk_name), "ID#%x", p->id);
-        unk_name[sizeof (unk_name) - 1] = '\0';
-        return unk_name;
+        snprintf(p->unknown_name, sizeof (p->unknown_name), "ID#%x", p->id);
+        return p->unknown_name;
     }
 }
 
@@ -1290,12 +1844,13 @@ static int ipslr_download(ipslr_handle_t *p, uint32_t addr, uint32_t length, uin
         CHECK(command(p->fd, 0x06, 0x00, 0x08));
         get_status(p->fd);
 
-        n = scsi_read(p->fd, downloadCmd, sizeof (downloadCmd), buf, block);
+        n = io_scsi_read(p->fd, downloadCmd, sizeof (downloadCmd), buf, block);
         get_status(p->fd);
 
         if (n < 0) {
             if (retry < BLOCK_RETRY) {
                 retry++;
+                IO_COUNT(download_retries);
                 continue;
             }
             return PSLR_READ_ERROR;
@@ -1368,7 +1923,7 @@ static int _ipslr_write_args(uint8_t cmd_2, ipslr_handle_t *p, int n, ...) {
         cmd[4] = 4 * n;
 
 
-        res = scsi_write(fd, cmd, sizeof (cmd), buf, 4 * n);
+        res = io_scsi_write(fd, cmd, sizeof (cmd), buf, 4 * n);
         if (res != PSLR_OK) {
             return res;
 	    }
@@ -1385,7 +1940,7 @@ static int _ipslr_write_args(uint8_t cmd_2, ipslr_handle_t *p, int n, ...) {
 
             cmd[4] = 4;
             cmd[2] = i * 4;
-            res = scsi_write(fd, cmd, sizeof (cmd), buf, 4);
+            res = io_scsi_write(fd, cmd, sizeof (cmd), buf, 4);
             if (res != PSLR_OK) {
                 return res;
 	    }
@@ -1397,6 +1952,31 @@ static int _ipslr_write_args(uint8_t cmd_2, ipslr_handle_t *p, int n, ...) {
 
 /* ----------------------------------------------------------------------- */
 
+/* The USB transfers go through these to be counted */
+static int io_scsi_read(int fd, uint8_t *cmd, uint32_t cmdLen, uint8_t *buf, uint32_t bufLen) {
+    int r = scsi_read(fd, cmd, cmdLen, buf, bufLen);
+    if (r < 0) {
+        IO_COUNT(usb_errors);
+    }
+    return r;
+}
+
+static int io_scsi_write(int fd, uint8_t *cmd, uint32_t cmdLen, uint8_t *buf, uint32_t bufLen) {
+    int r = scsi_write(fd, cmd, cmdLen, buf, bufLen);
+    if (r != PSLR_OK) {
+        IO_COUNT(usb_errors);
+    }
+    return r;
+}
+
+void pslr_get_io_counters(pslr_io_counters_t *counters) {
+    counters->usb_errors = __sync_fetch_and_add(&io_counters.usb_errors, 0);
+    counters->camera_errors = __sync_fetch_and_add(&io_counters.camera_errors, 0);
+    counters->download_retries = __sync_fetch_and_add(&io_counters.download_retries, 0);
+    counters->select_retries = __sync_fetch_and_add(&io_counters.select_retries, 0);
+    counters->busy_polls = __sync_fetch_and_add(&io_counters.busy_polls, 0);
+}
+
 static int command(int fd, int a, int b, int c) {
     DPRINT("[C]\t\t\tcommand(fd=%x, %x, %x, %x)\n", fd, a, b, c);
     uint8_t cmd[8] = {0xf0, 0x24, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
@@ -1405,7 +1985,7 @@ static int command(int fd, int a, int b, int c) {
     cmd[3] = b;
     cmd[4] = c;
 
-    CHECK(scsi_write(fd, cmd, sizeof (cmd), 0, 0));
+    CHECK(io_scsi_write(fd, cmd, sizeof (cmd), 0, 0));
     return PSLR_OK;
 }
 
@@ -1413,7 +1993,7 @@ static int read_status(int fd, uint8_t *buf) {
     uint8_t cmd[8] = {0xf0, 0x26, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
     int n;
 
-    n = scsi_read(fd, cmd, 8, buf, 8);
+    n = io_scsi_read(fd, cmd, 8, buf, 8);
     if (n != 8) {
         DPRINT("\tOnly got %d bytes\n", n);
         /* The *ist DS doesn't know to return the correct number of
@@ -1437,6 +2017,7 @@ static int get_status(int fd) {
             break;
         //DPRINT("Waiting for ready - ");
         DPRINT("[R]\t\t\t\t => ERROR: 0x%02X\n", statusbuf[7]);
+        IO_COUNT(busy_polls);
         usleep(POLL_INTERVAL);
     }
     if ((statusbuf[7] & 0xff) != 0) {
@@ -1460,6 +2041,7 @@ static int get_result(int fd) {
     }
     if ((statusbuf[7] & 0xff) != 0) {
         DPRINT("\tERROR: 0x%x\n", statusbuf[7]);
+        IO_COUNT(camera_errors);
         return -1;
     } else {
         DPRINT("[R]\t\t\t\t => [%02X %02X %02X %02X]\n",
@@ -1474,7 +2056,7 @@ static int read_result(int fd, uint8_t *buf, uint32_t n) {
     int r;
     int i;
     set_uint32_le(n, &cmd[4]);
-    r = scsi_read(fd, cmd, sizeof (cmd), buf, n);
+    r = io_scsi_read(fd, cmd, sizeof (cmd), buf, n);
     if (r != n) {
         return PSLR_READ_ERROR;
     }  else {
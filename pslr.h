@@ -39,6 +39,7 @@
 #include "pslr_enum.h"
 #include "pslr_scsi.h"
 #include "pslr_model.h"
+#include "pslr_tiff.h"
 
 #define PSLR_LIGHT_METER_AE_LOCK 0x8
 
@@ -141,9 +142,57 @@ typedef struct {
 
 typedef void (*pslr_progress_callback_t)(uint32_t current, uint32_t total);
 
+/* Counted over all the cameras since the start of the program */
+typedef struct {
+    uint32_t usb_errors;        /* failed SCSI transfers */
+    uint32_t camera_errors;     /* commands answered with an error status */
+    uint32_t download_retries;  /* download blocks read again */
+    uint32_t select_retries;    /* buffer selections recovered after a desync */
+    uint32_t busy_polls;        /* status reads while the camera was busy */
+} pslr_io_counters_t;
+
+typedef struct {
+    pslr_buffer_type type;
+    int resolution;
+    pslr_buffer_sink_t sink;
+    uintptr_t user_data;
+    int result;                 // set by pslr_buffer_fetch
+    pslr_buffer_target_t target;   // optional
+} pslr_rendition_t;
+
+typedef struct {
+    uint8_t *data;
+    uint32_t length;
+    pslr_handle_t pool;         // optional, data comes from the buffer pool of the handle
+} pslr_memory_sink_t;
+
+/* Reference counted image, the data is released to the buffer pool
+ * when the last reference is dropped */
+typedef struct {
+    uint8_t *data;
+    uint32_t length;
+    pslr_buffer_type type;
+    int refcount;
+    pslr_handle_t handle;
+} pslr_image_t;
+
+#define PSLR_PRIORITY_RAW     0
+#define PSLR_PRIORITY_JPEG    1
+#define PSLR_PRIORITY_PREVIEW 2
+
+typedef struct pslr_scheduler pslr_scheduler_t;
+
+/* Called when a scheduled download finished, rendition->result holds
+ * the outcome */
+typedef void (*pslr_download_done_t)(int bufno, pslr_rendition_t *rendition, uintptr_t user_data);
+
 void sleep_sec(double sec);
 
 pslr_handle_t pslr_init(char *model, char *device);
+pslr_handle_t pslr_init_handle(char *model, char *device);
+void pslr_free_handle(pslr_handle_t h);
+char **pslr_find_cameras(int *count);
+int pslr_get_device_serial(char *device, char *serial, int size);
 int pslr_connect(pslr_handle_t h);
 int pslr_disconnect(pslr_handle_t h);
 int pslr_shutdown(pslr_handle_t h);
@@ -157,11 +206,31 @@ int pslr_get_status_buffer(pslr_handle_t h, uint8_t *st_buf);
 
 char *collect_status_info( pslr_handle_t h, pslr_status status );
 
+/* *pdata comes from the buffer pool, release it with pslr_buffer_release */
 int pslr_get_buffer(pslr_handle_t h, int bufno, pslr_buffer_type type, int resolution,
                     uint8_t **pdata, uint32_t *pdatalen);
 
+uint8_t *pslr_buffer_alloc(pslr_handle_t h, uint32_t size);
+void pslr_buffer_release(pslr_handle_t h, uint8_t *data);
+
+pslr_image_t *pslr_get_image(pslr_handle_t h, int bufno, pslr_buffer_type type, int resolution);
+pslr_image_t *pslr_image_ref(pslr_image_t *image);
+void pslr_image_unref(pslr_image_t *image);
+
+int pslr_buffer_fetch(pslr_handle_t h, int bufno, pslr_rendition_t *renditions, int count);
+int pslr_memory_sink(uint8_t *buf, uint32_t length, uint32_t offset, uint32_t total,
+                     uintptr_t user_data);
+
+pslr_scheduler_t *pslr_scheduler_new(pslr_handle_t h, pslr_download_done_t done, uintptr_t user_data);
+void pslr_scheduler_free(pslr_scheduler_t *s);
+int pslr_scheduler_add(pslr_scheduler_t *s, int bufno, pslr_rendition_t *rendition, int priority);
+int pslr_scheduler_step(pslr_scheduler_t *s);
+int pslr_scheduler_run(pslr_scheduler_t *s);
+int pslr_get_buffer_type_priority(pslr_buffer_type type);
+
 int pslr_set_progress_callback(pslr_handle_t h, pslr_progress_callback_t cb, 
                                uintptr_t user_data);
+void pslr_get_io_counters(pslr_io_counters_t *counters);
 
 int pslr_set_shutter(pslr_handle_t h, pslr_rational_t value);
 int pslr_set_aperture(pslr_handle_t h, pslr_rational_t value);
@@ -208,6 +277,10 @@ int pslr_buffer_open(pslr_handle_t h, int bufno, pslr_buffer_type type, int reso
 uint32_t pslr_buffer_read(pslr_handle_t h, uint8_t *buf, uint32_t size);
 void pslr_buffer_close(pslr_handle_t h);
 uint32_t pslr_buffer_get_size(pslr_handle_t h);
+int pslr_buffer_seek(pslr_handle_t h, uint32_t offset);
+uint32_t pslr_buffer_read_range(pslr_handle_t h, uint32_t offset, uint8_t *buf, uint32_t length);
+int pslr_get_buffer_metadata(pslr_handle_t h, int bufno, pslr_buffer_type type, int resolution,
+                             uint32_t prefix_size, pslr_image_metadata_t *meta);
 
 int pslr_set_exposure_mode(pslr_handle_t h, pslr_exposure_mode_t mode);
 int pslr_select_af_point(pslr_handle_t h, uint32_t point);
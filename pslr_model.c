@@ -40,16 +40,16 @@
 
 #include "pslr_model.h"
 
-static uint8_t lastbuf[MAX_STATUS_BUF_SIZE];
-static int first = 1;
-
-static void ipslr_status_diff(uint8_t *buf) {
+/* Dumps the bytes changed since the last status of this camera */
+static void ipslr_status_diff(ipslr_handle_t *p) {
+    uint8_t *buf = p->status_buffer;
+    uint8_t *lastbuf = p->status_last;
     int n;
     int diffs;
-    if (first) {
+    if (!p->status_last_valid) {
         hexdump(buf, MAX_STATUS_BUF_SIZE);
         memcpy(lastbuf, buf, MAX_STATUS_BUF_SIZE);
-        first = 0;
+        p->status_last_valid = true;
     }
 
     diffs = 0;
@@ -185,7 +185,7 @@ int get_hw_jpeg_quality( ipslr_model_info_t *model, int user_jpeg_stars) {
 void ipslr_status_parse_k10d(ipslr_handle_t  *p, pslr_status *status) {
     uint8_t *buf = p->status_buffer;
     if( debug ) {
-        ipslr_status_diff(buf);
+        ipslr_status_diff(p);
     }
     memset(status, 0, sizeof (*status));
     status->bufmask = get_uint16_be(&buf[0x16]);
@@ -230,7 +230,7 @@ void ipslr_status_parse_k20d(ipslr_handle_t *p, pslr_status *status) {
 
     uint8_t *buf = p->status_buffer;
     if( debug ) {
-        ipslr_status_diff(buf);
+        ipslr_status_diff(p);
     }
     memset(status, 0, sizeof (*status));
     status->bufmask = get_uint16_be( &buf[0x16]);
@@ -385,7 +385,7 @@ void ipslr_status_parse_kx(ipslr_handle_t *p, pslr_status *status) {
 
     uint8_t *buf = p->status_buffer;
     if( debug ) {
-        ipslr_status_diff(buf);
+        ipslr_status_diff(p);
     }
 
     memset(status, 0, sizeof (*status));
@@ -402,7 +402,7 @@ void ipslr_status_parse_kx(ipslr_handle_t *p, pslr_status *status) {
 void ipslr_status_parse_kr(ipslr_handle_t *p, pslr_status *status) {
     uint8_t *buf = p->status_buffer;
     if( debug ) {
-        ipslr_status_diff(buf);
+        ipslr_status_diff(p);
     }
 
     memset(status, 0, sizeof (*status));
@@ -417,7 +417,7 @@ void ipslr_status_parse_kr(ipslr_handle_t *p, pslr_status *status) {
 void ipslr_status_parse_k5(ipslr_handle_t *p, pslr_status *status) {
     uint8_t *buf = p->status_buffer;
     if( debug ) {
-        ipslr_status_diff(buf);
+        ipslr_status_diff(p);
     }
 
     memset(status, 0, sizeof (*status));
@@ -435,7 +435,7 @@ void ipslr_status_parse_k5(ipslr_handle_t *p, pslr_status *status) {
 void ipslr_status_parse_k30(ipslr_handle_t *p, pslr_status *status) {
     uint8_t *buf = p->status_buffer;
     if( debug ) {
-        ipslr_status_diff(buf);
+        ipslr_status_diff(p);
     }
 
     memset(status, 0, sizeof (*status));
@@ -455,7 +455,7 @@ void ipslr_status_parse_k30(ipslr_handle_t *p, pslr_status *status) {
 void ipslr_status_parse_k01(ipslr_handle_t *p, pslr_status *status) {
     uint8_t *buf = p->status_buffer;
     if( debug ) {
-        ipslr_status_diff(buf);
+        ipslr_status_diff(p);
     }
 
     memset(status, 0, sizeof (*status));
@@ -474,7 +474,7 @@ void ipslr_status_parse_k01(ipslr_handle_t *p, pslr_status *status) {
 void ipslr_status_parse_k50(ipslr_handle_t *p, pslr_status *status) {
     uint8_t *buf = p->status_buffer;
     if( debug ) {
-        ipslr_status_diff(buf);
+        ipslr_status_diff(p);
     }
 
     memset(status, 0, sizeof (*status));
@@ -490,7 +490,7 @@ void ipslr_status_parse_k50(ipslr_handle_t *p, pslr_status *status) {
 void ipslr_status_parse_km(ipslr_handle_t *p, pslr_status *status) {
     uint8_t *buf = p->status_buffer;
     if( debug ) {
-        ipslr_status_diff(buf);
+        ipslr_status_diff(p);
     }
 
     memset(status, 0, sizeof (*status));
@@ -507,7 +507,7 @@ void ipslr_status_parse_km(ipslr_handle_t *p, pslr_status *status) {
 void ipslr_status_parse_k3(ipslr_handle_t *p, pslr_status *status) {
     uint8_t *buf = p->status_buffer;
     if( debug ) {
-        ipslr_status_diff(buf);
+        ipslr_status_diff(p);
     }
 
     memset(status, 0, sizeof (*status));
@@ -523,7 +523,7 @@ void ipslr_status_parse_k3(ipslr_handle_t *p, pslr_status *status) {
 void ipslr_status_parse_k200d(ipslr_handle_t *p, pslr_status *status) {
     uint8_t *buf = p->status_buffer;
     if( debug ) {
-        ipslr_status_diff(buf);
+        ipslr_status_diff(p);
     }
 
     memset(status, 0, sizeof (*status));
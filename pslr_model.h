@@ -41,6 +41,9 @@
 #define MAX_RESOLUTION_SIZE 4
 #define MAX_STATUS_BUF_SIZE 452
 #define MAX_SEGMENTS 4
+#define POOL_CLASSES 11        // 64 KiB .. 64 MiB
+#define POOL_MIN_SIZE 65536
+#define POOL_KEEP 2            // idle buffers kept per size class
 
 typedef struct ipslr_handle ipslr_handle_t;
 
@@ -133,6 +136,15 @@ typedef struct {
     uint32_t length;
 } ipslr_segment_t;
 
+typedef struct ipslr_pool_block ipslr_pool_block_t;
+
+/* Image buffers are reused in power of two size classes, so a long
+ * tethered session does not fragment the heap. */
+typedef struct {
+    ipslr_pool_block_t *free[POOL_CLASSES];
+    int free_count[POOL_CLASSES];
+} ipslr_buffer_pool_t;
+
 struct ipslr_handle {
     int fd;
     pslr_status status;
@@ -142,12 +154,18 @@ struct ipslr_handle {
     uint32_t segment_count;
     uint32_t offset;
     uint8_t status_buffer[MAX_STATUS_BUF_SIZE];
+    uint8_t status_last[MAX_STATUS_BUF_SIZE];   // debug status diff
+    bool status_last_valid;
+    char unknown_name[16];                      // camera name of an unknown id
+    ipslr_buffer_pool_t pool;
 };
 
 ipslr_model_info_t *find_model_by_id( uint32_t id );
 
 int get_hw_jpeg_quality( ipslr_model_info_t *model, int user_jpeg_stars);
 
+uint16_t get_uint16_be(uint8_t *buf);
+uint16_t get_uint16_le(uint8_t *buf);
 uint32_t get_uint32_be(uint8_t *buf);
 uint32_t get_uint32_le(uint8_t *buf);
 void set_uint32_be(uint32_t v, uint8_t *buf);
@@ -65,5 +65,7 @@ pslr_result get_drive_info(char* driveName, int* hDevice,
                             char* vendorId, int vendorIdSizeMax,
                             char* productId, int productIdSizeMax);
 
+pslr_result get_drive_serial(char* driveName, char* serial, int serialSizeMax);
+
 void close_drive(int *hDevice);
 #endif
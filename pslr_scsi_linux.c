@@ -35,6 +35,8 @@
 #endif
 #include <unistd.h>
 #include <dirent.h>
+#include <limits.h>
+#include <stdlib.h>
 #include "pslr_model.h"
 
 #include "pslr_scsi.h"
@@ -140,6 +142,41 @@ pslr_result get_drive_info(char* driveName, int* hDevice,
     return PSLR_OK;
 }
 
+/* The serial number of the USB device above the drive in sysfs */
+pslr_result get_drive_serial(char* driveName, char* serial, int serialSizeMax) {
+    char nmbuf[PATH_MAX + 16];
+    char path[PATH_MAX];
+    char *p;
+    int fd;
+
+    serial[0] = '\0';
+    snprintf(nmbuf, sizeof (nmbuf), "/sys/class/scsi_generic/%s/device", driveName);
+    if (!realpath(nmbuf, path)) {
+        snprintf(nmbuf, sizeof (nmbuf), "/sys/block/%s/device", driveName);
+        if (!realpath(nmbuf, path)) {
+            return PSLR_DEVICE_ERROR;
+        }
+    }
+    while ((p = strrchr(path, '/')) && p != path) {
+        snprintf(nmbuf, sizeof (nmbuf), "%s/serial", path);
+        fd = open(nmbuf, O_RDONLY);
+        if (fd != -1) {
+            int length = read(fd, serial, serialSizeMax-1);
+            close(fd);
+            if (length < 0) {
+                length = 0;
+            }
+            while (length > 0 && (serial[length-1] == '\n' || serial[length-1] == ' ')) {
+                --length;
+            }
+            serial[length] = '\0';
+            return length > 0 ? PSLR_OK : PSLR_DEVICE_ERROR;
+        }
+        *p = '\0';
+    }
+    return PSLR_DEVICE_ERROR;
+}
+
 void close_drive(int *hDevice) {
     close( *hDevice );
 }
@@ -230,6 +230,13 @@ pslr_result get_drive_info(char* driveName, int* hDevice,
     return drive_status;
 }
 
+pslr_result get_drive_serial(char* driveName, char* serial, int serialSizeMax)
+{
+  // not available on Windows
+  serial[0] = '\0';
+  return PSLR_DEVICE_ERROR;
+}
+
 void close_drive(int *hDevice)
 {
   CloseHandle((HANDLE)*hDevice);
@@ -0,0 +1,449 @@
+/*
+    pkTriggerCord
+    Copyright (C) 2011-2016 Andras Salamon <andras.salamon@melda.info>
+    Remote control of Pentax DSLR cameras.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    and GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+
+#include "pslr_tiff.h"
+
+#define TIFF_SHORT     3
+#define TIFF_LONG      4
+#define TIFF_RATIONAL  5
+#define TIFF_SRATIONAL 10
+#define TIFF_IFD       13
+
+#define TAG_NEW_SUBFILE_TYPE  0x00fe
+#define TAG_COMPRESSION       0x0103
+#define TAG_MAKE              0x010f
+#define TAG_MODEL             0x0110
+#define TAG_STRIP_OFFSETS     0x0111
+#define TAG_ORIENTATION       0x0112
+#define TAG_STRIP_BYTE_COUNTS 0x0117
+#define TAG_DATETIME          0x0132
+#define TAG_SUB_IFDS          0x014a
+#define TAG_JPEG_OFFSET       0x0201
+#define TAG_JPEG_LENGTH       0x0202
+#define TAG_EXIF_IFD          0x8769
+#define TAG_EXPOSURE_TIME     0x829a
+#define TAG_FNUMBER           0x829d
+#define TAG_ISO               0x8827
+#define TAG_DATETIME_ORIGINAL 0x9003
+#define TAG_EXPOSURE_BIAS     0x9204
+#define TAG_FOCAL_LENGTH      0x920a
+#define TAG_PIXEL_X           0xa002
+#define TAG_PIXEL_Y           0xa003
+
+#define MAX_IFD_ENTRIES 512
+#define MAX_IFD_DEPTH   4
+#define MAX_IFD_CHAIN   8
+
+#define COMPRESSION_OJPEG 6
+#define COMPRESSION_JPEG  7
+
+typedef struct {
+    uint8_t *buf;                    // start of the TIFF header
+    uint32_t length;
+    get_uint16_func get_uint16;
+    get_uint32_func get_uint32;
+} tiff_t;
+
+typedef struct {
+    uint16_t tag;
+    uint16_t type;
+    uint32_t count;
+    uint32_t value_offset;           // offset of the value inside the TIFF data
+} tiff_entry_t;
+
+static int tiff_type_size( uint16_t type ) {
+    switch( type ) {
+    case 3: case 8:
+	return 2;
+    case 4: case 9: case 11: case 13:
+	return 4;
+    case 5: case 10: case 12:
+	return 8;
+    default:
+	return 1;
+    }
+}
+
+/* Returns the TIFF header offset for TIFF files (PEF, DNG) and for
+ * JPEG files having an Exif APP1 segment, -1 otherwise */
+static int tiff_find_header( uint8_t *buf, uint32_t length ) {
+    uint32_t pos;
+    if( length < 8 ) {
+	return -1;
+    }
+    if( (buf[0] == 'I' && buf[1] == 'I') || (buf[0] == 'M' && buf[1] == 'M') ) {
+	return 0;
+    }
+    if( buf[0] != 0xff || buf[1] != 0xd8 ) {
+	return -1;
+    }
+    pos = 2;
+    while( pos + 4 <= length && buf[pos] == 0xff ) {
+	uint8_t marker = buf[pos+1];
+	uint32_t seglen = get_uint16_be( &buf[pos+2] );
+	if( marker == 0xda ) {
+	    // start of scan, no more metadata
+	    break;
+	}
+	if( marker == 0xe1 && pos + 10 <= length && !memcmp( &buf[pos+4], "Exif\0\0", 6) ) {
+	    return pos + 10;
+	}
+	pos += 2 + seglen;
+    }
+    return -1;
+}
+
+static int tiff_init( tiff_t *t, uint8_t *buf, uint32_t length ) {
+    int start = tiff_find_header( buf, length );
+    if( start < 0 || start + 8 > length ) {
+	return PSLR_READ_ERROR;
+    }
+    t->buf = buf + start;
+    t->length = length - start;
+    if( t->buf[0] == 'I' && t->buf[1] == 'I' ) {
+	t->get_uint16 = get_uint16_le;
+	t->get_uint32 = get_uint32_le;
+    } else if( t->buf[0] == 'M' && t->buf[1] == 'M' ) {
+	t->get_uint16 = get_uint16_be;
+	t->get_uint32 = get_uint32_be;
+    } else {
+	return PSLR_READ_ERROR;
+    }
+    if( t->get_uint16( &t->buf[2] ) != 42 ) {
+	return PSLR_READ_ERROR;
+    }
+    return PSLR_OK;
+}
+
+/* Number of entries of the IFD, 0 if the IFD is not inside the data */
+static int tiff_ifd_entries( tiff_t *t, uint32_t ifd ) {
+    int n;
+    if( ifd == 0 || (uint64_t) ifd + 2 > t->length ) {
+	return 0;
+    }
+    n = t->get_uint16( &t->buf[ifd] );
+    if( n > MAX_IFD_ENTRIES ) {
+	return 0;
+    }
+    if( (uint64_t) ifd + 2 + 12 * n > t->length ) {
+	// truncated prefix, use the entries we have
+	n = (t->length - ifd - 2) / 12;
+    }
+    return n;
+}
+
+static void tiff_ifd_entry( tiff_t *t, uint32_t ifd, int index, tiff_entry_t *e ) {
+    uint8_t *p = &t->buf[ifd + 2 + 12 * index];
+    e->tag = t->get_uint16( p );
+    e->type = t->get_uint16( p+2 );
+    e->count = t->get_uint32( p+4 );
+    if( (uint64_t) e->count * tiff_type_size( e->type ) <= 4 ) {
+	e->value_offset = ifd + 2 + 12 * index + 8;
+    } else {
+	e->value_offset = t->get_uint32( p+8 );
+    }
+}
+
+static bool tiff_entry_available( tiff_t *t, tiff_entry_t *e ) {
+    uint64_t size = (uint64_t) e->count * tiff_type_size( e->type );
+    return (uint64_t) e->value_offset + size <= t->length;
+}
+
+static uint32_t tiff_get_uint( tiff_t *t, tiff_entry_t *e ) {
+    if( !tiff_entry_available( t, e ) ) {
+	return 0;
+    }
+    if( e->type == TIFF_SHORT ) {
+	return t->get_uint16( &t->buf[e->value_offset] );
+    }
+    return t->get_uint32( &t->buf[e->value_offset] );
+}
+
+static pslr_rational_t tiff_get_rational( tiff_t *t, tiff_entry_t *e ) {
+    pslr_rational_t r = {0, 0};
+    if( (e->type == TIFF_RATIONAL || e->type == TIFF_SRATIONAL) && tiff_entry_available( t, e ) ) {
+	r.nom = t->get_uint32( &t->buf[e->value_offset] );
+	r.denom = t->get_uint32( &t->buf[e->value_offset+4] );
+    }
+    return r;
+}
+
+static void tiff_get_string( tiff_t *t, tiff_entry_t *e, char *str, uint32_t size ) {
+    uint32_t len = e->count < size ? e->count : size - 1;
+    str[0] = '\0';
+    if( (uint64_t) e->value_offset + len > t->length ) {
+	return;
+    }
+    memcpy( str, &t->buf[e->value_offset], len );
+    str[len] = '\0';
+}
+
+static void tiff_parse_exif( tiff_t *t, uint32_t ifd, pslr_image_metadata_t *meta ) {
+    tiff_entry_t e;
+    int n = tiff_ifd_entries( t, ifd );
+    int i;
+    for( i = 0; i < n; ++i ) {
+	tiff_ifd_entry( t, ifd, i, &e );
+	switch( e.tag ) {
+	case TAG_EXPOSURE_TIME:
+	    meta->exposure_time = tiff_get_rational( t, &e );
+	    break;
+	case TAG_FNUMBER:
+	    meta->fnumber = tiff_get_rational( t, &e );
+	    break;
+	case TAG_ISO:
+	    meta->iso = tiff_get_uint( t, &e );
+	    break;
+	case TAG_DATETIME_ORIGINAL:
+	    tiff_get_string( t, &e, meta->datetime_original, sizeof(meta->datetime_original) );
+	    break;
+	case TAG_EXPOSURE_BIAS:
+	    meta->exposure_bias = tiff_get_rational( t, &e );
+	    break;
+	case TAG_FOCAL_LENGTH:
+	    meta->focal_length = tiff_get_rational( t, &e );
+	    break;
+	case TAG_PIXEL_X:
+	    meta->width = tiff_get_uint( t, &e );
+	    break;
+	case TAG_PIXEL_Y:
+	    meta->height = tiff_get_uint( t, &e );
+	    break;
+	}
+    }
+}
+
+/* Parse IFD0 and the EXIF IFD of a TIFF based raw file or of an Exif
+ * jpeg. buf can be just the first part of the file; tags pointing
+ * outside of it are left empty. */
+int pslr_tiff_parse_metadata(uint8_t *buf, uint32_t length, pslr_image_metadata_t *meta) {
+    tiff_t t;
+    tiff_entry_t e;
+    uint32_t ifd0;
+    int n;
+    int i;
+
+    memset( meta, 0, sizeof(pslr_image_metadata_t) );
+    if( tiff_init( &t, buf, length ) != PSLR_OK ) {
+	DPRINT("\tNo TIFF header found\n");
+	return PSLR_READ_ERROR;
+    }
+    ifd0 = t.get_uint32( &t.buf[4] );
+    n = tiff_ifd_entries( &t, ifd0 );
+    if( n == 0 ) {
+	DPRINT("\tIFD0 (0x%x) is not in the first %d bytes\n", ifd0, length);
+	return PSLR_READ_ERROR;
+    }
+    for( i = 0; i < n; ++i ) {
+	tiff_ifd_entry( &t, ifd0, i, &e );
+	switch( e.tag ) {
+	case TAG_MAKE:
+	    tiff_get_string( &t, &e, meta->make, sizeof(meta->make) );
+	    break;
+	case TAG_MODEL:
+	    tiff_get_string( &t, &e, meta->model, sizeof(meta->model) );
+	    break;
+	case TAG_ORIENTATION:
+	    meta->orientation = tiff_get_uint( &t, &e );
+	    break;
+	case TAG_DATETIME:
+	    tiff_get_string( &t, &e, meta->datetime, sizeof(meta->datetime) );
+	    break;
+	case TAG_EXIF_IFD:
+	    tiff_parse_exif( &t, tiff_get_uint( &t, &e ), meta );
+	    break;
+	}
+    }
+    return PSLR_OK;
+}
+
+/* Remember the largest jpeg found in the IFD or in its SubIFDs: either
+ * a JpgFromRaw / PreviewImage (JPEGInterchangeFormat) or a reduced
+ * resolution image stored as a single jpeg strip (DNG). */
+static void tiff_find_preview( tiff_t *t, uint32_t ifd, int depth, uint32_t *offset, uint32_t *length ) {
+    tiff_entry_t e;
+    uint32_t jpeg_offset = 0, jpeg_length = 0;
+    uint32_t strip_offset = 0, strip_length = 0;
+    uint32_t compression = 0, subfile_type = 0;
+    int n = tiff_ifd_entries( t, ifd );
+    int i;
+    uint32_t k;
+
+    for( i = 0; i < n; ++i ) {
+	tiff_ifd_entry( t, ifd, i, &e );
+	switch( e.tag ) {
+	case TAG_NEW_SUBFILE_TYPE:
+	    subfile_type = tiff_get_uint( t, &e );
+	    break;
+	case TAG_COMPRESSION:
+	    compression = tiff_get_uint( t, &e );
+	    break;
+	case TAG_STRIP_OFFSETS:
+	    if( e.count == 1 ) {
+		strip_offset = tiff_get_uint( t, &e );
+	    }
+	    break;
+	case TAG_STRIP_BYTE_COUNTS:
+	    if( e.count == 1 ) {
+		strip_length = tiff_get_uint( t, &e );
+	    }
+	    break;
+	case TAG_JPEG_OFFSET:
+	    jpeg_offset = tiff_get_uint( t, &e );
+	    break;
+	case TAG_JPEG_LENGTH:
+	    jpeg_length = tiff_get_uint( t, &e );
+	    break;
+	case TAG_SUB_IFDS:
+	    // the offsets are read as 4 byte values
+	    if( depth < MAX_IFD_DEPTH && (e.type == TIFF_LONG || e.type == TIFF_IFD) &&
+		tiff_entry_available( t, &e ) ) {
+		for( k = 0; k < e.count; ++k ) {
+		    tiff_find_preview( t, t->get_uint32( &t->buf[e.value_offset + 4*k] ), depth+1, offset, length );
+		}
+	    }
+	    break;
+	}
+    }
+    if( jpeg_offset && jpeg_length > *length ) {
+	*offset = jpeg_offset;
+	*length = jpeg_length;
+    }
+    if( (compression == COMPRESSION_JPEG || compression == COMPRESSION_OJPEG) && (subfile_type & 1) &&
+	strip_offset && strip_length > *length ) {
+	*offset = strip_offset;
+	*length = strip_length;
+    }
+}
+
+/* Look for the embedded jpeg in the IFD chain starting at IFD0 */
+static int tiff_find_preview_in_chain( uint8_t *buf, uint32_t length, uint32_t *offset, uint32_t *size ) {
+    tiff_t t;
+    uint32_t ifd;
+    int i;
+    int n;
+
+    *offset = 0;
+    *size = 0;
+    // previews inside a jpeg are not interesting
+    if( tiff_find_header( buf, length ) != 0 || tiff_init( &t, buf, length ) != PSLR_OK ) {
+	return PSLR_READ_ERROR;
+    }
+    ifd = t.get_uint32( &t.buf[4] );
+    for( i = 0; i < MAX_IFD_CHAIN && (n = tiff_ifd_entries( &t, ifd )) > 0; ++i ) {
+	tiff_find_preview( &t, ifd, 0, offset, size );
+	if( (uint64_t) ifd + 2 + 12 * n + 4 > t.length ) {
+	    break;
+	}
+	ifd = t.get_uint32( &t.buf[ifd + 2 + 12 * n] );
+    }
+    return *size ? PSLR_OK : PSLR_READ_ERROR;
+}
+
+void pslr_preview_extractor_init(pslr_preview_extractor_t *x,
+                                 pslr_buffer_sink_t sink, uintptr_t sink_data,
+                                 pslr_buffer_sink_t preview, uintptr_t preview_data) {
+    memset( x, 0, sizeof(pslr_preview_extractor_t) );
+    x->sink = sink;
+    x->sink_data = sink_data;
+    x->preview = preview;
+    x->preview_data = preview_data;
+    x->state = PSLR_PREVIEW_HEADER;
+}
+
+/* Forwards the target of the wrapped sink */
+uint8_t *pslr_preview_extractor_target(uint32_t total, uintptr_t user_data) {
+    pslr_preview_extractor_t *x = (pslr_preview_extractor_t *) user_data;
+    return x->target ? x->target( total, x->sink_data ) : NULL;
+}
+
+void pslr_preview_extractor_free(pslr_preview_extractor_t *x) {
+    free( x->header );
+    x->header = NULL;
+}
+
+/* Pass the part of the file block [offset, offset+length) that
+ * overlaps the embedded jpeg to the preview sink */
+static void extractor_emit( pslr_preview_extractor_t *x, uint8_t *buf, uint32_t length, uint32_t offset ) {
+    uint64_t start = x->preview_offset;
+    uint64_t end = start + x->preview_length;
+    uint64_t from = offset > start ? offset : start;
+    uint64_t to = offset + (uint64_t) length < end ? offset + (uint64_t) length : end;
+
+    if( from >= to ) {
+	return;
+    }
+    if( x->preview( buf + (from - offset), to - from, from - start, x->preview_length, x->preview_data ) != PSLR_OK ) {
+	DPRINT("\tpreview sink failed, stop extracting\n");
+	x->state = PSLR_PREVIEW_NONE;
+    }
+}
+
+int pslr_preview_extractor_sink(uint8_t *buf, uint32_t length, uint32_t offset, uint32_t total,
+                                uintptr_t user_data) {
+    pslr_preview_extractor_t *x = (pslr_preview_extractor_t *) user_data;
+    uint32_t window = total < PSLR_METADATA_PREFIX_SIZE ? total : PSLR_METADATA_PREFIX_SIZE;
+    uint32_t copy;
+    int ret;
+
+    ret = x->sink( buf, length, offset, total, x->sink_data );
+    if( ret != PSLR_OK ) {
+	return ret;
+    }
+
+    if( x->state == PSLR_PREVIEW_HEADER ) {
+	if( offset != x->header_length ) {
+	    x->state = PSLR_PREVIEW_NONE;
+	    return PSLR_OK;
+	}
+	if( !x->header ) {
+	    x->header = malloc( window );
+	    if( !x->header ) {
+		x->state = PSLR_PREVIEW_NONE;
+		return PSLR_OK;
+	    }
+	}
+	copy = window - x->header_length < length ? window - x->header_length : length;
+	memcpy( x->header + x->header_length, buf, copy );
+	x->header_length += copy;
+	if( x->header_length < window ) {
+	    return PSLR_OK;
+	}
+	if( tiff_find_preview_in_chain( x->header, x->header_length, &x->preview_offset, &x->preview_length ) != PSLR_OK ||
+	    (uint64_t) x->preview_offset + x->preview_length > total ) {
+	    DPRINT("\tNo embedded jpeg found\n");
+	    x->state = PSLR_PREVIEW_NONE;
+	} else {
+	    DPRINT("\tEmbedded jpeg at 0x%x, %d bytes\n", x->preview_offset, x->preview_length);
+	    x->state = PSLR_PREVIEW_FOUND;
+	    // the part of the jpeg that arrived with the header
+	    extractor_emit( x, x->header, x->header_length, 0 );
+	    if( x->state == PSLR_PREVIEW_FOUND ) {
+		extractor_emit( x, buf + copy, length - copy, offset + copy );
+	    }
+	}
+	pslr_preview_extractor_free( x );
+    } else if( x->state == PSLR_PREVIEW_FOUND ) {
+	extractor_emit( x, buf, length, offset );
+    }
+    return PSLR_OK;
+}
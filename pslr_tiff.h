@@ -0,0 +1,87 @@
+/*
+    pkTriggerCord
+    Copyright (C) 2011-2016 Andras Salamon <andras.salamon@melda.info>
+    Remote control of Pentax DSLR cameras.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    and GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef PSLR_TIFF_H
+#define PSLR_TIFF_H
+
+#include "pslr_model.h"
+
+/* Receives the downloaded data block by block. offset is the position
+ * of buf inside the image, total is the full image size. A non-zero
+ * return value aborts the transfer. */
+typedef int (*pslr_buffer_sink_t)(uint8_t *buf, uint32_t length, uint32_t offset,
+                                  uint32_t total, uintptr_t user_data);
+
+/* Returns memory for the whole image (total bytes), the data is then
+ * downloaded straight into it and the sink is called with buf
+ * pointing into this memory. NULL falls back to a transfer buffer. */
+typedef uint8_t *(*pslr_buffer_target_t)(uint32_t total, uintptr_t user_data);
+
+// default prefix size for metadata only downloads
+#define PSLR_METADATA_PREFIX_SIZE 65536
+
+typedef struct {
+    char make[32];
+    char model[32];
+    char datetime[20];               // YYYY:MM:DD HH:MM:SS
+    char datetime_original[20];
+    uint32_t orientation;
+    uint32_t width;
+    uint32_t height;
+    uint32_t iso;
+    pslr_rational_t exposure_time;
+    pslr_rational_t fnumber;
+    pslr_rational_t exposure_bias;
+    pslr_rational_t focal_length;
+} pslr_image_metadata_t;
+
+int pslr_tiff_parse_metadata(uint8_t *buf, uint32_t length, pslr_image_metadata_t *meta);
+
+/* Streaming extraction of the embedded jpeg of a PEF or DNG file. The
+ * extractor is a buffer sink: the file is passed on to sink, and the
+ * embedded jpeg is passed to preview as soon as its bytes arrive.
+ * Blocks have to arrive in order. */
+typedef enum {
+    PSLR_PREVIEW_HEADER,             // collecting the header
+    PSLR_PREVIEW_FOUND,
+    PSLR_PREVIEW_NONE
+} pslr_preview_state_t;
+
+typedef struct {
+    pslr_buffer_sink_t sink;
+    uintptr_t sink_data;
+    pslr_buffer_sink_t preview;
+    uintptr_t preview_data;
+    pslr_buffer_target_t target;     // optional, called with sink_data
+    pslr_preview_state_t state;
+    uint8_t *header;
+    uint32_t header_length;
+    uint32_t preview_offset;         // offset of the jpeg in the file
+    uint32_t preview_length;
+} pslr_preview_extractor_t;
+
+void pslr_preview_extractor_init(pslr_preview_extractor_t *x,
+                                 pslr_buffer_sink_t sink, uintptr_t sink_data,
+                                 pslr_buffer_sink_t preview, uintptr_t preview_data);
+int pslr_preview_extractor_sink(uint8_t *buf, uint32_t length, uint32_t offset, uint32_t total,
+                                uintptr_t user_data);
+uint8_t *pslr_preview_extractor_target(uint32_t total, uintptr_t user_data);
+void pslr_preview_extractor_free(pslr_preview_extractor_t *x);
+
+#endif